@@ -0,0 +1,567 @@
+/**
+ * Copyright (C) 2016 flexVDI (Flexible Software Solutions S.L.)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "glue-audio.h"
+
+/* Size of the playback ring. It must hold several times the maximum latency. */
+#define PLAYBACK_RING_MS 2000
+#define DEFAULT_TARGET_MS 60
+#define DEFAULT_MAX_LATENCY_MS 400
+/* On an underrun, the target grows by TARGET_STEP_MS. After TARGET_DECAY_US
+ * without underruns, it goes back TARGET_STEP_MS / 2. */
+#define TARGET_STEP_MS 20
+#define TARGET_DECAY_US (10 * G_USEC_PER_SEC)
+
+static int audioMode = GLUE_AUDIO_MODE_NATIVE;
+
+/*
+ * Playback jitter buffer. Written in the glib mainloop thread, read from the
+ * client program audio thread.
+ *
+ * Reads only start when the buffer holds targetMs of audio, and start again
+ * after an underrun. When it holds more than twice the target, the oldest
+ * data is dropped, so that latency stays bounded when the server sends bursts.
+ */
+static struct {
+    GMutex mutex;
+    SpicePlaybackChannel *channel;
+    gboolean playing;
+    gboolean buffering;
+    gint frequency;
+    gint channels;
+    gsize frameSize;
+    guint8 *ring;
+    gsize capacity;
+    gsize readPos;
+    gsize fill;
+    gint baseTargetMs;
+    gint maxLatencyMs;
+    gboolean adaptive;
+    gint targetMs;
+    gint64 lastAdjustment;
+    SpiceGlibGlueAudioStats stats;
+    gint64 latencySum;
+    gint64 latencyCount;
+} playback = {
+    .baseTargetMs = DEFAULT_TARGET_MS,
+    .maxLatencyMs = DEFAULT_MAX_LATENCY_MS,
+    .adaptive = TRUE,
+};
+
+int glue_audio_get_mode(void)
+{
+    return audioMode;
+}
+
+void SpiceGlibGlue_SetAudioMode(int32_t mode)
+{
+    SPICE_DEBUG("Audio mode set to %d", mode);
+    audioMode = mode == GLUE_AUDIO_MODE_HOST ? GLUE_AUDIO_MODE_HOST : GLUE_AUDIO_MODE_NATIVE;
+}
+
+void SpiceGlibGlue_SetAudioLatency(int32_t targetMs, int32_t maxLatencyMs, int32_t adaptive)
+{
+    SPICE_DEBUG("Audio latency set to %d ms (max %d ms, adaptive %d)",
+                targetMs, maxLatencyMs, adaptive);
+    g_mutex_lock(&playback.mutex);
+    playback.baseTargetMs = CLAMP(targetMs, 10, PLAYBACK_RING_MS / 4);
+    playback.maxLatencyMs = CLAMP(maxLatencyMs, playback.baseTargetMs, PLAYBACK_RING_MS / 4);
+    playback.adaptive = adaptive;
+    playback.targetMs = playback.baseTargetMs;
+    g_mutex_unlock(&playback.mutex);
+}
+
+/* Must be called with playback.mutex held. */
+static gsize ms_to_bytes(gint ms)
+{
+    return (gsize)playback.frequency * ms / 1000 * playback.frameSize;
+}
+
+/* Must be called with playback.mutex held. */
+static gint bytes_to_ms(gsize bytes)
+{
+    return playback.frameSize ? bytes / playback.frameSize * 1000 / playback.frequency : 0;
+}
+
+/* Must be called with playback.mutex held. */
+static void drop_oldest(gsize bytes)
+{
+    bytes = MIN(bytes, playback.fill);
+    playback.readPos = (playback.readPos + bytes) % playback.capacity;
+    playback.fill -= bytes;
+}
+
+void glue_audio_playback_start(gint channels, gint frequency)
+{
+    g_mutex_lock(&playback.mutex);
+    playback.frequency = frequency;
+    playback.channels = channels;
+    playback.frameSize = channels * sizeof(int16_t);
+    g_free(playback.ring);
+    playback.capacity = ms_to_bytes(PLAYBACK_RING_MS);
+    playback.ring = g_malloc(playback.capacity);
+    playback.readPos = playback.fill = 0;
+    playback.targetMs = playback.baseTargetMs;
+    playback.lastAdjustment = g_get_monotonic_time();
+    playback.buffering = TRUE;
+    playback.playing = TRUE;
+    g_mutex_unlock(&playback.mutex);
+}
+
+void glue_audio_playback_write(const guint8 *pcm, gint size)
+{
+    gsize writePos, chunk;
+
+    g_mutex_lock(&playback.mutex);
+    if (!playback.playing || size <= 0) {
+        g_mutex_unlock(&playback.mutex);
+        return;
+    }
+
+    if (size > playback.capacity) {
+        pcm += size - playback.capacity;
+        size = playback.capacity;
+    }
+    if (playback.fill + size > playback.capacity) {
+        drop_oldest(playback.fill + size - playback.capacity);
+        playback.stats.overruns++;
+    }
+
+    writePos = (playback.readPos + playback.fill) % playback.capacity;
+    chunk = MIN(size, playback.capacity - writePos);
+    memcpy(playback.ring + writePos, pcm, chunk);
+    memcpy(playback.ring, pcm + chunk, size - chunk);
+    playback.fill += size;
+
+    if (!playback.buffering && playback.fill > ms_to_bytes(playback.targetMs * 2)) {
+        // Too much latency, the server sent a burst or we are draining too slowly
+        drop_oldest(playback.fill - ms_to_bytes(playback.targetMs));
+        playback.stats.overruns++;
+        SPICE_DEBUG("Playback latency over %d ms, dropped audio", playback.targetMs * 2);
+    }
+    g_mutex_unlock(&playback.mutex);
+}
+
+void glue_audio_playback_stop(void)
+{
+    g_mutex_lock(&playback.mutex);
+    playback.playing = FALSE;
+    playback.fill = 0;
+    g_mutex_unlock(&playback.mutex);
+}
+
+static void playback_start(SpicePlaybackChannel *channel, gint format, gint channels,
+                           gint frequency, gpointer data)
+{
+    SPICE_DEBUG("Playback start: format %d, %d channels, %d Hz", format, channels, frequency);
+    if (format != SPICE_AUDIO_FMT_S16) {
+        g_warning("Unsupported playback format %d", format);
+        return;
+    }
+    glue_audio_playback_start(channels, frequency);
+}
+
+static void playback_data(SpicePlaybackChannel *channel, gpointer data, gint size,
+                          gpointer user_data)
+{
+    glue_audio_playback_write(data, size);
+}
+
+static void playback_get_delay(SpicePlaybackChannel *channel, gpointer data)
+{
+    gint delay;
+
+    g_mutex_lock(&playback.mutex);
+    delay = bytes_to_ms(playback.fill);
+    g_mutex_unlock(&playback.mutex);
+    spice_playback_channel_set_delay(channel, delay);
+}
+
+static void playback_stop(SpicePlaybackChannel *channel, gpointer data)
+{
+    SPICE_DEBUG("Playback stop");
+    glue_audio_playback_stop();
+}
+
+void glue_audio_connect_playback(SpicePlaybackChannel *channel)
+{
+    SPICE_DEBUG("Playback handled by the client program");
+    playback.channel = channel;
+    g_signal_connect(channel, "playback-start", G_CALLBACK(playback_start), NULL);
+    g_signal_connect(channel, "playback-data", G_CALLBACK(playback_data), NULL);
+    g_signal_connect(channel, "playback-get-delay", G_CALLBACK(playback_get_delay), NULL);
+    g_signal_connect(channel, "playback-stop", G_CALLBACK(playback_stop), NULL);
+}
+
+void glue_audio_disconnect_playback(SpicePlaybackChannel *channel)
+{
+    if (playback.channel != channel)
+        return;
+    g_signal_handlers_disconnect_by_func(channel, playback_start, NULL);
+    g_signal_handlers_disconnect_by_func(channel, playback_data, NULL);
+    g_signal_handlers_disconnect_by_func(channel, playback_get_delay, NULL);
+    g_signal_handlers_disconnect_by_func(channel, playback_stop, NULL);
+    playback_stop(channel, NULL);
+    playback.channel = NULL;
+}
+
+int32_t SpiceGlibGlue_GetAudioFormat(int32_t *frequency, int32_t *channels)
+{
+    int32_t playing;
+
+    g_mutex_lock(&playback.mutex);
+    playing = playback.playing;
+    *frequency = playback.frequency;
+    *channels = playback.channels;
+    g_mutex_unlock(&playback.mutex);
+    return playing;
+}
+
+int32_t glue_audio_playback_read(int16_t *buffer, int32_t frames, gint64 now)
+{
+    guint8 *out = (guint8 *)buffer;
+    gsize size, available, chunk;
+    gint latency;
+
+    g_mutex_lock(&playback.mutex);
+    if (!playback.playing || frames <= 0) {
+        g_mutex_unlock(&playback.mutex);
+        return 0;
+    }
+
+    size = frames * playback.frameSize;
+    latency = bytes_to_ms(playback.fill);
+    playback.latencySum += latency;
+    playback.latencyCount++;
+    playback.stats.maxLatencyMs = MAX(playback.stats.maxLatencyMs, latency);
+
+    if (playback.buffering && playback.fill >= ms_to_bytes(playback.targetMs)) {
+        playback.buffering = FALSE;
+    }
+
+    available = playback.buffering ? 0 : MIN(size, playback.fill);
+    chunk = MIN(available, playback.capacity - playback.readPos);
+    memcpy(out, playback.ring + playback.readPos, chunk);
+    memcpy(out + chunk, playback.ring, available - chunk);
+    drop_oldest(available);
+    memset(out + available, 0, size - available);
+
+    if (!playback.buffering && available < size) {
+        playback.stats.underruns++;
+        playback.buffering = TRUE;
+        if (playback.adaptive && playback.targetMs < playback.maxLatencyMs) {
+            playback.targetMs = MIN(playback.targetMs + TARGET_STEP_MS, playback.maxLatencyMs);
+            SPICE_DEBUG("Playback underrun, target latency raised to %d ms", playback.targetMs);
+        }
+        playback.lastAdjustment = now;
+    } else if (playback.targetMs > playback.baseTargetMs &&
+               now - playback.lastAdjustment > TARGET_DECAY_US) {
+        playback.targetMs = MAX(playback.targetMs - TARGET_STEP_MS / 2, playback.baseTargetMs);
+        playback.lastAdjustment = now;
+    }
+    g_mutex_unlock(&playback.mutex);
+
+    return frames;
+}
+
+int32_t SpiceGlibGlue_ReadAudio(int16_t *buffer, int32_t frames)
+{
+    return glue_audio_playback_read(buffer, frames, g_get_monotonic_time());
+}
+
+void SpiceGlibGlue_GetAudioStats(SpiceGlibGlueAudioStats *stats)
+{
+    g_mutex_lock(&playback.mutex);
+    *stats = playback.stats;
+    stats->bufferedMs = bytes_to_ms(playback.fill);
+    stats->targetMs = playback.targetMs ? playback.targetMs : playback.baseTargetMs;
+    stats->avgLatencyMs = playback.latencyCount ?
+        playback.latencySum / playback.latencyCount : 0;
+    g_mutex_unlock(&playback.mutex);
+}
+
+/*
+ * Record (microphone). The client program pushes captured PCM into a lock-free
+ * single producer, single consumer ring, and a timer in the glib mainloop sends
+ * it to the server in packets of frameMs milliseconds, converting it to the
+ * format requested by the server if needed.
+ *
+ * The ring positions are free-running counters: the producer only writes head,
+ * and the consumer only writes tail. Each write also leaves a marker with its
+ * end position and capture time, to measure the capture-to-send latency.
+ */
+#define RECORD_RING_SIZE (1 << 17)
+#define RECORD_MARKERS 64
+#define DEFAULT_RECORD_FRAME_MS 20
+
+typedef struct {
+    guint endPos;
+    gint64 time;
+} RecordMarker;
+
+static struct {
+    /* Shared between the producer and the consumer */
+    guint8 ring[RECORD_RING_SIZE];
+    volatile gint head;
+    volatile gint tail;
+    RecordMarker markers[RECORD_MARKERS];
+    volatile gint markerHead;
+    volatile gint markerTail;
+    volatile gint recording;
+    volatile gint hostFrequency;   /* Format of the captured audio, 0 if same as server */
+    volatile gint hostChannels;
+    volatile gint droppedFrames;
+
+    /* Only used in the glib mainloop thread */
+    SpiceRecordChannel *channel;
+    gint frequency;                 /* Format requested by the server */
+    gint channels;
+    gint frameMs;
+    guint timer;
+    gint inFrequency;               /* Format of the data in the ring */
+    gint inChannels;
+    gdouble resamplePos;            /* Position of the next output frame, in input frames */
+    gint16 lastFrame[2];            /* Last input frame of the previous batch */
+    GByteArray *pending;            /* Converted audio not sent yet */
+    gint sentFrames;
+    gint64 latencySum;
+    gint64 latencyCount;
+    gint maxLatencyMs;
+} record = {
+    .frameMs = DEFAULT_RECORD_FRAME_MS,
+};
+
+void SpiceGlibGlue_SetRecordFormat(int32_t frequency, int32_t channels)
+{
+    SPICE_DEBUG("Record capture format set to %d Hz, %d channels", frequency, channels);
+    g_atomic_int_set(&record.hostChannels, CLAMP(channels, 0, 2));
+    g_atomic_int_set(&record.hostFrequency, MAX(frequency, 0));
+}
+
+void SpiceGlibGlue_SetRecordFrameMs(int32_t frameMs)
+{
+    record.frameMs = CLAMP(frameMs, 5, 100);
+}
+
+int32_t SpiceGlibGlue_GetRecordFormat(int32_t *frequency, int32_t *channels)
+{
+    *frequency = record.frequency;
+    *channels = record.channels;
+    return g_atomic_int_get(&record.recording);
+}
+
+int32_t SpiceGlibGlue_WriteAudio(const int16_t *pcm, int32_t frames)
+{
+    guint head, tail, size, offset, chunk, markerHead;
+    gint frameSize;
+
+    if (!g_atomic_int_get(&record.recording) || frames <= 0)
+        return 0;
+
+    frameSize = g_atomic_int_get(&record.hostChannels);
+    frameSize = (frameSize ? frameSize : record.channels) * sizeof(int16_t);
+    head = g_atomic_int_get(&record.head);
+    tail = g_atomic_int_get(&record.tail);
+    size = MIN(frames, (RECORD_RING_SIZE - (head - tail)) / frameSize) * frameSize;
+    if (size < frames * frameSize)
+        g_atomic_int_add(&record.droppedFrames, frames - size / frameSize);
+    if (size == 0)
+        return 0;
+
+    offset = head & (RECORD_RING_SIZE - 1);
+    chunk = MIN(size, RECORD_RING_SIZE - offset);
+    memcpy(record.ring + offset, pcm, chunk);
+    memcpy(record.ring, (const guint8 *)pcm + chunk, size - chunk);
+    g_atomic_int_set(&record.head, head + size);
+
+    markerHead = g_atomic_int_get(&record.markerHead);
+    if (markerHead - g_atomic_int_get(&record.markerTail) < RECORD_MARKERS) {
+        RecordMarker *marker = &record.markers[markerHead % RECORD_MARKERS];
+        marker->endPos = head + size;
+        marker->time = g_get_monotonic_time();
+        g_atomic_int_set(&record.markerHead, markerHead + 1);
+    }
+
+    return size / frameSize;
+}
+
+static gint16 input_sample(const gint16 *frame, gint channel)
+{
+    if (record.inChannels == record.channels)
+        return frame[channel];
+    if (record.inChannels == 1)
+        return frame[0];
+    return (frame[0] + frame[1]) / 2;
+}
+
+/* Converts n input frames to the server format, with linear interpolation,
+ * and appends them to record.pending. */
+static void convert_input(const gint16 *in, guint n)
+{
+    gdouble step = (gdouble)record.inFrequency / record.frequency;
+    gdouble pos = record.resamplePos;
+    gint16 out[2];
+    gint c;
+
+    if (record.inFrequency == record.frequency && record.inChannels == record.channels) {
+        g_byte_array_append(record.pending, (const guint8 *)in,
+                            n * record.inChannels * sizeof(gint16));
+        return;
+    }
+
+    /* Input frame -1 is the last frame of the previous batch */
+    while (pos < (gdouble)n - 1) {
+        gint idx = (gint)(pos + 1) - 1;  /* floor, pos >= -1 */
+        gdouble frac = pos - idx;
+        const gint16 *f0 = idx < 0 ? record.lastFrame : in + idx * record.inChannels;
+        const gint16 *f1 = in + (idx + 1) * record.inChannels;
+        for (c = 0; c < record.channels; c++) {
+            out[c] = input_sample(f0, c) * (1 - frac) + input_sample(f1, c) * frac;
+        }
+        g_byte_array_append(record.pending, (const guint8 *)out, record.channels * sizeof(gint16));
+        pos += step;
+    }
+    record.resamplePos = pos - n;
+    memcpy(record.lastFrame, in + (n - 1) * record.inChannels, record.inChannels * sizeof(gint16));
+}
+
+static void account_latency(guint tail)
+{
+    guint markerTail = g_atomic_int_get(&record.markerTail);
+    guint markerHead = g_atomic_int_get(&record.markerHead);
+    gint64 now = g_get_monotonic_time();
+
+    while (markerTail != markerHead &&
+           (gint)(record.markers[markerTail % RECORD_MARKERS].endPos - tail) <= 0) {
+        gint latency = (now - record.markers[markerTail % RECORD_MARKERS].time) / 1000;
+        record.latencySum += latency;
+        record.latencyCount++;
+        record.maxLatencyMs = MAX(record.maxLatencyMs, latency);
+        markerTail++;
+    }
+    g_atomic_int_set(&record.markerTail, markerTail);
+}
+
+static gboolean record_send(gpointer data)
+{
+    guint head = g_atomic_int_get(&record.head);
+    guint tail = g_atomic_int_get(&record.tail);
+    gsize inFrameSize = record.inChannels * sizeof(gint16);
+    gsize outFrameSize = record.channels * sizeof(gint16);
+    gsize packetSize = (gsize)record.frequency * record.frameMs / 1000 * outFrameSize;
+    guint8 batch[RECORD_RING_SIZE / 8];
+
+    /* Convert what the producer has written so far, in pieces */
+    while (head - tail >= inFrameSize) {
+        guint offset = tail & (RECORD_RING_SIZE - 1);
+        guint size = MIN(head - tail, sizeof(batch));
+        guint chunk;
+        size -= size % inFrameSize;
+        chunk = MIN(size, RECORD_RING_SIZE - offset);
+        memcpy(batch, record.ring + offset, chunk);
+        memcpy(batch + chunk, record.ring, size - chunk);
+        tail += size;
+        g_atomic_int_set(&record.tail, tail);
+        convert_input((const gint16 *)batch, size / inFrameSize);
+    }
+
+    if (record.pending->len >= packetSize) {
+        account_latency(tail);
+    }
+    while (record.pending->len >= packetSize) {
+        spice_record_send_data(record.channel, record.pending->data, packetSize, 0);
+        g_byte_array_remove_range(record.pending, 0, packetSize);
+        record.sentFrames += packetSize / outFrameSize;
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void record_start(SpiceRecordChannel *channel, gint format, gint channels,
+                         gint frequency, gpointer data)
+{
+    gint hostFrequency = g_atomic_int_get(&record.hostFrequency);
+    gint hostChannels = g_atomic_int_get(&record.hostChannels);
+
+    SPICE_DEBUG("Record start: format %d, %d channels, %d Hz", format, channels, frequency);
+    if (format != SPICE_AUDIO_FMT_S16 || channels < 1 || channels > 2) {
+        g_warning("Unsupported record format %d with %d channels", format, channels);
+        return;
+    }
+
+    record.frequency = frequency;
+    record.channels = channels;
+    record.inFrequency = hostFrequency ? hostFrequency : frequency;
+    record.inChannels = hostChannels ? hostChannels : channels;
+    record.resamplePos = 0;
+    memset(record.lastFrame, 0, sizeof(record.lastFrame));
+    if (record.pending == NULL)
+        record.pending = g_byte_array_new();
+    g_byte_array_set_size(record.pending, 0);
+    if (record.inFrequency != frequency || record.inChannels != channels)
+        SPICE_DEBUG("Record converting from %d Hz, %d channels",
+                    record.inFrequency, record.inChannels);
+
+    /* Discard anything captured before */
+    g_atomic_int_set(&record.tail, g_atomic_int_get(&record.head));
+    g_atomic_int_set(&record.markerTail, g_atomic_int_get(&record.markerHead));
+    g_atomic_int_set(&record.recording, TRUE);
+    if (record.timer == 0)
+        record.timer = g_timeout_add(record.frameMs, record_send, NULL);
+}
+
+static void record_stop(SpiceRecordChannel *channel, gpointer data)
+{
+    SPICE_DEBUG("Record stop");
+    g_atomic_int_set(&record.recording, FALSE);
+    if (record.timer) {
+        g_source_remove(record.timer);
+        record.timer = 0;
+    }
+}
+
+void glue_audio_connect_record(SpiceRecordChannel *channel)
+{
+    SPICE_DEBUG("Record handled by the client program");
+    record.channel = channel;
+    g_signal_connect(channel, "record-start", G_CALLBACK(record_start), NULL);
+    g_signal_connect(channel, "record-stop", G_CALLBACK(record_stop), NULL);
+}
+
+void glue_audio_disconnect_record(SpiceRecordChannel *channel)
+{
+    if (record.channel != channel)
+        return;
+    g_signal_handlers_disconnect_by_func(channel, record_start, NULL);
+    g_signal_handlers_disconnect_by_func(channel, record_stop, NULL);
+    record_stop(channel, NULL);
+    record.channel = NULL;
+}
+
+void SpiceGlibGlue_GetRecordStats(SpiceGlibGlueRecordStats *stats)
+{
+    stats->sentFrames = record.sentFrames;
+    stats->droppedFrames = g_atomic_int_get(&record.droppedFrames);
+    stats->avgLatencyMs = record.latencyCount ? record.latencySum / record.latencyCount : 0;
+    stats->maxLatencyMs = record.maxLatencyMs;
+}
@@ -0,0 +1,99 @@
+/**
+ * Copyright (C) 2016 flexVDI (Flexible Software Solutions S.L.)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Audio handled by the client program.
+ *
+ * By default, spice-glib plays audio with its own backend (spice_audio_get).
+ * With SpiceGlibGlue_SetAudioMode(GLUE_AUDIO_MODE_HOST), the glue receives
+ * the playback PCM (signed 16 bit, interleaved) in a jitter buffer instead,
+ * and the client program pulls it from its audio callback. Likewise, the
+ * client program pushes the captured audio for the record channel.
+ */
+
+#ifndef _GLUE_AUDIO_H
+#define _GLUE_AUDIO_H
+
+#include <stdint.h>
+#include "glue-spice-widget.h"
+
+#define GLUE_AUDIO_MODE_NATIVE 0
+#define GLUE_AUDIO_MODE_HOST   1
+
+typedef struct {
+    int32_t underruns;      /* Reads that found less data than requested */
+    int32_t overruns;       /* Writes that dropped old data to bound the latency */
+    int32_t bufferedMs;     /* Audio currently in the jitter buffer */
+    int32_t targetMs;       /* Current (adaptive) target latency */
+    int32_t avgLatencyMs;   /* Average buffered audio seen by reads */
+    int32_t maxLatencyMs;
+} SpiceGlibGlueAudioStats;
+
+typedef struct {
+    int32_t sentFrames;
+    int32_t droppedFrames;  /* Frames discarded because the ring was full */
+    int32_t avgLatencyMs;   /* From SpiceGlibGlue_WriteAudio to sending them */
+    int32_t maxLatencyMs;
+} SpiceGlibGlueRecordStats;
+
+/* Called internally by the connection when audio channels appear and disappear. */
+int glue_audio_get_mode(void);
+void glue_audio_connect_playback(SpicePlaybackChannel *channel);
+void glue_audio_disconnect_playback(SpicePlaybackChannel *channel);
+void glue_audio_connect_record(SpiceRecordChannel *channel);
+void glue_audio_disconnect_record(SpiceRecordChannel *channel);
+
+/* The playback jitter buffer, fed by the playback channel signals and read by
+ * SpiceGlibGlue_ReadAudio, with now as the current monotonic time. */
+void glue_audio_playback_start(gint channels, gint frequency);
+void glue_audio_playback_write(const guint8 *pcm, gint size);
+void glue_audio_playback_stop(void);
+int32_t glue_audio_playback_read(int16_t *buffer, int32_t frames, gint64 now);
+
+/* Selects how playback is done, for the next connection. */
+void SpiceGlibGlue_SetAudioMode(int32_t mode);
+
+/* Target latency of the jitter buffer, in ms. With adaptive set, it grows on
+ * underruns, up to maxLatencyMs, and slowly goes back to targetMs. */
+void SpiceGlibGlue_SetAudioLatency(int32_t targetMs, int32_t maxLatencyMs, int32_t adaptive);
+
+/* Returns 1 and the format of the playback stream if it is playing, 0 otherwise. */
+int32_t SpiceGlibGlue_GetAudioFormat(int32_t *frequency, int32_t *channels);
+
+/* Copies up to frames frames of audio to buffer, filling with silence if there
+ * is not enough. Returns the number of frames written, 0 if not playing. */
+int32_t SpiceGlibGlue_ReadAudio(int16_t *buffer, int32_t frames);
+
+void SpiceGlibGlue_GetAudioStats(SpiceGlibGlueAudioStats *stats);
+
+/* Format of the audio passed to SpiceGlibGlue_WriteAudio, if it is not the
+ * one requested by the server (0 for the same). It is converted when recording starts. */
+void SpiceGlibGlue_SetRecordFormat(int32_t frequency, int32_t channels);
+
+/* Duration of the packets sent to the server, in ms (20 by default). */
+void SpiceGlibGlue_SetRecordFrameMs(int32_t frameMs);
+
+/* Returns 1 and the format requested by the server if it is recording, 0 otherwise. */
+int32_t SpiceGlibGlue_GetRecordFormat(int32_t *frequency, int32_t *channels);
+
+/* Pushes captured audio. It may be called from any single thread, and never blocks.
+ * Returns the number of frames accepted, 0 if not recording. */
+int32_t SpiceGlibGlue_WriteAudio(const int16_t *pcm, int32_t frames);
+
+void SpiceGlibGlue_GetRecordStats(SpiceGlibGlueRecordStats *stats);
+
+#endif /* _GLUE_AUDIO_H */
@@ -0,0 +1,604 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/**
+ * Copyright (C) 2016 flexVDI (Flexible Software Solutions S.L.)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "glue-service.h"
+#include "glib.h"
+#include "glue-spice-widget.h"
+#include "glue-spice-widget-priv.h"
+#include "glue-clipboard-core.h"
+
+#ifdef USE_CLIPBOARD
+
+static gint64 maxClipboardSize = -1;
+static SpiceGlibGlueClipboardProgressCallback progressCallback = NULL;
+static gint timeoutMs = CLIPBOARD_DEFAULT_TIMEOUT;
+
+/* Guest and host clipboard contents. Accessed from both the client program
+ * thread and the glib mainloop thread. */
+static GMutex store_mutex;
+static guint32 guestTypes = 0;  /* Bit mask of types offered by the guest */
+static guint32 guestGeneration = 0;  /* Incremented with every guest grab or release */
+static guint32 guestDataType = VD_AGENT_CLIPBOARD_NONE;
+static guint32 guestDataGeneration = 0;
+static guchar *guestData = NULL;
+static gsize guestDataSize = 0;
+static guchar *hostData[CLIPBOARD_NUM_TYPES];
+static gsize hostDataSize[CLIPBOARD_NUM_TYPES];
+
+void SpiceGlibGlue_SetClipboardMaxSize(int32_t maxSize)
+{
+    SPICE_DEBUG("CB: max clipboard size set to %d", maxSize);
+    maxClipboardSize = maxSize;
+}
+
+void SpiceGlibGlue_SetClipboardProgressCallback(SpiceGlibGlueClipboardProgressCallback cb)
+{
+    progressCallback = cb;
+}
+
+void SpiceGlibGlue_SetClipboardTimeout(int32_t timeout)
+{
+    SPICE_DEBUG("CB: clipboard request timeout set to %d ms", timeout);
+    g_atomic_int_set(&timeoutMs, timeout > 0 ? timeout : CLIPBOARD_DEFAULT_TIMEOUT);
+}
+
+gint clipboard_get_timeout(void)
+{
+    return g_atomic_int_get(&timeoutMs);
+}
+
+void clipboard_stream_init(ClipboardStream *stream, ClipboardEolConversion eol,
+                           gsize expected)
+{
+    gsize reserve = expected;
+
+    /* LF -> CRLF grows the data; reserve some room to avoid most reallocations */
+    if (eol == CLIPBOARD_EOL_TO_DOS)
+        reserve += expected / 16;
+
+    stream->data = g_byte_array_sized_new(reserve + 1);
+    stream->eol = eol;
+    stream->lastWasCr = FALSE;
+    stream->total = 0;
+    stream->expected = expected;
+    stream->overflow = FALSE;
+}
+
+/* CRLF -> LF. A CR at the end of a chunk is held until the next byte is seen. */
+static void write_to_unix(ClipboardStream *stream, const guchar *data, gsize size)
+{
+    const guchar *end = data + size;
+    static const guchar cr = '\r';
+
+    if (stream->lastWasCr && size > 0) {
+        if (*data != '\n')
+            g_byte_array_append(stream->data, &cr, 1);
+        stream->lastWasCr = FALSE;
+    }
+
+    while (data < end) {
+        const guchar *p = memchr(data, '\r', end - data);
+        if (p == NULL) {
+            g_byte_array_append(stream->data, data, end - data);
+            break;
+        }
+        g_byte_array_append(stream->data, data, p - data);
+        if (p + 1 == end) {
+            stream->lastWasCr = TRUE;
+        } else if (p[1] != '\n') {
+            g_byte_array_append(stream->data, &cr, 1);
+        }
+        data = p + 1;
+    }
+}
+
+/* LF -> CRLF, leaving existing CRLF untouched. */
+static void write_to_dos(ClipboardStream *stream, const guchar *data, gsize size)
+{
+    const guchar *end = data + size;
+    static const guchar crlf[2] = { '\r', '\n' };
+
+    while (data < end) {
+        const guchar *p = memchr(data, '\n', end - data);
+        if (p == NULL) {
+            g_byte_array_append(stream->data, data, end - data);
+            stream->lastWasCr = (end[-1] == '\r');
+            break;
+        }
+        g_byte_array_append(stream->data, data, p - data);
+        if ((p > data && p[-1] == '\r') || (p == data && stream->lastWasCr))
+            g_byte_array_append(stream->data, crlf + 1, 1);
+        else
+            g_byte_array_append(stream->data, crlf, 2);
+        stream->lastWasCr = FALSE;
+        data = p + 1;
+    }
+}
+
+gboolean clipboard_stream_write(ClipboardStream *stream, const guchar *data, gsize size)
+{
+    if (stream->overflow)
+        return FALSE;
+
+    stream->total += size;
+    if (maxClipboardSize >= 0 && (gint64)stream->total > maxClipboardSize) {
+        g_warning("CB: discarded clipboard of size %" G_GSIZE_FORMAT " (max: %" G_GINT64_FORMAT ")",
+                  MAX(stream->total, stream->expected), maxClipboardSize);
+        stream->overflow = TRUE;
+        return FALSE;
+    }
+
+    switch (stream->eol) {
+    case CLIPBOARD_EOL_TO_UNIX:
+        write_to_unix(stream, data, size);
+        break;
+    case CLIPBOARD_EOL_TO_DOS:
+        write_to_dos(stream, data, size);
+        break;
+    default:
+        g_byte_array_append(stream->data, data, size);
+        break;
+    }
+
+    if (progressCallback)
+        progressCallback(stream->total, stream->expected ? stream->expected : -1);
+
+    return TRUE;
+}
+
+guchar *clipboard_stream_finish(ClipboardStream *stream, gsize *size)
+{
+    static const guchar tail[2] = { '\r', '\0' };
+
+    if (stream->overflow) {
+        g_byte_array_free(stream->data, TRUE);
+        stream->data = NULL;
+        *size = 0;
+        return NULL;
+    }
+
+    if (stream->eol == CLIPBOARD_EOL_TO_UNIX && stream->lastWasCr)
+        g_byte_array_append(stream->data, tail, 1);
+    *size = stream->data->len;
+    g_byte_array_append(stream->data, tail + 1, 1);
+
+    guchar *result = g_byte_array_free(stream->data, FALSE);
+    stream->data = NULL;
+    return result;
+}
+
+guchar *clipboard_convert(const guchar *data, gsize size,
+                          ClipboardEolConversion eol, gsize *outSize)
+{
+    ClipboardStream stream;
+    gsize offset;
+
+    clipboard_stream_init(&stream, eol, size);
+    for (offset = 0; offset < size; offset += CLIPBOARD_CHUNK_SIZE) {
+        if (!clipboard_stream_write(&stream, data + offset,
+                                    MIN(CLIPBOARD_CHUNK_SIZE, size - offset)))
+            break;
+    }
+    return clipboard_stream_finish(&stream, outSize);
+}
+
+static guint32 read_le16(const guchar *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static guint32 read_le32(const guchar *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((guint32)p[3] << 24);
+}
+
+static void write_le32(guchar *p, guint32 v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+/* Streams size bytes after a header, if any, one chunk at a time. */
+static guchar *convert_with_header(const guchar *header, gsize headerSize,
+                                   const guchar *data, gsize size, gsize *outSize)
+{
+    ClipboardStream stream;
+    gsize offset;
+
+    clipboard_stream_init(&stream, CLIPBOARD_EOL_KEEP, headerSize + size);
+    if (headerSize == 0 || clipboard_stream_write(&stream, header, headerSize)) {
+        for (offset = 0; offset < size; offset += CLIPBOARD_CHUNK_SIZE) {
+            if (!clipboard_stream_write(&stream, data + offset,
+                                        MIN(CLIPBOARD_CHUNK_SIZE, size - offset)))
+                break;
+        }
+    }
+    return clipboard_stream_finish(&stream, outSize);
+}
+
+guchar *clipboard_bmp_to_dib(const guchar *bmp, gsize size, gsize *outSize)
+{
+    *outSize = 0;
+    if (size <= CLIPBOARD_BMP_FILE_HEADER_SIZE || bmp[0] != 'B' || bmp[1] != 'M') {
+        g_warning("CB: invalid BMP image of size %" G_GSIZE_FORMAT, size);
+        return NULL;
+    }
+
+    return convert_with_header(NULL, 0, bmp + CLIPBOARD_BMP_FILE_HEADER_SIZE,
+                               size - CLIPBOARD_BMP_FILE_HEADER_SIZE, outSize);
+}
+
+static gboolean valid_dib_info_size(guint32 infoSize)
+{
+    switch (infoSize) {
+    case 12:    /* BITMAPCOREHEADER */
+    case 40:    /* BITMAPINFOHEADER */
+    case 52:    /* BITMAPV2INFOHEADER */
+    case 56:    /* BITMAPV3INFOHEADER */
+    case 108:   /* BITMAPV4HEADER */
+    case 124:   /* BITMAPV5HEADER */
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+guchar *clipboard_dib_to_bmp(const guchar *dib, gsize size, gsize *outSize)
+{
+    guchar header[CLIPBOARD_BMP_FILE_HEADER_SIZE] = { 'B', 'M' };
+    guint32 infoSize, bitCount, colors = 0, colorSize = 4, masks = 0;
+    guint64 pixelOffset;
+
+    *outSize = 0;
+    infoSize = size >= 4 ? read_le32(dib) : 0;
+    if (!valid_dib_info_size(infoSize) || infoSize > size) {
+        g_warning("CB: invalid DIB image of size %" G_GSIZE_FORMAT, size);
+        return NULL;
+    }
+
+    /* The pixel data starts after the info header, the bitfield masks
+     * and the color table */
+    if (infoSize == 12) {
+        /* BITMAPCOREHEADER */
+        bitCount = read_le16(dib + 10);
+        colorSize = 3;
+    } else {
+        bitCount = read_le16(dib + 14);
+        colors = read_le32(dib + 32);
+        /* With a BITMAPINFOHEADER, the masks follow it; bigger headers include them */
+        if (infoSize == 40 && read_le32(dib + 16) == 3 /* BI_BITFIELDS */)
+            masks = 12;
+        else if (infoSize == 40 && read_le32(dib + 16) == 6 /* BI_ALPHABITFIELDS */)
+            masks = 16;
+    }
+    /* Up to 8 bpp, the table has at most one color per pixel value */
+    if (bitCount >= 1 && bitCount <= 8 && (colors == 0 || colors > 1U << bitCount))
+        colors = 1U << bitCount;
+
+    pixelOffset = (guint64)infoSize + masks + (guint64)colors * colorSize;
+    if (pixelOffset > size) {
+        g_warning("CB: invalid DIB image of size %" G_GSIZE_FORMAT ", %" G_GUINT64_FORMAT
+                  " bytes of headers", size, pixelOffset);
+        return NULL;
+    }
+
+    write_le32(header + 2, CLIPBOARD_BMP_FILE_HEADER_SIZE + size);
+    write_le32(header + 10, CLIPBOARD_BMP_FILE_HEADER_SIZE + pixelOffset);
+
+    return convert_with_header(header, sizeof(header), dib, size, outSize);
+}
+
+SpiceMainChannel *clipboard_get_main_channel(void)
+{
+    SpiceDisplay *display = global_display();
+    if (display == NULL) {
+        return NULL;
+    }
+
+    return SPICE_DISPLAY_GET_PRIVATE(display)->main;
+}
+
+void clipboard_set_guest_types(const guint32 *types, guint32 numTypes)
+{
+    guint32 i, mask = 0;
+
+    for (i = 0; i < numTypes; i++) {
+        if (CLIPBOARD_TYPE_SUPPORTED(types[i]))
+            mask |= 1 << types[i];
+    }
+    g_mutex_lock(&store_mutex);
+    guestTypes = mask;
+    guestGeneration++;
+    g_mutex_unlock(&store_mutex);
+}
+
+gboolean clipboard_guest_has_type(guint32 type)
+{
+    gboolean result;
+
+    if (!CLIPBOARD_TYPE_SUPPORTED(type))
+        return FALSE;
+    g_mutex_lock(&store_mutex);
+    result = (guestTypes & (1 << type)) != 0;
+    g_mutex_unlock(&store_mutex);
+    return result;
+}
+
+int SpiceGlibGlue_GuestClipboardHasType(uint32_t type)
+{
+    return clipboard_guest_has_type(type);
+}
+
+/*
+ * Requests to the guest. They are only accessed from the glib mainloop thread.
+ * There is at most one request per type sent to the guest at a time; further
+ * requests of the same type wait for the same answer.
+ */
+typedef struct
+{
+    gint32 id;
+    guint32 type;
+    ClipboardRequestCallback cb;
+    gpointer userData;
+    guint timeoutSource;
+} ClipboardRequest;
+
+static GList *pendingRequests = NULL;
+static gint nextRequestId = 1;
+
+static void complete_request(ClipboardRequest *req, const guchar *data, gsize size)
+{
+    pendingRequests = g_list_remove(pendingRequests, req);
+    if (req->timeoutSource)
+        g_source_remove(req->timeoutSource);
+    req->cb(req->id, req->type, data, size, req->userData);
+    g_free(req);
+}
+
+/* Completes the pending requests of type, or all of them if type is NONE. */
+static void complete_requests(guint32 type, const guchar *data, gsize size)
+{
+    GList *l = pendingRequests;
+
+    while (l != NULL) {
+        ClipboardRequest *req = l->data;
+        l = l->next;
+        if (type == VD_AGENT_CLIPBOARD_NONE || req->type == type)
+            complete_request(req, data, size);
+    }
+}
+
+static gboolean request_timeout(gpointer data)
+{
+    ClipboardRequest *req = data;
+
+    g_warning("CB: clipboard request %d of type %d timed out", req->id, req->type);
+    req->timeoutSource = 0;
+    complete_request(req, NULL, 0);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean type_requested(guint32 type)
+{
+    GList *l;
+
+    for (l = pendingRequests; l != NULL; l = l->next) {
+        if (((ClipboardRequest *)l->data)->type == type)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static gboolean start_request(gpointer data)
+{
+    ClipboardRequest *req = data;
+    SpiceMainChannel *main;
+    gboolean cached;
+
+    /* Unchanged guest clipboard: answer from the cache, without a round-trip */
+    g_mutex_lock(&store_mutex);
+    cached = guestData != NULL && guestDataType == req->type &&
+             guestDataGeneration == guestGeneration;
+    g_mutex_unlock(&store_mutex);
+    if (cached) {
+        SPICE_DEBUG("CB: clipboard request %d of type %d served from cache",
+                    req->id, req->type);
+        req->cb(req->id, req->type, guestData, guestDataSize, req->userData);
+        g_free(req);
+        return G_SOURCE_REMOVE;
+    }
+
+    main = clipboard_get_main_channel();
+    if (main == NULL) {
+        req->cb(req->id, req->type, NULL, 0, req->userData);
+        g_free(req);
+        return G_SOURCE_REMOVE;
+    }
+
+    if (!type_requested(req->type)) {
+        spice_main_clipboard_selection_request(main,
+            VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD, req->type);
+    }
+    req->timeoutSource = g_timeout_add(clipboard_get_timeout(), request_timeout, req);
+    pendingRequests = g_list_append(pendingRequests, req);
+
+    return G_SOURCE_REMOVE;
+}
+
+gint32 clipboard_request(guint32 type, ClipboardRequestCallback cb, gpointer userData)
+{
+    ClipboardRequest *req;
+    gint32 id;
+
+    if (!clipboard_guest_has_type(type)) {
+        SPICE_DEBUG("CB: Guest does not offer type %d", type);
+        return -1;
+    }
+
+    req = g_new0(ClipboardRequest, 1);
+    id = req->id = g_atomic_int_add(&nextRequestId, 1);
+    req->type = type;
+    req->cb = cb;
+    req->userData = userData;
+    /* req may be completed and freed in the mainloop before this returns */
+    g_timeout_add_full(G_PRIORITY_HIGH, 0, start_request, req, NULL);
+
+    return id;
+}
+
+static void request_cb(gint32 id, guint32 type, const guchar *data, gsize size,
+                       gpointer userData)
+{
+    SpiceGlibGlueClipboardCallback cb = userData;
+    cb(id, type, (const char *)data, data ? size : -1);
+}
+
+int32_t SpiceGlibGlue_RequestGuestClipboard(uint32_t type, SpiceGlibGlueClipboardCallback cb)
+{
+    if (cb == NULL)
+        return -1;
+    return clipboard_request(type, request_cb, cb);
+}
+
+void clipboard_set_guest_data(guint32 type, guchar *data, gsize size)
+{
+    g_mutex_lock(&store_mutex);
+    g_free(guestData);
+    guestData = data;
+    guestDataSize = data ? size : 0;
+    guestDataType = data ? type : VD_AGENT_CLIPBOARD_NONE;
+    guestDataGeneration = guestGeneration;
+    g_mutex_unlock(&store_mutex);
+    SPICE_DEBUG("CB: guest clipboard holds %" G_GSIZE_FORMAT " bytes of type %d",
+                guestDataSize, type);
+
+    /* guestData is only replaced in this thread, so it can be used unlocked */
+    complete_requests(data ? type : VD_AGENT_CLIPBOARD_NONE, guestData, guestDataSize);
+}
+
+guint32 clipboard_get_host_types(guint32 types[CLIPBOARD_NUM_TYPES])
+{
+    guint32 type, numTypes = 0;
+
+    g_mutex_lock(&store_mutex);
+    for (type = VD_AGENT_CLIPBOARD_UTF8_TEXT; type < CLIPBOARD_NUM_TYPES; type++) {
+        if (hostData[type])
+            types[numTypes++] = type;
+    }
+    g_mutex_unlock(&store_mutex);
+    return numTypes;
+}
+
+guchar *clipboard_convert_host_data(guint32 type, ClipboardEolConversion eol, gsize *size)
+{
+    guchar *data = NULL;
+
+    *size = 0;
+    if (!CLIPBOARD_TYPE_SUPPORTED(type))
+        return NULL;
+    if (type != VD_AGENT_CLIPBOARD_UTF8_TEXT)
+        eol = CLIPBOARD_EOL_KEEP;
+
+    g_mutex_lock(&store_mutex);
+    if (hostData[type])
+        data = clipboard_convert(hostData[type], hostDataSize[type], eol, size);
+    g_mutex_unlock(&store_mutex);
+    return data;
+}
+
+int32_t SpiceGlibGlue_GetGuestClipboardSize(void)
+{
+    int32_t size;
+
+    g_mutex_lock(&store_mutex);
+    size = guestData ? guestDataSize : -1;
+    g_mutex_unlock(&store_mutex);
+    return size;
+}
+
+uint32_t SpiceGlibGlue_GetGuestClipboardType(void)
+{
+    uint32_t type;
+
+    g_mutex_lock(&store_mutex);
+    type = guestDataType;
+    g_mutex_unlock(&store_mutex);
+    return type;
+}
+
+int32_t SpiceGlibGlue_ReadGuestClipboard(char *buffer, int32_t offset, int32_t size)
+{
+    int32_t copied = -1;
+
+    g_mutex_lock(&store_mutex);
+    if (guestData != NULL && offset >= 0 && size >= 0) {
+        copied = offset < guestDataSize ? MIN(size, guestDataSize - offset) : 0;
+        memcpy(buffer, guestData + offset, copied);
+    }
+    g_mutex_unlock(&store_mutex);
+    return copied;
+}
+
+static void set_host_data(guint32 type, const char *data, int32_t size)
+{
+    g_free(hostData[type]);
+    hostData[type] = NULL;
+    hostDataSize[type] = 0;
+    if (data != NULL && size > 0) {
+        /* Keep it NUL terminated, as text is sent to the guest */
+        hostData[type] = g_malloc(size + 1);
+        memcpy(hostData[type], data, size);
+        hostData[type][size] = '\0';
+        hostDataSize[type] = size;
+    }
+    SPICE_DEBUG("CB: host clipboard holds %" G_GSIZE_FORMAT " bytes of type %d",
+                hostDataSize[type], type);
+}
+
+void SpiceGlibGlue_SetHostClipboard(const char *data, int32_t size)
+{
+    guint32 type;
+
+    g_mutex_lock(&store_mutex);
+    for (type = VD_AGENT_CLIPBOARD_UTF8_TEXT; type < CLIPBOARD_NUM_TYPES; type++)
+        set_host_data(type, NULL, 0);
+    set_host_data(VD_AGENT_CLIPBOARD_UTF8_TEXT, data, size);
+    g_mutex_unlock(&store_mutex);
+}
+
+void SpiceGlibGlue_SetHostClipboardType(uint32_t type, const char *data, int32_t size)
+{
+    if (!CLIPBOARD_TYPE_SUPPORTED(type)) {
+        g_warning("CB: unsupported host clipboard type %d", type);
+        return;
+    }
+
+    g_mutex_lock(&store_mutex);
+    set_host_data(type, data, size);
+    g_mutex_unlock(&store_mutex);
+}
+
+#endif
@@ -0,0 +1,161 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/**
+ * Copyright (C) 2016 flexVDI (Flexible Software Solutions S.L.)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Platform independent part of clipboard sharing.
+ *
+ * Clipboard payloads are converted in chunks while they are copied, so the
+ * line-ending conversion and the copy are a single pass, and there is no
+ * size limit other than the one configured by the client program.
+ *
+ * Supported types are utf-8 text, PNG and BMP images. Types are negotiated
+ * lazily: a grab only announces the types, and the data of a type is only
+ * transferred when it is requested.
+ */
+
+#ifdef USE_CLIPBOARD
+#ifndef _GLUE_CLIPBOARD_CORE_H
+#define _GLUE_CLIPBOARD_CORE_H
+
+#include <stdint.h>
+#include "glue-spice-widget.h"
+#include "glue-clipboard.h"
+
+/* Amount of data converted between two progress notifications */
+#define CLIPBOARD_CHUNK_SIZE (64 * 1024)
+
+/* Supported types are VD_AGENT_CLIPBOARD_UTF8_TEXT to VD_AGENT_CLIPBOARD_IMAGE_BMP */
+#define CLIPBOARD_NUM_TYPES (VD_AGENT_CLIPBOARD_IMAGE_BMP + 1)
+#define CLIPBOARD_TYPE_SUPPORTED(type) \
+    ((type) > VD_AGENT_CLIPBOARD_NONE && (type) < CLIPBOARD_NUM_TYPES)
+
+/* Default time to wait for the guest to send the clipboard, in milliseconds */
+#define CLIPBOARD_DEFAULT_TIMEOUT 10000
+
+/* Size of the BITMAPFILEHEADER that precedes a DIB in a BMP file */
+#define CLIPBOARD_BMP_FILE_HEADER_SIZE 14
+
+typedef enum {
+    CLIPBOARD_EOL_KEEP,
+    CLIPBOARD_EOL_TO_UNIX,  /* CRLF -> LF */
+    CLIPBOARD_EOL_TO_DOS,   /* LF -> CRLF */
+} ClipboardEolConversion;
+
+/* Converts clipboard data incrementally. */
+typedef struct
+{
+    GByteArray *data;
+    ClipboardEolConversion eol;
+    gboolean lastWasCr;
+    gsize total;     /* Input bytes written so far */
+    gsize expected;  /* Total input bytes, if known, or 0 */
+    gboolean overflow;
+} ClipboardStream;
+
+void clipboard_stream_init(ClipboardStream *stream, ClipboardEolConversion eol,
+                           gsize expected);
+/* Returns FALSE if the data exceeds the configured limit. */
+gboolean clipboard_stream_write(ClipboardStream *stream, const guchar *data, gsize size);
+/* Returns the converted, NUL terminated, data (to be g_free'd), or NULL
+ * if it exceeded the limit. size does not count the terminator. */
+guchar *clipboard_stream_finish(ClipboardStream *stream, gsize *size);
+
+/* Converts a whole buffer, one chunk at a time. */
+guchar *clipboard_convert(const guchar *data, gsize size,
+                          ClipboardEolConversion eol, gsize *outSize);
+
+/* BMP file <-> DIB (what the Windows clipboard holds as CF_DIB). Only the
+ * file header is parsed or generated; pixel data is copied in chunks.
+ * Return NULL if the data is not a valid image or exceeds the limit. */
+guchar *clipboard_bmp_to_dib(const guchar *bmp, gsize size, gsize *outSize);
+guchar *clipboard_dib_to_bmp(const guchar *dib, gsize size, gsize *outSize);
+
+/* Main channel of the current session, or NULL */
+SpiceMainChannel *clipboard_get_main_channel(void);
+
+/* Types offered by the guest in its last grab. */
+void clipboard_set_guest_types(const guint32 *types, guint32 numTypes);
+gboolean clipboard_guest_has_type(guint32 type);
+
+/* Guest clipboard content, as delivered to the host. Takes ownership of data,
+ * and completes the pending requests of that type. With NULL data, the
+ * guest could not provide the data, and all pending requests fail. */
+void clipboard_set_guest_data(guint32 type, guchar *data, gsize size);
+
+/* Called in the glib mainloop thread with the (NUL terminated) data, only valid
+ * during the call, or NULL if the request failed or timed out. */
+typedef void (*ClipboardRequestCallback)(gint32 id, guint32 type,
+                                         const guchar *data, gsize size,
+                                         gpointer userData);
+/* Requests a type of the guest clipboard. The answer comes from the cache if
+ * the guest has not grabbed the clipboard again since it was received.
+ * May be called from any thread. Returns the request id, or -1 if the guest
+ * does not offer that type. */
+gint32 clipboard_request(guint32 type, ClipboardRequestCallback cb, gpointer userData);
+/* Time to wait for the guest, in milliseconds */
+gint clipboard_get_timeout(void);
+/* Fills types with the types set with SpiceGlibGlue_SetHostClipboardType(),
+ * and returns how many there are. */
+guint32 clipboard_get_host_types(guint32 types[CLIPBOARD_NUM_TYPES]);
+/* The content of a type set with SpiceGlibGlue_SetHostClipboardType(),
+ * converted in a single pass, or NULL if there is none or it exceeds the limit.
+ * eol only applies to text. */
+guchar *clipboard_convert_host_data(guint32 type, ClipboardEolConversion eol, gsize *size);
+
+/* Maximum clipboard size in bytes, -1 for no limit (the default). */
+void SpiceGlibGlue_SetClipboardMaxSize(int32_t maxSize);
+
+/* Called every CLIPBOARD_CHUNK_SIZE bytes while a clipboard is transferred.
+ * total is -1 if unknown. It may be called from any thread. */
+typedef void (*SpiceGlibGlueClipboardProgressCallback)(int64_t done, int64_t total);
+void SpiceGlibGlue_SetClipboardProgressCallback(SpiceGlibGlueClipboardProgressCallback cb);
+
+/* Whether the guest offers a type (VD_AGENT_CLIPBOARD_*) in its clipboard. */
+int SpiceGlibGlue_GuestClipboardHasType(uint32_t type);
+
+/* Called in the glib mainloop thread when a request completes. data is only
+ * valid during the call; it is NULL, and size -1, if the request failed. */
+typedef void (*SpiceGlibGlueClipboardCallback)(int32_t requestId, uint32_t type,
+                                               const char *data, int32_t size);
+/* Asynchronously requests the guest clipboard content of a type.
+ * Returns the id passed to the callback, or -1 if the guest does not offer it. */
+int32_t SpiceGlibGlue_RequestGuestClipboard(uint32_t type, SpiceGlibGlueClipboardCallback cb);
+/* Time to wait for the guest to answer a request, in milliseconds. */
+void SpiceGlibGlue_SetClipboardTimeout(int32_t timeout);
+
+/* Size in bytes of the last clipboard received from the guest, -1 if none. */
+int32_t SpiceGlibGlue_GetGuestClipboardSize(void);
+/* Type (VD_AGENT_CLIPBOARD_*) of the last clipboard received from the guest. */
+uint32_t SpiceGlibGlue_GetGuestClipboardType(void);
+
+/* Copies up to size bytes of the guest clipboard, starting at offset, to buffer,
+ * so that it can be retrieved in chunks of any size.
+ * Returns the number of bytes copied, or -1 if there is no guest clipboard. */
+int32_t SpiceGlibGlue_ReadGuestClipboard(char *buffer, int32_t offset, int32_t size);
+
+/* Sets the content of the host clipboard that will be sent to the guest when
+ * it asks for it, after SpiceGlibGlue_GrabGuestClipboard(). This is utf-8
+ * text, and replaces any other type. */
+void SpiceGlibGlue_SetHostClipboard(const char *data, int32_t size);
+/* Adds (or removes, with NULL data) one type to the host clipboard, so that
+ * text and images can be offered at the same time. BMP data is a whole
+ * BMP file. */
+void SpiceGlibGlue_SetHostClipboardType(uint32_t type, const char *data, int32_t size);
+
+#endif /* _GLUE_CLIPBOARD_CORE_H */
+#endif
@@ -27,7 +27,7 @@
 #include "glib.h"
 #include "glue-spice-widget.h"
 #include "glue-spice-widget-priv.h"
-#include "glue-clipboard.h"
+#include "glue-clipboard-core.h"
 
 gboolean enableClipboardToGuest = FALSE;
 gboolean enableClipboardToClient = FALSE;
@@ -67,19 +67,22 @@ typedef struct
     guint type;
 } CBData;
 
-/* Allocates new memory for current_data, which will need to be freed later*/
-void
-push_clipboard_data (const guchar *data, guint size)
+/* ClipboardRequestCallback. The whole data is kept by the core for
+ * SpiceGlibGlue_ReadGuestClipboard(); the first CB_SIZE bytes are also
+ * copied to guestClipboard, if any. */
+static void
+push_clipboard_data (gint32 id, guint32 type, const guchar *data, gsize size,
+                     gpointer userData)
 {
+  if (data == NULL) {
+      return;
+  }
+
   g_mutex_lock (&data_mutex);
   SPICE_DEBUG("CB: data_mutex locked in push.\n");
 
-  if (size > CB_SIZE) {
-      size = CB_SIZE;
-  }
-
   if (guestClipboard != NULL) {
-      snprintf((char *) guestClipboard, size, "%s", data);
+      snprintf((char *) guestClipboard, MIN(size + 1, CB_SIZE), "%s", data);
   }
 
   pendingGuestData = 1;
@@ -161,28 +164,6 @@ int SpiceGlibGlue_ReleaseGuestClipboard()
     return 0;
 }
 
-static gboolean clipboard_get_data(gpointer data)
-{
-    SpiceDisplay *display;
-    SpiceDisplayPrivate *d;
-
-    display = global_display();
-    if (global_display() == NULL) {
-        return FALSE;
-    }
-
-    d = SPICE_DISPLAY_GET_PRIVATE(display);
-    if (d->main == NULL) {
-        return FALSE;
-    }
-
-    spice_main_clipboard_selection_request(d->main, 
-        VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD,  
-        VD_AGENT_CLIPBOARD_UTF8_TEXT);
-
-    return FALSE;
-}
-
 int SpiceGlibGlue_ClipboardGetData()
 {
     SPICE_DEBUG("CB: ClipboardGetData");
@@ -192,9 +173,8 @@ int SpiceGlibGlue_ClipboardGetData()
         return 0;
     }
 
-    g_idle_add(clipboard_get_data, NULL);
-    
-    return 1;
+    /* Answered from the cache if the guest clipboard did not change */
+    return clipboard_request(VD_AGENT_CLIPBOARD_UTF8_TEXT, push_clipboard_data, NULL) > 0;
 }
 
 int SpiceGlibGlue_ClipboardDataAvailable()
@@ -239,40 +219,34 @@ gboolean clipboard_requestFromGuest(SpiceMainChannel *main, guint selection,
     }
 
     //TODO check values as spice-gtk-session.
-    gchar *data = (gchar *) hostClipboard;
-    SPICE_DEBUG("CB: hostClipboard 0x%x\n", hostClipboard);
+    gsize len = 0;
+    guchar *conv = NULL;
 
-    if (hostClipboard != NULL) {
-        SPICE_DEBUG("CB: hostClipboard contains %s\n", hostClipboard);
+    /* Text in the host uses LF as line break.
+       But it is our (client program) responsability to give the guest the format it wants.
+    */
+    ClipboardEolConversion eol =
+        spice_main_agent_test_capability(d->main, VD_AGENT_CAP_GUEST_LINEEND_CRLF) ?
+        CLIPBOARD_EOL_TO_DOS : CLIPBOARD_EOL_KEEP;
+
+    /* Content set with SpiceGlibGlue_SetHostClipboard() has no size limit,
+     * and takes precedence over the hostClipboard buffer. */
+    conv = clipboard_convert_host_data(VD_AGENT_CLIPBOARD_UTF8_TEXT, eol, &len);
+    if (conv == NULL && hostClipboard != NULL) {
+        SPICE_DEBUG("CB: hostClipboard 0x%x\n", hostClipboard);
+        conv = clipboard_convert((const guchar *)hostClipboard,
+                                 strnlen((const char *)hostClipboard, CB_SIZE), eol, &len);
     }
 
-    if (data == NULL ) {
+    if (conv == NULL) {
         SPICE_DEBUG("CB: No supported Clipboard format available\n");
         return FALSE;
     }
-        
-    /* Transform format (line ending, etc) before sending */ 
-    gint len = 0;
-    gpointer conv = NULL;
-    
-    /* Our clipboard is not GTK but windows. So we positively have CRLF as line break.
-       But it is our (client program) responsability to give the guest the format it wants.
-    */
-    if (spice_main_agent_test_capability(d->main, VD_AGENT_CAP_GUEST_LINEEND_CRLF)) {
-        SPICE_DEBUG("CB: Host to Guest, changing line ending\n");
-        len = strnlen(data, CB_SIZE);
-        conv = spice_unix2dos((gchar*)data, len);
-        SPICE_DEBUG("CB: Host to Guest, changing line ending: OK\n");
-        len = strnlen(conv, CB_SIZE);
-    } else {
-        len = strnlen((const char *)data, CB_SIZE);
-    }
 
     spice_main_clipboard_selection_notify(d->main, 
             VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD, 
             VD_AGENT_CLIPBOARD_UTF8_TEXT,
-            conv ? conv : data, len);
-onError:
+            conv, len);
     g_free(conv);
     return FALSE;
 }
@@ -289,11 +263,17 @@ void clipboard_got_from_guest(SpiceMainChannel *main, guint selection,
 
     if (type == VD_AGENT_CLIPBOARD_NONE) {
         SPICE_DEBUG("CB: No data. Received type VD_AGENT_CLIPBOARD_NONE : size %d", size);
+        clipboard_set_guest_data(type, NULL, 0);
         return;
     }
     
     if (type == VD_AGENT_CLIPBOARD_UTF8_TEXT) {
-        push_clipboard_data (data, size + 1);
+        gsize len;
+        guchar *conv = clipboard_convert(data, size,
+            spice_main_agent_test_capability(main, VD_AGENT_CAP_GUEST_LINEEND_CRLF) ?
+                CLIPBOARD_EOL_TO_UNIX : CLIPBOARD_EOL_KEEP, &len);
+        // Completes the pending requests, see push_clipboard_data
+        clipboard_set_guest_data(type, conv, len);
     } else {
         g_warning("CB: Ignoring clipboard of unexpected type %d from guest", type);
     }
@@ -316,6 +296,7 @@ gboolean clipboard_grabByGuest(SpiceMainChannel *main, guint selection,
         return FALSE;    
     }
     
+    clipboard_set_guest_types(types, num_types);
     for (i = 0; i < num_types; i++) {
         SPICE_DEBUG("CB: checking type(%d)",types[i]);
         if (types[i] == VD_AGENT_CLIPBOARD_UTF8_TEXT){
@@ -333,7 +314,9 @@ gboolean clipboard_releaseByGuest(SpiceMainChannel *main, guint selection,
     guint32* types, guint32 num_types,
     gpointer user_data) {
 
-    SPICE_DEBUG("CB: clipboard_releaseByGuest(sel %d) not implemented in this platform", selection);
+    SPICE_DEBUG("CB: clipboard_releaseByGuest(sel %d)", selection);
+    clipboard_set_guest_types(NULL, 0);
+    return TRUE;
 
 }
 
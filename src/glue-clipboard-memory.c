@@ -0,0 +1,267 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/**
+ * Copyright (C) 2016 flexVDI (Flexible Software Solutions S.L.)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "glue-service.h"
+#include "glib.h"
+#include "glue-spice-widget.h"
+#include "glue-clipboard-core.h"
+
+#ifdef USE_CLIPBOARD
+/*
+ *   Clipboard sharing between client and guest, without any native clipboard.
+ *
+ *   The client program keeps its own clipboard in memory: it sets the host
+ *   content with SpiceGlibGlue_SetHostClipboard() and reads the guest content
+ *   with SpiceGlibGlue_ReadGuestClipboard(). Used on platforms without a
+ *   native backend (e.g. Linux), where clients manage the clipboard themselves.
+ *
+ *   Utf-8 text, PNG and BMP images. Text in the host uses LF as line break.
+ *   Each type is only transferred when the other side asks for it.
+ */
+
+gboolean enableClipboardToGuest = FALSE;
+gboolean enableClipboardToClient = FALSE;
+
+#define CB_OWNER_NONE 0
+#define CB_OWNER_GUEST 1
+#define CB_OWNER_HOST 2
+static int clipboardOwner = CB_OWNER_NONE;
+static int pendingGuestData = 0;
+static GMutex data_mutex;
+
+static gboolean grab_guest_clipboard(gpointer data)
+{
+    guint32 clipboardTypes[CLIPBOARD_NUM_TYPES];
+    guint32 ntypes;
+    SpiceMainChannel *main = clipboard_get_main_channel();
+    if (main == NULL) {
+        return FALSE;
+    }
+
+    /* Only announce the types, the data is sent when the guest requests it */
+    ntypes = clipboard_get_host_types(clipboardTypes);
+    if (ntypes == 0) {
+        SPICE_DEBUG("CB: host clipboard is empty, not grabbing");
+        return FALSE;
+    }
+    spice_main_clipboard_selection_grab(main,
+        VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD,
+        clipboardTypes, ntypes);
+    clipboardOwner = CB_OWNER_HOST;
+
+    return FALSE;
+}
+
+int SpiceGlibGlue_GrabGuestClipboard()
+{
+    SPICE_DEBUG("CB: GrabGuestClipboard grabbing %d", VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD);
+
+    if (!enableClipboardToGuest) {
+        SPICE_DEBUG("CB: enableClipboardToGuest set to false. Doing nothing.");
+        return 0;
+    }
+
+    g_idle_add(grab_guest_clipboard, NULL);
+
+    return 0;
+}
+
+static gboolean release_guest_clipboard(gpointer data)
+{
+    SpiceMainChannel *main = clipboard_get_main_channel();
+    if (main == NULL) {
+        return FALSE;
+    }
+
+    spice_main_clipboard_selection_release(main, VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD);
+    clipboardOwner = CB_OWNER_NONE;
+
+    return FALSE;
+}
+
+int SpiceGlibGlue_ReleaseGuestClipboard()
+{
+    SPICE_DEBUG("CB: ReleaseGuestClipboard");
+    if (!enableClipboardToGuest) {
+        SPICE_DEBUG("CB: enableClipboardToGuest set to false. Doing nothing.");
+        return 0;
+    }
+
+    g_idle_add(release_guest_clipboard, NULL);
+
+    return 0;
+}
+
+/* ClipboardRequestCallback, the data is already in the core store */
+static void clipboard_got_data(gint32 id, guint32 type, const guchar *data, gsize size,
+                               gpointer userData)
+{
+    if (data == NULL)
+        return;
+
+    g_mutex_lock(&data_mutex);
+    pendingGuestData = 1;
+    g_mutex_unlock(&data_mutex);
+}
+
+int SpiceGlibGlue_ClipboardGetDataType(uint32_t type)
+{
+    SPICE_DEBUG("CB: ClipboardGetDataType(%d)", type);
+
+    if (clipboardOwner != CB_OWNER_GUEST) {
+        SPICE_DEBUG("CB: Guest has not grabbed CB, returning false");
+        return 0;
+    }
+
+    return clipboard_request(type, clipboard_got_data, NULL) > 0;
+}
+
+int SpiceGlibGlue_ClipboardGetData()
+{
+    return SpiceGlibGlue_ClipboardGetDataType(VD_AGENT_CLIPBOARD_UTF8_TEXT);
+}
+
+int SpiceGlibGlue_ClipboardDataAvailable()
+{
+    int available;
+
+    g_mutex_lock(&data_mutex);
+    available = pendingGuestData;
+    pendingGuestData = 0;
+    g_mutex_unlock(&data_mutex);
+
+    return available;
+}
+
+gboolean clipboard_requestFromGuest(SpiceMainChannel *main, guint selection,
+                                  guint type, gpointer user_data)
+{
+    gsize len;
+    guchar *data;
+
+    SPICE_DEBUG("CB: clipboard_requestFromGuest()");
+    if (!enableClipboardToGuest) {
+        SPICE_DEBUG("CB: enableClipboardToGuest set to false. Doing nothing.");
+        return TRUE;
+    }
+
+    if (clipboardOwner != CB_OWNER_HOST) {
+        SPICE_DEBUG("We do NOT have clipboard grabbed, so we won't send it.");
+        return FALSE;
+    }
+
+    data = clipboard_convert_host_data(type,
+        spice_main_agent_test_capability(main, VD_AGENT_CAP_GUEST_LINEEND_CRLF) ?
+            CLIPBOARD_EOL_TO_DOS : CLIPBOARD_EOL_KEEP, &len);
+    if (data == NULL) {
+        SPICE_DEBUG("CB: No host clipboard of type %d available\n", type);
+        return FALSE;
+    }
+
+    spice_main_clipboard_selection_notify(main,
+            VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD,
+            type, data, len);
+    g_free(data);
+    return TRUE;
+}
+
+void clipboard_got_from_guest(SpiceMainChannel *main, guint selection,
+                                     guint type, const guchar *data, guint size,
+                                     gpointer user_data)
+{
+    guchar *conv;
+    gsize len;
+
+    SPICE_DEBUG("CB: clipboard_got_data  type : %d ", type);
+    if (!enableClipboardToClient) {
+        SPICE_DEBUG("CB: enableClipboardToClient set to false. Doing nothing.");
+        return;
+    }
+
+    if (!CLIPBOARD_TYPE_SUPPORTED(type)) {
+        g_warning("CB: Ignoring clipboard of unexpected type %d from guest", type);
+        clipboard_set_guest_data(type, NULL, 0);
+        return;
+    }
+
+    conv = clipboard_convert(data, size,
+        type == VD_AGENT_CLIPBOARD_UTF8_TEXT &&
+        spice_main_agent_test_capability(main, VD_AGENT_CAP_GUEST_LINEEND_CRLF) ?
+            CLIPBOARD_EOL_TO_UNIX : CLIPBOARD_EOL_KEEP, &len);
+    // Completes the requests, or makes them fail if conv is NULL
+    clipboard_set_guest_data(type, conv, len);
+}
+
+gboolean clipboard_grabByGuest(SpiceMainChannel *main, guint selection,
+                               guint32* types, guint32 num_types,
+                               gpointer user_data)
+{
+    gint i;
+
+    SPICE_DEBUG("CB: clipboard_grabByGuest(sel %d)", selection);
+    if (!enableClipboardToClient) {
+        SPICE_DEBUG("CB: enableClipboardToClient set to false. Doing nothing.");
+        return TRUE;
+    }
+
+    if (selection != VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD) {
+        g_warning("CB: discarded clipboard request of unsupported selection %d",selection);
+        return FALSE;
+    }
+
+    /* Nothing is transferred until the host asks for one of these types */
+    clipboard_set_guest_types(types, num_types);
+    for (i = 0; i < num_types; i++) {
+        if (CLIPBOARD_TYPE_SUPPORTED(types[i])) {
+            clipboardOwner = CB_OWNER_GUEST;
+        }
+    }
+
+    return TRUE;
+}
+
+gboolean clipboard_releaseByGuest(SpiceMainChannel *main, guint selection,
+                               guint32* types, guint32 num_types,
+                               gpointer user_data)
+{
+    SPICE_DEBUG("CB: clipboard_releaseByGuest(sel %d)", selection);
+    if (clipboardOwner == CB_OWNER_GUEST)
+        clipboardOwner = CB_OWNER_NONE;
+    clipboard_set_guest_types(NULL, 0);
+    return TRUE;
+}
+
+gboolean SpiceGlibGlue_InitClipboard(
+        int16_t enableClipboardToGuestP, int16_t enableClipboardToClientP)
+{
+    SPICE_DEBUG("CB SpiceGlibGlue_InitClipboard (%d, %d)",
+            enableClipboardToGuestP, enableClipboardToClientP);
+    enableClipboardToGuest  = enableClipboardToGuestP;
+    enableClipboardToClient = enableClipboardToClientP;
+
+    return FALSE;
+}
+
+#endif
@@ -27,7 +27,7 @@
 #include "glib.h"
 #include "glue-spice-widget.h"
 #include "glue-spice-widget-priv.h"
-#include "glue-clipboard.h"
+#include "glue-clipboard-core.h"
 
 #ifdef G_OS_WIN32
 #include <windows.h>
@@ -56,17 +56,40 @@ gboolean enableClipboardToClient = FALSE;
  *   Clipboard sharing between client and guest, using spice client library
  *   and windows native API. No GTK or any other GUI framework.
  *
- *   Only utf-8 text implemented (although library supports images)
+ *   Utf-8 text, PNG and BMP images (CF_DIB in windows) implemented. Formats
+ *   are rendered lazily: data is only requested to the vdagent when a local
+ *   application pastes that format.
  *   ClipboardMain shared (but not primary clipboard, as windows has only the main one).
  */
 
 
-/* Array with the type of data we are interested in sharing */
-guint32 clipboardTypes [1] = {VD_AGENT_CLIPBOARD_UTF8_TEXT};
-int ntypes = 1;
+/* Registered "PNG" clipboard format, used by most image applications */
+static UINT cfPng = 0;
 gboolean isClipboardGrabbed = FALSE;
 
-const int max_clipboard = 512*1024;
+/* Windows clipboard format of a VD_AGENT_CLIPBOARD_* type, 0 if not supported */
+static UINT type_to_format(guint32 type) {
+    switch (type) {
+    case VD_AGENT_CLIPBOARD_UTF8_TEXT:
+        return CF_UNICODETEXT;
+    case VD_AGENT_CLIPBOARD_IMAGE_PNG:
+        return cfPng;
+    case VD_AGENT_CLIPBOARD_IMAGE_BMP:
+        return CF_DIB;
+    default:
+        return 0;
+    }
+}
+
+static guint32 format_to_type(UINT format) {
+    if (format == CF_UNICODETEXT)
+        return VD_AGENT_CLIPBOARD_UTF8_TEXT;
+    if (format == CF_DIB)
+        return VD_AGENT_CLIPBOARD_IMAGE_BMP;
+    if (format != 0 && format == cfPng)
+        return VD_AGENT_CLIPBOARD_IMAGE_PNG;
+    return VD_AGENT_CLIPBOARD_NONE;
+}
 
  /* Flag to know if guest owns the clipboard, and we should ask vdagent for data
   * or not. We don't need to distinguish if clipboard is owned by some other 
@@ -78,6 +101,9 @@ gboolean guestOwnsClipboard = FALSE;
  * and windows message receiving thread 
  */
 gpointer current_data = NULL;
+gsize current_size = 0;
+gboolean data_ready = FALSE;
+gint32 awaited_request = -1;  /* Id of the request whose data is awaited, or -1 */
 GMutex data_mutex;
 GCond data_cond;
 
@@ -89,25 +115,53 @@ typedef struct
     guint type;
 } CBData;
 
-/* Allocates new memory for current_data, which will need to be freed later*/
-void
-push_clipboard_data (const gpointer data) {
+/* ClipboardRequestCallback, copies data for the windows message receiving thread.
+ * NULL data (the request failed) wakes it up too. */
+static void
+push_clipboard_data (gint32 id, guint32 type, const guchar *data, gsize size,
+                     gpointer userData) {
 
   g_mutex_lock (&data_mutex);
   SPICE_DEBUG("CB: data_mutex locked in push.\n");
 
+  // A request that timed out, its data is not awaited anymore
+  if (id != awaited_request) {
+    SPICE_DEBUG("CB: discarding data of request %d, awaiting %d", id, awaited_request);
+    g_mutex_unlock (&data_mutex);
+    return;
+  }
+
   if (current_data) {
     g_free(current_data);
     current_data = NULL;
   }
-  // Counting on null terminated string, and not any other non null terminated data
-  current_data = g_strdup(data);
+  // Core data is NUL terminated, keep the terminator for text
+  current_data = data ? g_memdup(data, size + 1) : NULL;
+  current_size = size;
+  data_ready = TRUE;
   g_cond_signal (&data_cond);
   g_mutex_unlock (&data_mutex);
   SPICE_DEBUG("CB: data_mutex UNlocked in push.\n");
 }
 
-gpointer pop_clipboard_data_timed (void) {
+/* Requests a type of the guest clipboard, for pop_clipboard_data_timed().
+ * The mutex is held so that the request cannot complete before its id is stored. */
+static gboolean request_clipboard_data (guint32 type) {
+
+  gint32 id;
+
+  g_mutex_lock (&data_mutex);
+  g_free(current_data);
+  current_data = NULL;
+  data_ready = FALSE;
+  id = clipboard_request(type, push_clipboard_data, NULL);
+  awaited_request = id;
+  g_mutex_unlock (&data_mutex);
+
+  return id >= 0;
+}
+
+gpointer pop_clipboard_data_timed (gsize *size) {
 
   gint64 end_time;
   gpointer data;
@@ -115,13 +169,15 @@ gpointer pop_clipboard_data_timed (void) {
   g_mutex_lock (&data_mutex);
   SPICE_DEBUG("CB: data_mutex locked in pop.\n");
 
-    // max wait 10 seconds
-  end_time = g_get_monotonic_time () + 10 * G_TIME_SPAN_SECOND;
-  while (!current_data)
+  // The request itself times out first, this is just a safety net
+  end_time = g_get_monotonic_time () +
+      (clipboard_get_timeout () + 1000) * G_TIME_SPAN_MILLISECOND;
+  while (!data_ready)
     if (!g_cond_wait_until (&data_cond, &data_mutex, end_time))
       {
         // timeout has passed.
 		SPICE_DEBUG("CB: Timeout has passed.\n");
+        awaited_request = -1;
         g_mutex_unlock (&data_mutex);
 		SPICE_DEBUG("CB: data_mutex UNlocked in pop (after timeout).\n");
         return NULL;
@@ -129,7 +185,10 @@ gpointer pop_clipboard_data_timed (void) {
 
   // There are data for us
   data = current_data;
+  *size = current_size;
   current_data = NULL;
+  data_ready = FALSE;
+  awaited_request = -1;
 
   g_mutex_unlock (&data_mutex);
   SPICE_DEBUG("CB: data_mutex UNlocked in pop (after signal).\n");
@@ -159,7 +218,21 @@ int SpiceGlibGlue_GrabGuestClipboard() {
         return -1;
     }
    
-    /* Grab the guest clipboard, with just one type (text) */
+    /* Grab the guest clipboard with the types available in the local
+     * clipboard. Their data is only read when the guest requests it. */
+    guint32 clipboardTypes[CLIPBOARD_NUM_TYPES];
+    int ntypes = 0;
+    if (IsClipboardFormatAvailable(CF_UNICODETEXT) || IsClipboardFormatAvailable(CF_TEXT))
+        clipboardTypes[ntypes++] = VD_AGENT_CLIPBOARD_UTF8_TEXT;
+    if (cfPng != 0 && IsClipboardFormatAvailable(cfPng))
+        clipboardTypes[ntypes++] = VD_AGENT_CLIPBOARD_IMAGE_PNG;
+    if (IsClipboardFormatAvailable(CF_DIB))
+        clipboardTypes[ntypes++] = VD_AGENT_CLIPBOARD_IMAGE_BMP;
+    if (ntypes == 0) {
+        SPICE_DEBUG("CB: No supported Clipboard format available. Not grabbing.");
+        return 0;
+    }
+
     spice_main_clipboard_selection_grab(d->main, 
         /*selection */VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD,
         clipboardTypes, ntypes);
@@ -193,19 +266,65 @@ int SpiceGlibGlue_ReleaseGuestClipboard() {
     return 0;
 }
 
-static gboolean check_clipboard_size_limits(gint clipboard_len) {
+/* Reads the text in the (open) local clipboard, converting its line endings
+ * while copying it out of the clipboard. */
+static guchar *get_client_text(ClipboardEolConversion eol, gsize *len) {
 
-    //g_object_get(session->priv->main, "max-clipboard", &max_clipboard, NULL);
-    if (max_clipboard != -1 && clipboard_len > max_clipboard) {
-        g_warning("discarded clipboard of size %d (max: %d)",
-                  clipboard_len, max_clipboard);
-        return FALSE;
-    } else if (clipboard_len <= 0) {
-        SPICE_DEBUG("discarding empty clipboard");
-        return FALSE;
+    HANDLE h;
+    gchar *utf8 = NULL;
+    const gchar *text = NULL;
+    guchar *conv = NULL;
+
+    if (IsClipboardFormatAvailable(CF_UNICODETEXT)) // UTF16
+    {
+        h = GetClipboardData(CF_UNICODETEXT);
+        if (h == NULL) {
+            SPICE_DEBUG("CB: Clipboard is empty\n");
+        }
+        else {
+            text = utf8 = g_utf16_to_utf8 ((const gunichar2*) h, -1,
+                     NULL, NULL, /*GError **error*/NULL);
+        }
+    }
+    else if (IsClipboardFormatAvailable(CF_TEXT)) // ASCII
+    {
+        h = GetClipboardData(CF_TEXT);
+        if (h == NULL) {
+            SPICE_DEBUG("CB: Clipboard is empty\n");
+        }
+        text = h;
     }
 
-    return TRUE;
+    if (text == NULL) {
+        SPICE_DEBUG("CB: No supported Clipboard format available\n");
+        return NULL;
+    }
+
+    conv = clipboard_convert((const guchar *)text, strlen(text), eol, len);
+    g_free(utf8);
+    return conv;
+}
+
+/* Reads an image in the (open) local clipboard. CF_DIB is sent as a BMP file. */
+static guchar *get_client_image(guint32 type, gsize *len) {
+
+    HANDLE h;
+    const guchar *data;
+    guchar *conv = NULL;
+
+    h = GetClipboardData(type_to_format(type));
+    if (h == NULL || (data = GlobalLock(h)) == NULL) {
+        SPICE_DEBUG("CB: No image of type %d in Clipboard\n", type);
+        return NULL;
+    }
+
+    if (type == VD_AGENT_CLIPBOARD_IMAGE_BMP) {
+        conv = clipboard_dib_to_bmp(data, GlobalSize(h), len);
+    } else {
+        conv = clipboard_convert(data, GlobalSize(h), CLIPBOARD_EOL_KEEP, len);
+    }
+    GlobalUnlock(h);
+    return conv;
 }
 
 gboolean clipboard_requestFromGuest(SpiceMainChannel *main, guint selection,
@@ -236,76 +355,48 @@ gboolean clipboard_requestFromGuest(SpiceMainChannel *main, guint selection,
     }
 
     //TODO check values as spice-gtk-session.
-    gchar *data = NULL;
-
-#ifdef WIN32
-    /* Get clipboard content from Windows OS (text only)
-       and copy it to data (which will be g_free'd later) */ 
-    HANDLE h;
+    guchar *conv = NULL;
+    gsize len = 0;
 
     if (!OpenClipboard(NULL)) {
         SPICE_DEBUG("Can't open clipboard");
         return FALSE;
     }
 
-    if (IsClipboardFormatAvailable(CF_UNICODETEXT)) // UTF16
-    {
-        h = GetClipboardData(CF_UNICODETEXT);
-        if (h == NULL) {
-            SPICE_DEBUG("CB: Clipboard is empty\n");
-        }
-        else {
-            data = g_utf16_to_utf8 ((const gunichar2*) h, -1,
-                     NULL, NULL, /*GError **error*/NULL);
-            //SPICE_DEBUG("CB: Clipboard contains %s\n", data);
-        }
-    }
-    else if (IsClipboardFormatAvailable(CF_TEXT)) // ASCII
-    {
-        h = GetClipboardData(CF_TEXT);
-        if (h == NULL) {
-            SPICE_DEBUG("CB: Clipboard is empty\n");
-        }
-        data = g_strdup(h);
+    switch (type) {
+    case VD_AGENT_CLIPBOARD_UTF8_TEXT:
+        /* Our clipboard is not GTK but windows. So we positively have CRLF as line break.
+           But it is our (client program) responsability to give the guest the format it wants.
+        */
+        conv = get_client_text(
+            spice_main_agent_test_capability(d->main, VD_AGENT_CAP_GUEST_LINEEND_CRLF) ?
+            CLIPBOARD_EOL_KEEP : CLIPBOARD_EOL_TO_UNIX, &len);
+        break;
+    case VD_AGENT_CLIPBOARD_IMAGE_PNG:
+    case VD_AGENT_CLIPBOARD_IMAGE_BMP:
+        conv = get_client_image(type, &len);
+        break;
+    default:
+        g_warning("CB: Guest requested unsupported clipboard type %d", type);
+        break;
     }
     CloseClipboard();
 
-    if (data == NULL ) {
-        SPICE_DEBUG("CB: No supported Clipboard format available\n");
-        goto onError;
-    }
-        
-    /* Transform format (line ending, etc) before sending */ 
-    gint len = 0;
-    gpointer conv = NULL;
-    
-    /* Our clipboard is not GTK but windows. So we positively have CRLF as line break.
-       But it is our (client program) responsability to give the guest the format it wants.
-    */
-    if (!spice_main_agent_test_capability(d->main, VD_AGENT_CAP_GUEST_LINEEND_CRLF)) {
-        len = strlen(data);
-        conv = spice_dos2unix((gchar*)data, len);
-        len = strlen(conv);
-    } else {
-        len = strlen((const char *)data);
+    if (conv == NULL) {
+        // Not available, or over the size limit
+        return FALSE;
     }
-    if (!check_clipboard_size_limits(/*self,*/ len)) {
+    if (len == 0) {
+        SPICE_DEBUG("discarding empty clipboard");
         g_free(conv);
-        goto onError;
+        return FALSE;
     }
 
-    
     spice_main_clipboard_selection_notify(d->main, 
             VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD, 
-            VD_AGENT_CLIPBOARD_UTF8_TEXT,
-            conv ?: data, len);
+            type, conv, len);
     g_free(conv);
-#endif
-    g_free(data);
     return TRUE;
-onError:
-    g_free(data);
-    return FALSE;
 }
 
 void clipboard_got_from_guest(SpiceMainChannel *main, guint selection,
@@ -318,38 +409,34 @@ void clipboard_got_from_guest(SpiceMainChannel *main, guint selection,
         return;
     }
 
-    gchar *conv = NULL;
+    guchar *conv = NULL;
+    gsize len;
     if (type == VD_AGENT_CLIPBOARD_NONE) {
         SPICE_DEBUG("CB: No data. Received type VD_AGENT_CLIPBOARD_NONE : size %d", size);
-        push_clipboard_data (NULL);
+        clipboard_set_guest_data (type, NULL, 0);
         return;
     }
     
     if (type == VD_AGENT_CLIPBOARD_UTF8_TEXT) {
-#ifdef G_OS_WIN32
         /* Received text is UTF-8, with the line-ending of the guest.
-         * Here we convert the line-ending to windowsstyle if necessary. */
-        
-        if (!spice_main_agent_test_capability(main, VD_AGENT_CAP_GUEST_LINEEND_CRLF)) {
-            SPICE_DEBUG("CB: Change Line ending");
-            conv = spice_unix2dos((gchar*)data, size);
-            //size = strlen(conv);
-        } else {
-            SPICE_DEBUG("CB: Set null terminator");
-            conv = g_new(char, size+1);
-            memcpy(conv, data, size);
-            conv[size] = 0;
-        }
-#endif
-        push_clipboard_data (conv?(const gpointer)conv:(const gpointer)data);
-        SPICE_DEBUG("CB: clipboard got %s", conv);
-        g_free(conv);
+         * Here we convert the line-ending to windowsstyle if necessary,
+         * while copying it and adding the null terminator. */
+        conv = clipboard_convert(data, size,
+            spice_main_agent_test_capability(main, VD_AGENT_CAP_GUEST_LINEEND_CRLF) ?
+                CLIPBOARD_EOL_KEEP : CLIPBOARD_EOL_TO_DOS, &len);
+    } else if (type == VD_AGENT_CLIPBOARD_IMAGE_BMP) {
+        /* CF_DIB is a BMP file without its file header */
+        conv = clipboard_bmp_to_dib(data, size, &len);
+    } else if (type == VD_AGENT_CLIPBOARD_IMAGE_PNG) {
+        conv = clipboard_convert(data, size, CLIPBOARD_EOL_KEEP, &len);
     } else {
         g_warning("CB: Ignoring clipboard of unexpected type %d from guest", type);
+        clipboard_set_guest_data (type, NULL, 0);
+        return;
     }
-    
-end:
-    g_free(conv);
+    SPICE_DEBUG("CB: clipboard got %" G_GSIZE_FORMAT " bytes of type %d", len, type);
+    // Takes ownership of conv, and completes the requests with push_clipboard_data
+    clipboard_set_guest_data (type, conv, len);
 }
 
 gboolean clipboard_grabByGuest(SpiceMainChannel *main, guint selection,
@@ -370,20 +457,23 @@ gboolean clipboard_grabByGuest(SpiceMainChannel *main, guint selection,
         return FALSE;    
     }
     
+    clipboard_set_guest_types(types, num_types);
     for (i = 0; i < num_types; i++) {
         SPICE_DEBUG("CB: checking type(%d)",types[i]);
-        if (types[i] == VD_AGENT_CLIPBOARD_UTF8_TEXT){
-        
-            SPICE_DEBUG("CB: IT IS UTF8");
-            
-            if (!OpenClipboard(hwnd)) {
-                return FALSE;
+        UINT format = type_to_format(types[i]);
+        if (format != 0) {
+            if (!sth_grabbed) {
+                if (!OpenClipboard(hwnd)) {
+                    return FALSE;
+                }
+                sth_grabbed= TRUE;
+                guestOwnsClipboard = TRUE;
+                EmptyClipboard();
             }
-            sth_grabbed= TRUE;
-            guestOwnsClipboard = TRUE;
-            EmptyClipboard();
-            SetClipboardData(CF_UNICODETEXT, NULL);
-            SPICE_DEBUG("CB: ClipboardData Set to null WM_RENDERFORMAT should come");
+            /* Delayed rendering: the data is requested on WM_RENDERFORMAT */
+            SetClipboardData(format, NULL);
+            SPICE_DEBUG("CB: ClipboardData of type %d Set to null WM_RENDERFORMAT should come",
+                        types[i]);
         }
     }// end for
     if (sth_grabbed) {
@@ -416,6 +506,7 @@ gboolean clipboard_releaseByGuest(SpiceMainChannel *main, guint selection,
         return TRUE;
     }
     guestOwnsClipboard = FALSE;
+    clipboard_set_guest_types(NULL, 0);
     
     return TRUE;
 }
@@ -452,30 +543,6 @@ static gboolean recv_windows_message (GIOChannel  *channel,
   return TRUE;
 }
 
-/* GSourceFunc
- * Requests text content of the clipboard to the vdagent of the guest */
-static gboolean onRenderFormat_text() {
-
-    SpiceDisplay *display;
-    SpiceDisplayPrivate *d;
-
-    display = global_display();
-    if (global_display() == NULL) {
-        return -1;
-    }
-
-    d = SPICE_DISPLAY_GET_PRIVATE(display);
-    if (d->main == NULL) {
-        return -1;
-    }
-    
-    spice_main_clipboard_selection_request(d->main, 
-            VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD,  
-            VD_AGENT_CLIPBOARD_UTF8_TEXT);
-    return G_SOURCE_REMOVE;
-    
-}
-
 static void showBytes(char* name, char* bytes) {
 
     gint numBytes =strlen(bytes)+1;
@@ -502,45 +569,55 @@ void OnRenderFormat(UINT wparam) {
         return;
     }
 
-    if (wparam == CF_UNICODETEXT) {
-        g_timeout_add_full(G_PRIORITY_HIGH, 0,
-               onRenderFormat_text,
-               NULL, NULL);
+    guint32 type = format_to_type(wparam);
+    if (type == VD_AGENT_CLIPBOARD_NONE || !clipboard_guest_has_type(type)) {
+        g_warning("CB: Requested format %06X  is not supported (nor grabbed)", wparam);
+        return;
+    }
+
+    /* Windows expects the data before we return, so wait for the request
+     * to complete. It does not reach the guest if the data is cached. */
+    if (!request_clipboard_data(type)) {
+        return;
+    }
 /* https://msdn.microsoft.com/en-us/library/windows/desktop/ms649016(v=vs.85).aspx */
 
-        // Allocate a buffer for the text. 
-        HGLOBAL hglb;
-        LPTSTR  lptstr;
-        char* receivedContent = pop_clipboard_data_timed();
-        //showBytes("receivedContent", receivedContent);
-        
+    HGLOBAL hglb;
+    LPVOID  lpdata;
+    gsize receivedSize = 0;
+    char* receivedContent = pop_clipboard_data_timed(&receivedSize);
+    if (receivedContent == NULL) {
+        return;
+    }
+
+    if (type == VD_AGENT_CLIPBOARD_UTF8_TEXT) {
         //Convert received utf8 (spice standard) to required utf16 (windows standard)
         glong winTItems=-1;
         gunichar2* winText = g_utf8_to_utf16(receivedContent, -1,
                  NULL, &winTItems, /*GError **error*/NULL);
         g_free(receivedContent);
+        receivedContent = (char *)winText;
+        receivedSize = (winTItems+1) * sizeof(gunichar2);
+    }
 
-        glong winTSize = (winTItems+1) * sizeof(gunichar2);
-        
-        hglb = GlobalAlloc(GMEM_MOVEABLE, winTSize);
-        if (hglb == NULL) {
-            g_warning("CB: Could not allocate memory for clipboard.");
-            return;
-        }
+    // Allocate a buffer for the data.
+    hglb = GlobalAlloc(GMEM_MOVEABLE, receivedSize);
+    if (hglb == NULL) {
+        g_warning("CB: Could not allocate memory for clipboard.");
+        g_free(receivedContent);
+        return;
+    }
 
-        lptstr = GlobalLock(hglb); 
-        memcpy(lptstr, winText, winTSize);
-        
-        g_free(winText);
-        GlobalUnlock(hglb);
+    lpdata = GlobalLock(hglb);
+    memcpy(lpdata, receivedContent, receivedSize);
 
-        // Place the handle on the clipboard.
-        if (SetClipboardData(CF_UNICODETEXT, hglb) == NULL) {
-            g_warning("CB: SetClipboardData() Failed");
-        };
-    } else {
-        g_warning("CB: Requested format %06X  is not supported (nor grabbed)", wparam);
-    }
+    g_free(receivedContent);
+    GlobalUnlock(hglb);
+
+    // Place the handle on the clipboard.
+    if (SetClipboardData(wparam, hglb) == NULL) {
+        g_warning("CB: SetClipboardData() Failed");
+    };
 }                              
 
 void OnRenderAllFormats(HWND hwnd) {
@@ -551,7 +628,11 @@ void OnRenderAllFormats(HWND hwnd) {
         return;
     }
     if (OpenClipboard(hwnd)) {
-        OnRenderFormat(CF_UNICODETEXT);
+        guint32 type;
+        for (type = VD_AGENT_CLIPBOARD_UTF8_TEXT; type < CLIPBOARD_NUM_TYPES; type++) {
+            if (clipboard_guest_has_type(type))
+                OnRenderFormat(type_to_format(type));
+        }
         CloseClipboard();
     }
 }
@@ -602,6 +683,8 @@ gboolean SpiceGlibGlue_InitClipboard(
     enableClipboardToClient = enableClipboardToClientP;
 
     if (!enableClipboardToGuest && !enableClipboardToClient) return;
+
+    cfPng = RegisterClipboardFormat(TEXT("PNG"));
     
     WNDCLASS wcls;
     
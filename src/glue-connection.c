@@ -18,8 +18,11 @@
  */
 
 #include <sys/stat.h>
+#include <string.h>
 #include <spice-client.h>
 #include "glue-connection.h"
+#include "glue-audio.h"
+#include "glue-profiler.h"
 
 struct _SpiceConnection {
     GObject          parent;
@@ -30,8 +33,13 @@ struct _SpiceConnection {
     int              channels;
     int              disconnecting;
     gboolean         enable_sound;
+    int              channel_states[GLUE_MAX_CHANNEL_TYPES];
 };
 
+static SpiceConnectionUsableFunc display_usable_func = NULL;
+
+static void apply_display_options(SpiceChannel *channel);
+
 G_DEFINE_TYPE(SpiceConnection, spice_connection, G_TYPE_OBJECT);
 
 static void spice_connection_dispose(GObject * obj);
@@ -69,6 +77,30 @@ SpiceConnection *spice_connection_new(void)
     return SPICE_CONNECTION(g_object_new(SPICE_CONNECTION_TYPE, NULL));
 }
 
+static void set_channel_state(SpiceConnection *conn, SpiceChannel *channel, int state)
+{
+    int id, channel_type;
+
+    g_object_get(channel, "channel-id", &id, "channel-type", &channel_type, NULL);
+    if (id != 0 || channel_type < 0 || channel_type >= GLUE_MAX_CHANNEL_TYPES ||
+        conn->channel_states[channel_type] == state)
+        return;
+    SPICE_DEBUG("%s channel: state %d -> %d", spice_channel_type_to_string(channel_type),
+                conn->channel_states[channel_type], state);
+    conn->channel_states[channel_type] = state;
+}
+
+static void display_mark(SpiceChannel *channel, gint mark, gpointer data)
+{
+    SpiceConnection *conn = SPICE_CONNECTION(data);
+
+    if (mark == 0 || conn->channel_states[SPICE_CHANNEL_DISPLAY] == GLUE_CHANNEL_READY)
+        return;
+    set_channel_state(conn, channel, GLUE_CHANNEL_READY);
+    if (display_usable_func)
+        display_usable_func(conn);
+}
+
 static void channel_event(SpiceChannel *channel, SpiceChannelEvent event,
 				  gpointer data)
 {
@@ -81,26 +113,37 @@ static void channel_event(SpiceChannel *channel, SpiceChannelEvent event,
     switch (event) {
     case SPICE_CHANNEL_OPENED:
         SPICE_DEBUG("%s channel: opened", channel_name);
+        glue_profiler_channel_opened(channel_type);
+        if (SPICE_IS_DISPLAY_CHANNEL(channel)) {
+            set_channel_state(conn, channel, GLUE_CHANNEL_LINKED);
+            apply_display_options(channel);
+        } else {
+            set_channel_state(conn, channel, GLUE_CHANNEL_READY);
+        }
         break;
     case SPICE_CHANNEL_SWITCHING:
         SPICE_DEBUG("%s channel: switching host", channel_name);
         break;
     case SPICE_CHANNEL_CLOSED:
         SPICE_DEBUG("%s channel closed", channel_name);
+        set_channel_state(conn, channel, GLUE_CHANNEL_NONE);
         spice_connection_disconnect(conn);
         break;
     case SPICE_CHANNEL_ERROR_IO:
         g_warning("%s channel: input-output error", channel_name);
+        set_channel_state(conn, channel, GLUE_CHANNEL_ERROR);
         spice_connection_disconnect(conn);
         break;
     case SPICE_CHANNEL_ERROR_TLS:
     case SPICE_CHANNEL_ERROR_LINK:
     case SPICE_CHANNEL_ERROR_CONNECT:
         g_warning("%s channel: failed to connect", channel_name);
+        set_channel_state(conn, channel, GLUE_CHANNEL_ERROR);
         spice_connection_disconnect(conn);
         break;
     case SPICE_CHANNEL_ERROR_AUTH:
         g_warning("%s channel: auth failure (wrong password?)", channel_name);
+        set_channel_state(conn, channel, GLUE_CHANNEL_ERROR);
         spice_connection_disconnect(conn);
         break;
     default:
@@ -133,10 +176,19 @@ static void channel_new(SpiceSession *s, SpiceChannel *channel, gpointer data)
         if (conn->display != NULL)
             return;
         conn->display = spice_display_new(conn->session, id);
+        g_signal_connect(channel, "display-mark", G_CALLBACK(display_mark), conn);
     }
 
     else if (conn->enable_sound && SPICE_IS_PLAYBACK_CHANNEL(channel)) {
-        conn->audio = spice_audio_get(s, NULL);
+        if (glue_audio_get_mode() == GLUE_AUDIO_MODE_HOST)
+            glue_audio_connect_playback(SPICE_PLAYBACK_CHANNEL(channel));
+        else
+            conn->audio = spice_audio_get(s, NULL);
+    }
+
+    else if (conn->enable_sound && SPICE_IS_RECORD_CHANNEL(channel) &&
+             glue_audio_get_mode() == GLUE_AUDIO_MODE_HOST) {
+        glue_audio_connect_record(SPICE_RECORD_CHANNEL(channel));
     }
 
     else if (!SPICE_IS_INPUTS_CHANNEL(channel) &&
@@ -145,6 +197,7 @@ static void channel_new(SpiceSession *s, SpiceChannel *channel, gpointer data)
         return;
     }
 
+    set_channel_state(conn, channel, GLUE_CHANNEL_CONNECTING);
     spice_channel_connect(channel);
     g_signal_connect(channel, "channel-event", G_CALLBACK(channel_event), conn);
 }
@@ -163,6 +216,9 @@ static void channel_destroy(SpiceSession *s, SpiceChannel *channel, gpointer dat
     SPICE_DEBUG("Number of channels remaining: %d", conn->channels);
 
     g_signal_handlers_disconnect_by_data(channel, data);
+    /* Errors are kept, for the client program to see them */
+    if (spice_connection_get_channel_state(conn, channel_type) != GLUE_CHANNEL_ERROR)
+        set_channel_state(conn, channel, GLUE_CHANNEL_NONE);
 
     if (SPICE_IS_MAIN_CHANNEL(channel)) {
         conn->main = NULL;
@@ -177,9 +233,14 @@ static void channel_destroy(SpiceSession *s, SpiceChannel *channel, gpointer dat
     }
 
     if (conn->enable_sound && SPICE_IS_PLAYBACK_CHANNEL(channel)) {
+        glue_audio_disconnect_playback(SPICE_PLAYBACK_CHANNEL(channel));
         conn->audio = NULL;
     }
 
+    if (SPICE_IS_RECORD_CHANNEL(channel)) {
+        glue_audio_disconnect_record(SPICE_RECORD_CHANNEL(channel));
+    }
+
     if (conn->channels > 0) {
         return;
     }
@@ -203,6 +264,278 @@ void spice_connection_disconnect(SpiceConnection *conn)
     spice_session_disconnect(conn->session);
 }
 
+/*
+ * Connection options, for the next connections. Session properties are set
+ * before connecting, and the display preferences are sent when the display
+ * channel is linked, if the server supports them.
+ */
+#define MAX_VIDEO_CODECS 8
+#define MAX_CACHE_SIZE (1 << 30)
+/* Share of the cache memory budget for the GLZ dictionary, and its limits */
+#define GLZ_BUDGET_DIVISOR 4
+#define MIN_GLZ_WINDOW_SIZE (1 << 20)
+#define MAX_GLZ_WINDOW_SIZE (1 << 25)
+
+static struct {
+    gint compression;       /* SpiceImageCompression, -1 for the server default */
+    gint codecs[MAX_VIDEO_CODECS];
+    gint numCodecs;
+    gint cacheSize;         /* In bytes, -1 for the default */
+    gint glzWindowSize;     /* In bytes, -1 for the default */
+    gint colorDepth;        /* 16 or 32, -1 for the default */
+    gint cacheBudget;       /* In MiB, 0 for none */
+} options = {
+    .compression = -1,
+    .cacheSize = -1,
+    .glzWindowSize = -1,
+    .colorDepth = -1,
+};
+
+typedef struct {
+    const char *name;
+    gint value;
+} OptionName;
+
+static const OptionName compressionNames[] = {
+    { "off", SPICE_IMAGE_COMPRESSION_OFF },
+    { "auto-glz", SPICE_IMAGE_COMPRESSION_AUTO_GLZ },
+    { "auto-lz", SPICE_IMAGE_COMPRESSION_AUTO_LZ },
+    { "quic", SPICE_IMAGE_COMPRESSION_QUIC },
+    { "glz", SPICE_IMAGE_COMPRESSION_GLZ },
+    { "lz", SPICE_IMAGE_COMPRESSION_LZ },
+    { "lz4", SPICE_IMAGE_COMPRESSION_LZ4 },
+}, codecNames[] = {
+    { "mjpeg", SPICE_VIDEO_CODEC_TYPE_MJPEG },
+    { "vp8", SPICE_VIDEO_CODEC_TYPE_VP8 },
+    { "h264", SPICE_VIDEO_CODEC_TYPE_H264 },
+};
+
+static const char *option_name(const OptionName *names, gsize n, gint value)
+{
+    gsize i;
+
+    for (i = 0; i < n; i++) {
+        if (names[i].value == value)
+            return names[i].name;
+    }
+    return "unknown";
+}
+
+static gboolean parse_int(const char *value, gint min, gint max, gint *result)
+{
+    gchar *end;
+    gint64 v = g_ascii_strtoll(value, &end, 10);
+
+    if (*value == '\0' || *end != '\0' || v < min || v > max)
+        return FALSE;
+    *result = v;
+    return TRUE;
+}
+
+static gboolean parse_codecs(const char *value)
+{
+    gchar **names = g_strsplit(value, ",", -1);
+    gint codecs[MAX_VIDEO_CODECS], n = 0, i, j;
+    gboolean valid = TRUE;
+
+    for (i = 0; names[i] != NULL && valid; i++) {
+        gchar *name = g_strstrip(names[i]);
+        valid = n < MAX_VIDEO_CODECS;
+        for (j = 0; j < G_N_ELEMENTS(codecNames) && valid; j++) {
+            if (g_ascii_strcasecmp(name, codecNames[j].name) == 0)
+                break;
+        }
+        if (j == G_N_ELEMENTS(codecNames))
+            valid = FALSE;
+        else if (valid)
+            codecs[n++] = codecNames[j].value;
+    }
+    g_strfreev(names);
+
+    if (!valid || n == 0)
+        return FALSE;
+    memcpy(options.codecs, codecs, n * sizeof(gint));
+    options.numCodecs = n;
+    return TRUE;
+}
+
+int32_t SpiceGlibGlue_SetConnectionOption(const char *key, const char *value)
+{
+    gboolean valid = FALSE;
+    int i;
+
+    if (key == NULL || value == NULL)
+        return -2;
+
+    if (strcmp(key, "compression") == 0) {
+        for (i = 0; i < G_N_ELEMENTS(compressionNames); i++) {
+            if (g_ascii_strcasecmp(value, compressionNames[i].name) == 0) {
+                options.compression = compressionNames[i].value;
+                valid = TRUE;
+            }
+        }
+    } else if (strcmp(key, "video-codecs") == 0) {
+        valid = parse_codecs(value);
+    } else if (strcmp(key, "image-cache-size") == 0) {
+        valid = parse_int(value, 1, MAX_CACHE_SIZE, &options.cacheSize);
+    } else if (strcmp(key, "glz-window-size") == 0) {
+        valid = parse_int(value, 1, MAX_CACHE_SIZE, &options.glzWindowSize);
+    } else if (strcmp(key, "color-depth") == 0) {
+        gint depth;
+        valid = parse_int(value, 16, 32, &depth) && (depth == 16 || depth == 32);
+        if (valid)
+            options.colorDepth = depth;
+    } else {
+        g_warning("Unknown connection option %s", key);
+        return -1;
+    }
+
+    if (!valid) {
+        g_warning("Invalid value \"%s\" for connection option %s", value, key);
+        return -2;
+    }
+    SPICE_DEBUG("Connection option %s = %s", key, value);
+    return 0;
+}
+
+void SpiceGlibGlue_ClearConnectionOptions(void)
+{
+    options.compression = options.cacheSize = options.glzWindowSize = options.colorDepth = -1;
+    options.numCodecs = 0;
+    options.cacheBudget = 0;
+}
+
+void SpiceGlibGlue_SetCacheMemoryBudget(int32_t megabytes)
+{
+    if (megabytes < 0 || megabytes > MAX_CACHE_SIZE >> 20) {
+        g_warning("Invalid cache memory budget %d MiB", megabytes);
+        return;
+    }
+    SPICE_DEBUG("Cache memory budget %d MiB", megabytes);
+    options.cacheBudget = megabytes;
+}
+
+void spice_connection_split_cache_budget(gint budgetMiB, gint *cacheSize, gint *glzWindowSize)
+{
+    gint64 budget = (gint64)budgetMiB << 20;
+    gint64 glz;
+
+    /* The budget only sizes what was not set explicitly */
+    if (budgetMiB <= 0)
+        return;
+    glz = *glzWindowSize > 0 ? *glzWindowSize :
+        CLAMP(budget / GLZ_BUDGET_DIVISOR, MIN_GLZ_WINDOW_SIZE, MAX_GLZ_WINDOW_SIZE);
+    if (*glzWindowSize <= 0)
+        *glzWindowSize = glz;
+    if (*cacheSize <= 0)
+        *cacheSize = MAX(budget - glz, MIN_GLZ_WINDOW_SIZE);
+}
+
+static void apply_session_options(SpiceSession *session)
+{
+    gint cacheSize = options.cacheSize, glzWindowSize = options.glzWindowSize;
+
+    if (options.cacheBudget > 0) {
+        spice_connection_split_cache_budget(options.cacheBudget, &cacheSize, &glzWindowSize);
+        g_message("Cache memory budget %d MiB: image cache %d bytes, glz window %d bytes",
+                  options.cacheBudget, cacheSize, glzWindowSize);
+    }
+
+    if (cacheSize > 0)
+        g_object_set(session, "cache-size", cacheSize, NULL);
+    if (glzWindowSize > 0)
+        g_object_set(session, "glz-window-size", glzWindowSize, NULL);
+    if (options.colorDepth > 0)
+        g_object_set(session, "color-depth", options.colorDepth, NULL);
+}
+
+#define YES_NO(b) ((b) ? "yes" : "no")
+
+gint spice_connection_send_display_preferences(SpiceChannel *channel,
+                                               gint fallbackCompression, gint fallbackCodec)
+{
+    gint compression = options.compression >= 0 ? options.compression : fallbackCompression;
+    const gint *codecs = options.numCodecs > 0 ? options.codecs : &fallbackCodec;
+    gint numCodecs = options.numCodecs > 0 ? options.numCodecs : fallbackCodec >= 0;
+    gint codecsSent = 0;
+
+#if SPICE_GTK_CHECK_VERSION(0, 31, 0)
+    if (compression >= 0 &&
+        spice_channel_test_capability(channel, SPICE_DISPLAY_CAP_PREF_COMPRESSION))
+        spice_display_channel_change_preferred_compression(channel, compression);
+#endif
+#if SPICE_GTK_CHECK_VERSION(0, 38, 0)
+    if (numCodecs > 0 &&
+        spice_channel_test_capability(channel, SPICE_DISPLAY_CAP_PREF_VIDEO_CODEC_TYPE)) {
+        GError *err = NULL;
+        if (spice_display_channel_change_preferred_video_codec_types(channel, codecs,
+                                                                     numCodecs, &err)) {
+            codecsSent = numCodecs;
+        } else {
+            SPICE_DEBUG("Video codecs not accepted: %s", err->message);
+            g_clear_error(&err);
+        }
+    }
+#elif SPICE_GTK_CHECK_VERSION(0, 34, 0)
+    if (numCodecs > 0 &&
+        spice_channel_test_capability(channel, SPICE_DISPLAY_CAP_PREF_VIDEO_CODEC_TYPE)) {
+        /* Only the first one can be sent */
+        spice_display_channel_change_preferred_video_codec_type(channel, codecs[0]);
+        codecsSent = 1;
+    }
+#endif
+    return codecsSent;
+}
+
+/* Sends the display preferences, once the display channel is linked and the
+ * server capabilities are known, and logs what is in effect. */
+static void apply_display_options(SpiceChannel *channel)
+{
+    gint cacheSize = 0, glzWindowSize = 0, colorDepth = 0;
+    gboolean prefCompression = FALSE, prefCodec = FALSE;
+    gint codecsSent = 0;
+    const char *compression = "server default";
+    GString *codecs = g_string_new(NULL);
+    SpiceSession *session;
+    gint i;
+
+    g_object_get(channel, "spice-session", &session, NULL);
+    if (session != NULL) {
+        g_object_get(session, "cache-size", &cacheSize,
+                     "glz-window-size", &glzWindowSize,
+                     "color-depth", &colorDepth, NULL);
+        g_object_unref(session);
+    }
+
+#if SPICE_GTK_CHECK_VERSION(0, 31, 0)
+    prefCompression = spice_channel_test_capability(channel, SPICE_DISPLAY_CAP_PREF_COMPRESSION);
+    if (options.compression >= 0 && prefCompression) {
+        compression = option_name(compressionNames, G_N_ELEMENTS(compressionNames),
+                                  options.compression);
+    }
+#endif
+#if SPICE_GTK_CHECK_VERSION(0, 34, 0)
+    prefCodec = spice_channel_test_capability(channel, SPICE_DISPLAY_CAP_PREF_VIDEO_CODEC_TYPE);
+#endif
+    codecsSent = spice_connection_send_display_preferences(channel, -1, -1);
+    for (i = 0; i < codecsSent; i++) {
+        g_string_append_printf(codecs, "%s%s", i ? "," : "",
+                               option_name(codecNames, G_N_ELEMENTS(codecNames),
+                                           options.codecs[i]));
+    }
+
+    g_message("Display negotiated: image cache %d bytes, glz window %d bytes, color depth %d",
+              cacheSize, glzWindowSize, colorDepth);
+    g_message("Display negotiated: compression %s, video codecs %s",
+              compression, codecsSent ? codecs->str : "server default");
+    g_message("Display server capabilities: preferred compression %s, preferred video codec %s, "
+              "stream report %s, sized streams %s",
+              YES_NO(prefCompression), YES_NO(prefCodec),
+              YES_NO(spice_channel_test_capability(channel, SPICE_DISPLAY_CAP_STREAM_REPORT)),
+              YES_NO(spice_channel_test_capability(channel, SPICE_DISPLAY_CAP_SIZED_STREAM)));
+    g_string_free(codecs, TRUE);
+}
+
 /* Saver config parameters to session Object*/
 void spice_connection_setup(SpiceConnection *conn, const char *host,
 			 const char *port,
@@ -231,6 +564,7 @@ void spice_connection_setup(SpiceConnection *conn, const char *host,
         g_object_set(conn->session, "ca-file", ca_file, NULL);
     if (cert_subj)
         g_object_set(conn->session, "cert-subject", cert_subj, NULL);
+    apply_session_options(conn->session);
     conn->enable_sound = enable_sound;
 }
 
@@ -239,11 +573,28 @@ SpiceDisplay *spice_connection_get_display(SpiceConnection *conn)
     return conn->display;
 }
 
+SpiceSession *spice_connection_get_session(SpiceConnection *conn)
+{
+    return conn->session;
+}
+
 int spice_connection_get_num_channels(SpiceConnection *conn)
 {
     return conn->channels;
 }
 
+int spice_connection_get_channel_state(SpiceConnection *conn, int channel_type)
+{
+    if (channel_type < 0 || channel_type >= GLUE_MAX_CHANNEL_TYPES)
+        return GLUE_CHANNEL_NONE;
+    return conn->channel_states[channel_type];
+}
+
+void spice_connection_set_display_usable_func(SpiceConnectionUsableFunc func)
+{
+    display_usable_func = func;
+}
+
 void spice_connection_power_event_request(SpiceConnection *conn, int powerEvent)
 {
 #ifndef SPICEGLUE_DISABLE_POWER
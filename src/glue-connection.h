@@ -26,6 +26,18 @@
 #include <glib-object.h>
 #include "glue-spice-widget.h"
 
+/*
+ * State of the first channel of each type (SPICE_CHANNEL_*). A channel is
+ * ready when it is linked, except the display, which is ready when it shows
+ * its first frame.
+ */
+#define GLUE_CHANNEL_NONE       0
+#define GLUE_CHANNEL_CONNECTING 1
+#define GLUE_CHANNEL_LINKED     2
+#define GLUE_CHANNEL_READY      3
+#define GLUE_CHANNEL_ERROR      4
+#define GLUE_MAX_CHANNEL_TYPES  16
+
 #define SPICE_CONNECTION_TYPE (spice_connection_get_type())
 G_DECLARE_FINAL_TYPE(SpiceConnection, spice_connection, SPICE, CONNECTION, GObject)
 
@@ -38,11 +50,44 @@ void spice_connection_setup(SpiceConnection *conn, const char *host,
 			 const char *cert_subj,
              gboolean enable_sound);
 
+/*
+ * Options for the next connections, before SpiceGlibGlue_Connect():
+ * - compression: off, auto-glz, auto-lz, quic, glz, lz or lz4
+ * - video-codecs: comma separated list of mjpeg, vp8 and h264, by preference
+ * - image-cache-size, glz-window-size: in bytes
+ * - color-depth: 16 or 32
+ * Returns 0, -1 for an unknown key, or -2 for an invalid value.
+ */
+int32_t SpiceGlibGlue_SetConnectionOption(const char *key, const char *value);
+void SpiceGlibGlue_ClearConnectionOptions(void);
+
+/* Memory for the image cache and the GLZ dictionary of the next connections,
+ * in MiB, split between them unless their sizes are set as options.
+ * 0 leaves the spice-glib defaults. */
+void SpiceGlibGlue_SetCacheMemoryBudget(int32_t megabytes);
+
+/* Splits a cache memory budget, in MiB, between the image cache and the GLZ
+ * window, a quarter of it within 1 and 32 MiB. Only the sizes that are not
+ * positive are set, the others take their share of the budget. */
+void spice_connection_split_cache_budget(gint budgetMiB, gint *cacheSize, gint *glzWindowSize);
+
+/* Sends the compression and video codecs set as options to a linked display
+ * channel, those the server supports. Where they are not set, fallbackCompression
+ * and fallbackCodec are sent instead, unless they are -1. Returns the number
+ * of video codecs sent. Called in the glib mainloop. */
+gint spice_connection_send_display_preferences(SpiceChannel *channel,
+                                               gint fallbackCompression, gint fallbackCodec);
+
 SpiceConnection *spice_connection_new(void);
 void spice_connection_connect(SpiceConnection *conn);
 void spice_connection_disconnect(SpiceConnection *conn);
 SpiceDisplay *spice_connection_get_display(SpiceConnection *conn);
+SpiceSession *spice_connection_get_session(SpiceConnection *conn);
 int spice_connection_get_num_channels(SpiceConnection *conn);
+int spice_connection_get_channel_state(SpiceConnection *conn, int channel_type);
+/* Called in the glib mainloop when the display of a connection becomes usable. */
+typedef void (*SpiceConnectionUsableFunc)(SpiceConnection *conn);
+void spice_connection_set_display_usable_func(SpiceConnectionUsableFunc func);
 void spice_connection_power_event_request(SpiceConnection *conn, int powerEvent);
 
 #endif /* _ANDROID_SPICY_H */
@@ -0,0 +1,380 @@
+/**
+ * Copyright (C) 2016 flexVDI (Flexible Software Solutions S.L.)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <spice-client.h>
+
+#include "glue-keymaps.h"
+
+/* Linux input event codes, at offset o. Up to KEY_KPDOT, they are the
+ * scancodes. */
+#define EVDEV_KEYMAP(o)                                                         \
+    [(o) + 1] = 0x01, [(o) + 2] = 0x02, [(o) + 3] = 0x03, [(o) + 4] = 0x04,     \
+    [(o) + 5] = 0x05, [(o) + 6] = 0x06, [(o) + 7] = 0x07, [(o) + 8] = 0x08,     \
+    [(o) + 9] = 0x09, [(o) + 10] = 0x0a, [(o) + 11] = 0x0b, [(o) + 12] = 0x0c,  \
+    [(o) + 13] = 0x0d, [(o) + 14] = 0x0e, [(o) + 15] = 0x0f, [(o) + 16] = 0x10, \
+    [(o) + 17] = 0x11, [(o) + 18] = 0x12, [(o) + 19] = 0x13, [(o) + 20] = 0x14, \
+    [(o) + 21] = 0x15, [(o) + 22] = 0x16, [(o) + 23] = 0x17, [(o) + 24] = 0x18, \
+    [(o) + 25] = 0x19, [(o) + 26] = 0x1a, [(o) + 27] = 0x1b, [(o) + 28] = 0x1c, \
+    [(o) + 29] = 0x1d, [(o) + 30] = 0x1e, [(o) + 31] = 0x1f, [(o) + 32] = 0x20, \
+    [(o) + 33] = 0x21, [(o) + 34] = 0x22, [(o) + 35] = 0x23, [(o) + 36] = 0x24, \
+    [(o) + 37] = 0x25, [(o) + 38] = 0x26, [(o) + 39] = 0x27, [(o) + 40] = 0x28, \
+    [(o) + 41] = 0x29, [(o) + 42] = 0x2a, [(o) + 43] = 0x2b, [(o) + 44] = 0x2c, \
+    [(o) + 45] = 0x2d, [(o) + 46] = 0x2e, [(o) + 47] = 0x2f, [(o) + 48] = 0x30, \
+    [(o) + 49] = 0x31, [(o) + 50] = 0x32, [(o) + 51] = 0x33, [(o) + 52] = 0x34, \
+    [(o) + 53] = 0x35, [(o) + 54] = 0x36, [(o) + 55] = 0x37, [(o) + 56] = 0x38, \
+    [(o) + 57] = 0x39, [(o) + 58] = 0x3a, [(o) + 59] = 0x3b, [(o) + 60] = 0x3c, \
+    [(o) + 61] = 0x3d, [(o) + 62] = 0x3e, [(o) + 63] = 0x3f, [(o) + 64] = 0x40, \
+    [(o) + 65] = 0x41, [(o) + 66] = 0x42, [(o) + 67] = 0x43, [(o) + 68] = 0x44, \
+    [(o) + 69] = 0x45, [(o) + 70] = 0x46, [(o) + 71] = 0x47, [(o) + 72] = 0x48, \
+    [(o) + 73] = 0x49, [(o) + 74] = 0x4a, [(o) + 75] = 0x4b, [(o) + 76] = 0x4c, \
+    [(o) + 77] = 0x4d, [(o) + 78] = 0x4e, [(o) + 79] = 0x4f, [(o) + 80] = 0x50, \
+    [(o) + 81] = 0x51, [(o) + 82] = 0x52, [(o) + 83] = 0x53,                    \
+    [(o) + 86] = 0x56,    /* KEY_102ND */                                       \
+    [(o) + 87] = 0x57,    /* KEY_F11 */                                         \
+    [(o) + 88] = 0x58,    /* KEY_F12 */                                         \
+    [(o) + 89] = 0x73,    /* KEY_RO */                                          \
+    [(o) + 96] = 0x11c,   /* KEY_KPENTER */                                     \
+    [(o) + 97] = 0x11d,   /* KEY_RIGHTCTRL */                                   \
+    [(o) + 98] = 0x135,   /* KEY_KPSLASH */                                     \
+    [(o) + 99] = 0x137,   /* KEY_SYSRQ */                                       \
+    [(o) + 100] = 0x138,  /* KEY_RIGHTALT */                                    \
+    [(o) + 102] = 0x147,  /* KEY_HOME */                                        \
+    [(o) + 103] = 0x148,  /* KEY_UP */                                          \
+    [(o) + 104] = 0x149,  /* KEY_PAGEUP */                                      \
+    [(o) + 105] = 0x14b,  /* KEY_LEFT */                                        \
+    [(o) + 106] = 0x14d,  /* KEY_RIGHT */                                       \
+    [(o) + 107] = 0x14f,  /* KEY_END */                                         \
+    [(o) + 108] = 0x150,  /* KEY_DOWN */                                        \
+    [(o) + 109] = 0x151,  /* KEY_PAGEDOWN */                                    \
+    [(o) + 110] = 0x152,  /* KEY_INSERT */                                      \
+    [(o) + 111] = 0x153,  /* KEY_DELETE */                                      \
+    [(o) + 113] = 0x120,  /* KEY_MUTE */                                        \
+    [(o) + 114] = 0x12e,  /* KEY_VOLUMEDOWN */                                  \
+    [(o) + 115] = 0x130,  /* KEY_VOLUMEUP */                                    \
+    [(o) + 116] = 0x15e,  /* KEY_POWER */                                       \
+    [(o) + 117] = 0x59,   /* KEY_KPEQUAL */                                     \
+    [(o) + 119] = 0x146,  /* KEY_PAUSE */                                       \
+    [(o) + 121] = 0x7e,   /* KEY_KPCOMMA */                                     \
+    [(o) + 124] = 0x7d,   /* KEY_YEN */                                         \
+    [(o) + 125] = 0x15b,  /* KEY_LEFTMETA */                                    \
+    [(o) + 126] = 0x15c,  /* KEY_RIGHTMETA */                                   \
+    [(o) + 127] = 0x15d,  /* KEY_COMPOSE */
+
+static const uint16_t keymap_evdev[] = { EVDEV_KEYMAP(0) };
+
+/* The same, with the X11 evdev driver offset */
+static const uint16_t keymap_xorg_evdev[] = { EVDEV_KEYMAP(8) };
+
+/* macOS virtual keycodes, from HIToolbox/Events.h */
+static const uint16_t keymap_macos[] = {
+    [0x00] = 0x1e,  /* kVK_ANSI_A */
+    [0x01] = 0x1f,  /* kVK_ANSI_S */
+    [0x02] = 0x20,  /* kVK_ANSI_D */
+    [0x03] = 0x21,  /* kVK_ANSI_F */
+    [0x04] = 0x23,  /* kVK_ANSI_H */
+    [0x05] = 0x22,  /* kVK_ANSI_G */
+    [0x06] = 0x2c,  /* kVK_ANSI_Z */
+    [0x07] = 0x2d,  /* kVK_ANSI_X */
+    [0x08] = 0x2e,  /* kVK_ANSI_C */
+    [0x09] = 0x2f,  /* kVK_ANSI_V */
+    [0x0a] = 0x56,  /* kVK_ISO_Section */
+    [0x0b] = 0x30,  /* kVK_ANSI_B */
+    [0x0c] = 0x10,  /* kVK_ANSI_Q */
+    [0x0d] = 0x11,  /* kVK_ANSI_W */
+    [0x0e] = 0x12,  /* kVK_ANSI_E */
+    [0x0f] = 0x13,  /* kVK_ANSI_R */
+    [0x10] = 0x15,  /* kVK_ANSI_Y */
+    [0x11] = 0x14,  /* kVK_ANSI_T */
+    [0x12] = 0x02,  /* kVK_ANSI_1 */
+    [0x13] = 0x03,  /* kVK_ANSI_2 */
+    [0x14] = 0x04,  /* kVK_ANSI_3 */
+    [0x15] = 0x05,  /* kVK_ANSI_4 */
+    [0x16] = 0x07,  /* kVK_ANSI_6 */
+    [0x17] = 0x06,  /* kVK_ANSI_5 */
+    [0x18] = 0x0d,  /* kVK_ANSI_Equal */
+    [0x19] = 0x0a,  /* kVK_ANSI_9 */
+    [0x1a] = 0x08,  /* kVK_ANSI_7 */
+    [0x1b] = 0x0c,  /* kVK_ANSI_Minus */
+    [0x1c] = 0x09,  /* kVK_ANSI_8 */
+    [0x1d] = 0x0b,  /* kVK_ANSI_0 */
+    [0x1e] = 0x1b,  /* kVK_ANSI_RightBracket */
+    [0x1f] = 0x18,  /* kVK_ANSI_O */
+    [0x20] = 0x16,  /* kVK_ANSI_U */
+    [0x21] = 0x1a,  /* kVK_ANSI_LeftBracket */
+    [0x22] = 0x17,  /* kVK_ANSI_I */
+    [0x23] = 0x19,  /* kVK_ANSI_P */
+    [0x24] = 0x1c,  /* kVK_Return */
+    [0x25] = 0x26,  /* kVK_ANSI_L */
+    [0x26] = 0x24,  /* kVK_ANSI_J */
+    [0x27] = 0x28,  /* kVK_ANSI_Quote */
+    [0x28] = 0x25,  /* kVK_ANSI_K */
+    [0x29] = 0x27,  /* kVK_ANSI_Semicolon */
+    [0x2a] = 0x2b,  /* kVK_ANSI_Backslash */
+    [0x2b] = 0x33,  /* kVK_ANSI_Comma */
+    [0x2c] = 0x35,  /* kVK_ANSI_Slash */
+    [0x2d] = 0x31,  /* kVK_ANSI_N */
+    [0x2e] = 0x32,  /* kVK_ANSI_M */
+    [0x2f] = 0x34,  /* kVK_ANSI_Period */
+    [0x30] = 0x0f,  /* kVK_Tab */
+    [0x31] = 0x39,  /* kVK_Space */
+    [0x32] = 0x29,  /* kVK_ANSI_Grave */
+    [0x33] = 0x0e,  /* kVK_Delete */
+    [0x35] = 0x01,  /* kVK_Escape */
+    [0x36] = 0x15c, /* kVK_RightCommand */
+    [0x37] = 0x15b, /* kVK_Command */
+    [0x38] = 0x2a,  /* kVK_Shift */
+    [0x39] = 0x3a,  /* kVK_CapsLock */
+    [0x3a] = 0x38,  /* kVK_Option */
+    [0x3b] = 0x1d,  /* kVK_Control */
+    [0x3c] = 0x36,  /* kVK_RightShift */
+    [0x3d] = 0x138, /* kVK_RightOption */
+    [0x3e] = 0x11d, /* kVK_RightControl */
+    [0x41] = 0x53,  /* kVK_ANSI_KeypadDecimal */
+    [0x43] = 0x37,  /* kVK_ANSI_KeypadMultiply */
+    [0x45] = 0x4e,  /* kVK_ANSI_KeypadPlus */
+    [0x47] = 0x45,  /* kVK_ANSI_KeypadClear, as Num Lock */
+    [0x48] = 0x130, /* kVK_VolumeUp */
+    [0x49] = 0x12e, /* kVK_VolumeDown */
+    [0x4a] = 0x120, /* kVK_Mute */
+    [0x4b] = 0x135, /* kVK_ANSI_KeypadDivide */
+    [0x4c] = 0x11c, /* kVK_ANSI_KeypadEnter */
+    [0x4e] = 0x4a,  /* kVK_ANSI_KeypadMinus */
+    [0x51] = 0x59,  /* kVK_ANSI_KeypadEquals */
+    [0x52] = 0x52,  /* kVK_ANSI_Keypad0 */
+    [0x53] = 0x4f,  /* kVK_ANSI_Keypad1 */
+    [0x54] = 0x50,  /* kVK_ANSI_Keypad2 */
+    [0x55] = 0x51,  /* kVK_ANSI_Keypad3 */
+    [0x56] = 0x4b,  /* kVK_ANSI_Keypad4 */
+    [0x57] = 0x4c,  /* kVK_ANSI_Keypad5 */
+    [0x58] = 0x4d,  /* kVK_ANSI_Keypad6 */
+    [0x59] = 0x47,  /* kVK_ANSI_Keypad7 */
+    [0x5b] = 0x48,  /* kVK_ANSI_Keypad8 */
+    [0x5c] = 0x49,  /* kVK_ANSI_Keypad9 */
+    [0x5d] = 0x7d,  /* kVK_JIS_Yen */
+    [0x5e] = 0x73,  /* kVK_JIS_Underscore */
+    [0x5f] = 0x7e,  /* kVK_JIS_KeypadComma */
+    [0x60] = 0x3f,  /* kVK_F5 */
+    [0x61] = 0x40,  /* kVK_F6 */
+    [0x62] = 0x41,  /* kVK_F7 */
+    [0x63] = 0x3d,  /* kVK_F3 */
+    [0x64] = 0x42,  /* kVK_F8 */
+    [0x65] = 0x43,  /* kVK_F9 */
+    [0x67] = 0x57,  /* kVK_F11 */
+    [0x68] = 0x70,  /* kVK_JIS_Kana */
+    [0x6d] = 0x44,  /* kVK_F10 */
+    [0x6f] = 0x58,  /* kVK_F12 */
+    [0x72] = 0x152, /* kVK_Help, as Insert */
+    [0x73] = 0x147, /* kVK_Home */
+    [0x74] = 0x149, /* kVK_PageUp */
+    [0x75] = 0x153, /* kVK_ForwardDelete */
+    [0x76] = 0x3e,  /* kVK_F4 */
+    [0x77] = 0x14f, /* kVK_End */
+    [0x78] = 0x3c,  /* kVK_F2 */
+    [0x79] = 0x151, /* kVK_PageDown */
+    [0x7a] = 0x3b,  /* kVK_F1 */
+    [0x7b] = 0x14b, /* kVK_LeftArrow */
+    [0x7c] = 0x14d, /* kVK_RightArrow */
+    [0x7d] = 0x150, /* kVK_DownArrow */
+    [0x7e] = 0x148, /* kVK_UpArrow */
+};
+
+/* Android keycodes, from android/keycodes.h */
+static const uint16_t keymap_android[] = {
+    [7] = 0x0b,     /* AKEYCODE_0 */
+    [8] = 0x02, [9] = 0x03, [10] = 0x04, [11] = 0x05, [12] = 0x06,
+    [13] = 0x07, [14] = 0x08, [15] = 0x09, [16] = 0x0a,
+    [19] = 0x148,   /* AKEYCODE_DPAD_UP */
+    [20] = 0x150,   /* AKEYCODE_DPAD_DOWN */
+    [21] = 0x14b,   /* AKEYCODE_DPAD_LEFT */
+    [22] = 0x14d,   /* AKEYCODE_DPAD_RIGHT */
+    [24] = 0x130,   /* AKEYCODE_VOLUME_UP */
+    [25] = 0x12e,   /* AKEYCODE_VOLUME_DOWN */
+    [26] = 0x15e,   /* AKEYCODE_POWER */
+    [29] = 0x1e, [30] = 0x30, [31] = 0x2e, [32] = 0x20, [33] = 0x12,   /* A - E */
+    [34] = 0x21, [35] = 0x22, [36] = 0x23, [37] = 0x17, [38] = 0x24,   /* F - J */
+    [39] = 0x25, [40] = 0x26, [41] = 0x32, [42] = 0x31, [43] = 0x18,   /* K - O */
+    [44] = 0x19, [45] = 0x10, [46] = 0x13, [47] = 0x1f, [48] = 0x14,   /* P - T */
+    [49] = 0x16, [50] = 0x2f, [51] = 0x11, [52] = 0x2d, [53] = 0x15,   /* U - Y */
+    [54] = 0x2c,                                                       /* Z */
+    [55] = 0x33,    /* AKEYCODE_COMMA */
+    [56] = 0x34,    /* AKEYCODE_PERIOD */
+    [57] = 0x38,    /* AKEYCODE_ALT_LEFT */
+    [58] = 0x138,   /* AKEYCODE_ALT_RIGHT */
+    [59] = 0x2a,    /* AKEYCODE_SHIFT_LEFT */
+    [60] = 0x36,    /* AKEYCODE_SHIFT_RIGHT */
+    [61] = 0x0f,    /* AKEYCODE_TAB */
+    [62] = 0x39,    /* AKEYCODE_SPACE */
+    [66] = 0x1c,    /* AKEYCODE_ENTER */
+    [67] = 0x0e,    /* AKEYCODE_DEL, backspace */
+    [68] = 0x29,    /* AKEYCODE_GRAVE */
+    [69] = 0x0c,    /* AKEYCODE_MINUS */
+    [70] = 0x0d,    /* AKEYCODE_EQUALS */
+    [71] = 0x1a,    /* AKEYCODE_LEFT_BRACKET */
+    [72] = 0x1b,    /* AKEYCODE_RIGHT_BRACKET */
+    [73] = 0x2b,    /* AKEYCODE_BACKSLASH */
+    [74] = 0x27,    /* AKEYCODE_SEMICOLON */
+    [75] = 0x28,    /* AKEYCODE_APOSTROPHE */
+    [76] = 0x35,    /* AKEYCODE_SLASH */
+    [82] = 0x15d,   /* AKEYCODE_MENU */
+    [92] = 0x149,   /* AKEYCODE_PAGE_UP */
+    [93] = 0x151,   /* AKEYCODE_PAGE_DOWN */
+    [111] = 0x01,   /* AKEYCODE_ESCAPE */
+    [112] = 0x153,  /* AKEYCODE_FORWARD_DEL */
+    [113] = 0x1d,   /* AKEYCODE_CTRL_LEFT */
+    [114] = 0x11d,  /* AKEYCODE_CTRL_RIGHT */
+    [115] = 0x3a,   /* AKEYCODE_CAPS_LOCK */
+    [116] = 0x46,   /* AKEYCODE_SCROLL_LOCK */
+    [117] = 0x15b,  /* AKEYCODE_META_LEFT */
+    [118] = 0x15c,  /* AKEYCODE_META_RIGHT */
+    [120] = 0x137,  /* AKEYCODE_SYSRQ */
+    [121] = 0x146,  /* AKEYCODE_BREAK */
+    [122] = 0x147,  /* AKEYCODE_MOVE_HOME */
+    [123] = 0x14f,  /* AKEYCODE_MOVE_END */
+    [124] = 0x152,  /* AKEYCODE_INSERT */
+    [131] = 0x3b, [132] = 0x3c, [133] = 0x3d, [134] = 0x3e,            /* F1 - F4 */
+    [135] = 0x3f, [136] = 0x40, [137] = 0x41, [138] = 0x42,            /* F5 - F8 */
+    [139] = 0x43, [140] = 0x44, [141] = 0x57, [142] = 0x58,            /* F9 - F12 */
+    [143] = 0x45,   /* AKEYCODE_NUM_LOCK */
+    [144] = 0x52, [145] = 0x4f, [146] = 0x50, [147] = 0x51, [148] = 0x4b, /* Numpad 0 - 4 */
+    [149] = 0x4c, [150] = 0x4d, [151] = 0x47, [152] = 0x48, [153] = 0x49, /* Numpad 5 - 9 */
+    [154] = 0x135,  /* AKEYCODE_NUMPAD_DIVIDE */
+    [155] = 0x37,   /* AKEYCODE_NUMPAD_MULTIPLY */
+    [156] = 0x4a,   /* AKEYCODE_NUMPAD_SUBTRACT */
+    [157] = 0x4e,   /* AKEYCODE_NUMPAD_ADD */
+    [158] = 0x53,   /* AKEYCODE_NUMPAD_DOT */
+    [159] = 0x7e,   /* AKEYCODE_NUMPAD_COMMA */
+    [160] = 0x11c,  /* AKEYCODE_NUMPAD_ENTER */
+    [161] = 0x59,   /* AKEYCODE_NUMPAD_EQUALS */
+    [164] = 0x120,  /* AKEYCODE_VOLUME_MUTE */
+};
+
+/* USB HID usages of the keyboard/keypad page (0x07) */
+static const uint16_t keymap_usb_hid[] = {
+    [0x04] = 0x1e, [0x05] = 0x30, [0x06] = 0x2e, [0x07] = 0x20,        /* A - D */
+    [0x08] = 0x12, [0x09] = 0x21, [0x0a] = 0x22, [0x0b] = 0x23,        /* E - H */
+    [0x0c] = 0x17, [0x0d] = 0x24, [0x0e] = 0x25, [0x0f] = 0x26,        /* I - L */
+    [0x10] = 0x32, [0x11] = 0x31, [0x12] = 0x18, [0x13] = 0x19,        /* M - P */
+    [0x14] = 0x10, [0x15] = 0x13, [0x16] = 0x1f, [0x17] = 0x14,        /* Q - T */
+    [0x18] = 0x16, [0x19] = 0x2f, [0x1a] = 0x11, [0x1b] = 0x2d,        /* U - X */
+    [0x1c] = 0x15, [0x1d] = 0x2c,                                      /* Y - Z */
+    [0x1e] = 0x02, [0x1f] = 0x03, [0x20] = 0x04, [0x21] = 0x05,        /* 1 - 4 */
+    [0x22] = 0x06, [0x23] = 0x07, [0x24] = 0x08, [0x25] = 0x09,        /* 5 - 8 */
+    [0x26] = 0x0a, [0x27] = 0x0b,                                      /* 9 - 0 */
+    [0x28] = 0x1c,  /* Enter */
+    [0x29] = 0x01,  /* Escape */
+    [0x2a] = 0x0e,  /* Backspace */
+    [0x2b] = 0x0f,  /* Tab */
+    [0x2c] = 0x39,  /* Space */
+    [0x2d] = 0x0c,  /* - */
+    [0x2e] = 0x0d,  /* = */
+    [0x2f] = 0x1a,  /* [ */
+    [0x30] = 0x1b,  /* ] */
+    [0x31] = 0x2b,  /* \ */
+    [0x32] = 0x2b,  /* Non-US # */
+    [0x33] = 0x27,  /* ; */
+    [0x34] = 0x28,  /* ' */
+    [0x35] = 0x29,  /* ` */
+    [0x36] = 0x33,  /* , */
+    [0x37] = 0x34,  /* . */
+    [0x38] = 0x35,  /* / */
+    [0x39] = 0x3a,  /* Caps Lock */
+    [0x3a] = 0x3b, [0x3b] = 0x3c, [0x3c] = 0x3d, [0x3d] = 0x3e,        /* F1 - F4 */
+    [0x3e] = 0x3f, [0x3f] = 0x40, [0x40] = 0x41, [0x41] = 0x42,        /* F5 - F8 */
+    [0x42] = 0x43, [0x43] = 0x44, [0x44] = 0x57, [0x45] = 0x58,        /* F9 - F12 */
+    [0x46] = 0x137, /* Print Screen */
+    [0x47] = 0x46,  /* Scroll Lock */
+    [0x48] = 0x146, /* Pause */
+    [0x49] = 0x152, /* Insert */
+    [0x4a] = 0x147, /* Home */
+    [0x4b] = 0x149, /* Page Up */
+    [0x4c] = 0x153, /* Delete */
+    [0x4d] = 0x14f, /* End */
+    [0x4e] = 0x151, /* Page Down */
+    [0x4f] = 0x14d, /* Right */
+    [0x50] = 0x14b, /* Left */
+    [0x51] = 0x150, /* Down */
+    [0x52] = 0x148, /* Up */
+    [0x53] = 0x45,  /* Num Lock */
+    [0x54] = 0x135, /* Keypad / */
+    [0x55] = 0x37,  /* Keypad * */
+    [0x56] = 0x4a,  /* Keypad - */
+    [0x57] = 0x4e,  /* Keypad + */
+    [0x58] = 0x11c, /* Keypad Enter */
+    [0x59] = 0x4f, [0x5a] = 0x50, [0x5b] = 0x51, [0x5c] = 0x4b,        /* Keypad 1 - 4 */
+    [0x5d] = 0x4c, [0x5e] = 0x4d, [0x5f] = 0x47, [0x60] = 0x48,        /* Keypad 5 - 8 */
+    [0x61] = 0x49, [0x62] = 0x52,                                      /* Keypad 9 - 0 */
+    [0x63] = 0x53,  /* Keypad . */
+    [0x64] = 0x56,  /* Non-US \ */
+    [0x65] = 0x15d, /* Application */
+    [0x66] = 0x15e, /* Power */
+    [0x67] = 0x59,  /* Keypad = */
+    [0x7f] = 0x120, /* Mute */
+    [0x80] = 0x130, /* Volume Up */
+    [0x81] = 0x12e, /* Volume Down */
+    [0x85] = 0x7e,  /* Keypad , */
+    [0x87] = 0x73,  /* International1, Ro */
+    [0x89] = 0x7d,  /* International3, Yen */
+    [0xe0] = 0x1d,  /* Left Control */
+    [0xe1] = 0x2a,  /* Left Shift */
+    [0xe2] = 0x38,  /* Left Alt */
+    [0xe3] = 0x15b, /* Left GUI */
+    [0xe4] = 0x11d, /* Right Control */
+    [0xe5] = 0x36,  /* Right Shift */
+    [0xe6] = 0x138, /* Right Alt */
+    [0xe7] = 0x15c, /* Right GUI */
+};
+
+static int keymap = GLUE_KEYMAP_SCANCODE;
+
+const uint16_t *glue_keymap_get(size_t *len)
+{
+    switch (keymap) {
+    case GLUE_KEYMAP_EVDEV:
+        *len = G_N_ELEMENTS(keymap_evdev);
+        return keymap_evdev;
+    case GLUE_KEYMAP_XORG_EVDEV:
+        *len = G_N_ELEMENTS(keymap_xorg_evdev);
+        return keymap_xorg_evdev;
+    case GLUE_KEYMAP_MACOS:
+        *len = G_N_ELEMENTS(keymap_macos);
+        return keymap_macos;
+    case GLUE_KEYMAP_ANDROID:
+        *len = G_N_ELEMENTS(keymap_android);
+        return keymap_android;
+    case GLUE_KEYMAP_USB_HID:
+        *len = G_N_ELEMENTS(keymap_usb_hid);
+        return keymap_usb_hid;
+    default:
+        *len = 0;
+        return NULL;
+    }
+}
+
+int32_t SpiceGlibGlueSetKeymap(int32_t newKeymap)
+{
+    if (newKeymap < 0 || newKeymap >= GLUE_KEYMAP_COUNT) {
+        g_warning("Unknown keymap %d", newKeymap);
+        return -1;
+    }
+    SPICE_DEBUG("Keymap %d", newKeymap);
+    keymap = newKeymap;
+    return 0;
+}
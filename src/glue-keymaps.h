@@ -0,0 +1,47 @@
+/**
+ * Copyright (C) 2016 flexVDI (Flexible Software Solutions S.L.)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Translation of host keycodes to the scancodes sent to the guest (PC/XT set 1,
+ * with 0x100 for the extended, 0xE0 prefixed, ones). The tables are static, so
+ * translating a key is a single array index. By default, keycodes are already
+ * scancodes and are passed through.
+ */
+
+#ifndef _GLUE_KEYMAPS_H
+#define _GLUE_KEYMAPS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define GLUE_KEYMAP_SCANCODE   0   /* No translation */
+#define GLUE_KEYMAP_EVDEV      1   /* Linux input event codes (KEY_*) */
+#define GLUE_KEYMAP_XORG_EVDEV 2   /* X11 keycodes with the evdev driver (KEY_* + 8) */
+#define GLUE_KEYMAP_MACOS      3   /* macOS virtual keycodes (kVK_*) */
+#define GLUE_KEYMAP_ANDROID    4   /* Android keycodes (AKEYCODE_*) */
+#define GLUE_KEYMAP_USB_HID    5   /* USB HID usages of the keyboard page */
+#define GLUE_KEYMAP_COUNT      6
+
+/* Called internally. Table of the selected keymap, indexed by keycode, with 0
+ * for unmapped keys, or NULL for GLUE_KEYMAP_SCANCODE. */
+const uint16_t *glue_keymap_get(size_t *len);
+
+/* Selects the keycodes passed to SpiceGlibGlueKeyEvent(), before connecting.
+ * Returns 0, or -1 if the keymap does not exist. */
+int32_t SpiceGlibGlueSetKeymap(int32_t keymap);
+
+#endif /* _GLUE_KEYMAPS_H */
@@ -32,6 +32,15 @@
  * - when the glue is notified by spice library that the connection with felxVDIAgent is opened
  * it will share the printers in the requestedList.
  *
+ * Printers in the requestedList are shared concurrently by a pool of threads, with at most
+ * sharingWindow share requests in flight, so that a slow printer does not delay the rest.
+ * The client program can follow the progress with SpiceGlibGlueSetPrinterShareCallback()
+ * or SpiceGlibGlueGetPrinterShareProgress().
+ *
+ * The requestedList is saved in a state file, so that it survives client restarts.
+ * When the agent connects, all the requested printers are shared again, since the
+ * agent disconnected them.
+ *
  **/
 #ifdef PRINTING
 #include <stdio.h>
@@ -40,12 +49,28 @@
 #include "glue-service.h"
 #include "glib.h"
 #include "flexvdi-port.h"
+#include "glue-printing.h"
 
 #define MAX_PRINTER_NAME_SIZE 1024
+#define DEFAULT_SHARING_WINDOW 4
 
 // TODO: if the client becomes multisession, this table must be part of the session.
 // Printers shared with the guest.
+// Shared with the threads of sharePool, so it must be accessed with printers_mutex held.
 GHashTable* sharedPrinters;
+static GMutex printers_mutex;
+
+// Pool of threads that share the requested printers when the agent connects.
+static GThreadPool* sharePool;
+static int sharingWindow = DEFAULT_SHARING_WINDOW;
+
+// Progress of the current batch of shares; protected by printers_mutex.
+// batch changes with every agent connection, so that late results of a
+// previous batch are ignored.
+static guint batch;
+static int32_t batchTotal, batchDone, batchFailed;
+static guint32 latencyHistogram[PRINTER_LATENCY_BUCKETS];
+static SpiceGlibGluePrinterShareCallback shareCallback;
 
 // Printers that the user wants to be shared.
 // They may be shared, or not (ie: if there is no flexVDI agent)
@@ -53,10 +78,142 @@ GHashTable* sharedPrinters;
 // This table is per executable; not per guest/session
 GHashTable* requestedSharedPrinters;
 
-// Temporary storage for the list of local printers
-// printers: full list
-// printer: not yet retrieved list.
-GSList * localPrinters, * localPrinter;
+/*
+ * Inventory of local printers.
+ *
+ * Enumerating the printers may take long on print servers with many queues,
+ * so it is done in a background thread every PRINTER_REFRESH_INTERVAL seconds,
+ * and the client program reads the cached result. Each refresh that finds
+ * changes increments inventoryGeneration and logs the added and removed printers,
+ * so that a client program can ask just for the changes since the generation it knows.
+ * printerInventory is never modified, it is replaced by a new sorted array,
+ * so that readers can iterate over a reference to it without locking.
+ */
+#define PRINTER_REFRESH_INTERVAL 30
+#define PRINTER_CHANGE_LOG_SIZE 256
+
+typedef struct {
+	guint32 generation;
+	gboolean added;
+	char* printerName;
+} PrinterChange;
+
+static GMutex inventory_mutex;
+static GPtrArray* printerInventory;
+static guint32 inventoryGeneration;
+static gboolean inventoryListed;  // The printers have been listed at least once
+static GArray* changeLog;         // PrinterChange, in generation order
+static guint32 changeLogStart;    // changeLog holds all the changes after this generation
+static gboolean refreshing;
+static GThread* refreshThread;    // The last refresh thread, joined by the next refresh or on dispose
+static guint refreshSource;
+
+// Iterators of SpiceGlibGlueGetNextLocalPrinter and SpiceGlibGlueGetNextLocalPrinterChange
+static GPtrArray* localPrinters;
+static guint localPrinter;
+static GArray* localChanges;
+static guint localChange;
+
+static void free_printer_change(gpointer data) {
+	g_free(((PrinterChange*)data)->printerName);
+}
+
+static gint compare_printer_names(gconstpointer a, gconstpointer b) {
+	return strcmp(*(const char**)a, *(const char**)b);
+}
+
+static void log_change(guint32 generation, gboolean added, const char* printerName) {
+	PrinterChange change = { generation, added, g_strdup(printerName) };
+	g_array_append_val(changeLog, change);
+}
+
+/*
+ * Replaces the inventory with a new (sorted) list of printers, and logs the changes.
+ * Must be called with inventory_mutex held.
+ */
+static void update_inventory(GPtrArray* printers) {
+	GPtrArray* old = printerInventory;
+	guint32 generation = inventoryGeneration + 1;
+	guint logLen = changeLog->len;
+	guint i = 0, j = 0;
+
+	inventoryListed = TRUE;
+	// Both lists are sorted, so the changes are found in a single pass
+	while (i < old->len || j < printers->len) {
+		int cmp = i == old->len ? 1 : j == printers->len ? -1 :
+			strcmp(g_ptr_array_index(old, i), g_ptr_array_index(printers, j));
+		if (cmp < 0) {
+			log_change(generation, FALSE, g_ptr_array_index(old, i++));
+		} else if (cmp > 0) {
+			log_change(generation, TRUE, g_ptr_array_index(printers, j++));
+		} else {
+			i++, j++;
+		}
+	}
+
+	if (changeLog->len == logLen) {
+		g_ptr_array_unref(printers);
+		return;
+	}
+
+	SPICE_DEBUG("FMP: printer inventory generation %u, %u changes",
+	            generation, changeLog->len - logLen);
+	inventoryGeneration = generation;
+	printerInventory = printers;
+	g_ptr_array_unref(old);
+
+	// Trim the log, removing whole generations
+	while (changeLog->len > PRINTER_CHANGE_LOG_SIZE) {
+		guint32 trimmed = g_array_index(changeLog, PrinterChange, 0).generation;
+		guint n = 0;
+		while (n < changeLog->len && g_array_index(changeLog, PrinterChange, n).generation == trimmed)
+			n++;
+		g_array_remove_range(changeLog, 0, n);
+		changeLogStart = trimmed;
+	}
+}
+
+static void refresh_inventory() {
+	GSList *list = NULL, *l;
+	GPtrArray* printers;
+	gint64 start = g_get_monotonic_time();
+
+	flexvdi_get_printer_list(&list);
+	printers = g_ptr_array_new_with_free_func(g_free);
+	for (l = list; l != NULL; l = l->next) {
+		g_ptr_array_add(printers, l->data);
+	}
+	g_slist_free(list);
+	g_ptr_array_sort(printers, compare_printer_names);
+	SPICE_DEBUG("FMP: %u local printers listed in %" G_GINT64_FORMAT " ms",
+	            printers->len, (g_get_monotonic_time() - start) / 1000);
+
+	g_mutex_lock(&inventory_mutex);
+	update_inventory(printers);
+	g_mutex_unlock(&inventory_mutex);
+}
+
+static gpointer refresh_inventory_thread(gpointer data) {
+	refresh_inventory();
+	g_mutex_lock(&inventory_mutex);
+	refreshing = FALSE;
+	g_mutex_unlock(&inventory_mutex);
+	return NULL;
+}
+
+/* GSourceFunc. Refreshes the inventory in a background thread, unless it is already being refreshed. */
+static gboolean start_inventory_refresh(gpointer data) {
+	g_mutex_lock(&inventory_mutex);
+	if (!refreshing) {
+		refreshing = TRUE;
+		// The previous refresh is over, this just reclaims its thread
+		if (refreshThread)
+			g_thread_join(refreshThread);
+		refreshThread = g_thread_new("printer-inventory", refresh_inventory_thread, NULL);
+	}
+	g_mutex_unlock(&inventory_mutex);
+	return G_SOURCE_CONTINUE;
+}
 
 /*
  * Get a list with the names of the printers installed in the system.
@@ -65,10 +222,19 @@ GSList * localPrinters, * localPrinter;
 void SpiceGlibGlueGetLocalPrinterList() {
 
 	SPICE_DEBUG("FMP: SpiceGlibGlueGetLocalPrinterList");
-	// This call takes 2ms in my system with only local printers. Do not seem to be a need for an asynchronous call
-	flexvdi_get_printer_list(&localPrinters);
+	g_mutex_lock(&inventory_mutex);
+	if (!inventoryListed) {
+		// Not listed yet, do it now
+		g_mutex_unlock(&inventory_mutex);
+		refresh_inventory();
+		g_mutex_lock(&inventory_mutex);
+	}
 	// Initialize iterator
-	localPrinter = localPrinters;
+	if (localPrinters)
+		g_ptr_array_unref(localPrinters);
+	localPrinters = g_ptr_array_ref(printerInventory);
+	localPrinter = 0;
+	g_mutex_unlock(&inventory_mutex);
  }
 
 /*
@@ -76,47 +242,240 @@ void SpiceGlibGlueGetLocalPrinterList() {
  * The StringBuilder passed in "printerName" must EnsureCapacity of at least MAX_PRINTER_NAME_SIZE,
  * which is the limit that we artificially impose.
  * In the next invocation after the last printer is retrieved,
- * the memory of the local list of printers is freed, and an empty ("") string passed back.
+ * the reference to the local list of printers is released, and an empty ("") string passed back.
  * - isShared: true if printerName is shared with the guest.
  */
 void SpiceGlibGlueGetNextLocalPrinter(char* printerName, int32_t* isShared) {
 
 	SPICE_DEBUG("FMP: SpiceGlibGlueGetNextLocalPrinter()");
 
-	// When we get get past the end of the list, free the list
-	if (localPrinter == NULL) {
+	// When we get get past the end of the list, release the list
+	if (localPrinters == NULL || localPrinter >= localPrinters->len) {
 		SPICE_DEBUG("FMP: No more printers.");
 		printerName[0]= '\0';
 
-		g_slist_free_full(localPrinters, g_free);
+		if (localPrinters)
+			g_ptr_array_unref(localPrinters);
 		localPrinters= NULL;
 	} else {
-		strncpy(printerName, (const char *)localPrinter->data, MAX_PRINTER_NAME_SIZE);
-		gboolean inSharedSet = g_hash_table_contains (sharedPrinters, printerName);
+		const char* name = g_ptr_array_index(localPrinters, localPrinter++);
+		g_strlcpy(printerName, name, MAX_PRINTER_NAME_SIZE);
+		g_mutex_lock(&printers_mutex);
+		gboolean inSharedSet = sharedPrinters && g_hash_table_contains (sharedPrinters, name);
+		g_mutex_unlock(&printers_mutex);
 
 		*isShared= inSharedSet?1:0;
-		SPICE_DEBUG("FMP: Found printer %s shared %d", (const char *)localPrinter->data, *isShared);
-        localPrinter = g_slist_next(localPrinter);
+		SPICE_DEBUG("FMP: Found printer %s shared %d", name, *isShared);
 	}
 }
 
+/*
+ * Generation of the inventory of local printers. It changes when printers are added
+ * or removed, and the inventory is refreshed in background.
+ */
+uint32_t SpiceGlibGlueGetLocalPrinterGeneration() {
+	uint32_t generation;
+
+	g_mutex_lock(&inventory_mutex);
+	generation = inventoryGeneration;
+	g_mutex_unlock(&inventory_mutex);
+	return generation;
+}
+
+/* Refreshes the inventory of local printers now, in background. */
+void SpiceGlibGlueRefreshLocalPrinters() {
+	start_inventory_refresh(NULL);
+}
+
+/*
+ * Prepares the list of changes in the local printers after generation sinceGeneration,
+ * to be retrieved with SpiceGlibGlueGetNextLocalPrinterChange.
+ * Returns the generation they lead to, or -1 if the changes are not available
+ * anymore, and the whole list must be retrieved with SpiceGlibGlueGetLocalPrinterList.
+ */
+int64_t SpiceGlibGlueGetLocalPrinterChanges(uint32_t sinceGeneration) {
+	int64_t generation = -1;
+	guint i;
+
+	SPICE_DEBUG("FMP: SpiceGlibGlueGetLocalPrinterChanges(%u)", sinceGeneration);
+	if (localChanges)
+		g_array_unref(localChanges);
+	localChanges = NULL;
+	localChange = 0;
+
+	g_mutex_lock(&inventory_mutex);
+	if (sinceGeneration >= changeLogStart && sinceGeneration <= inventoryGeneration) {
+		localChanges = g_array_new(FALSE, FALSE, sizeof(PrinterChange));
+		g_array_set_clear_func(localChanges, free_printer_change);
+		// The log is in generation order, look for the changes from the end
+		for (i = changeLog->len; i > 0 &&
+		     g_array_index(changeLog, PrinterChange, i - 1).generation > sinceGeneration; i--);
+		for (; i < changeLog->len; i++) {
+			PrinterChange* change = &g_array_index(changeLog, PrinterChange, i);
+			PrinterChange copy = { change->generation, change->added, g_strdup(change->printerName) };
+			g_array_append_val(localChanges, copy);
+		}
+		generation = inventoryGeneration;
+	}
+	g_mutex_unlock(&inventory_mutex);
+	return generation;
+}
+
+/*
+ * Copies to printerName the name of the next changed printer, like SpiceGlibGlueGetNextLocalPrinter.
+ * - added: 1 if the printer was added, 0 if it was removed.
+ * Returns 0 when there are no more changes.
+ */
+int32_t SpiceGlibGlueGetNextLocalPrinterChange(char* printerName, int32_t* added) {
+	if (localChanges == NULL || localChange >= localChanges->len) {
+		printerName[0]= '\0';
+		if (localChanges)
+			g_array_unref(localChanges);
+		localChanges = NULL;
+		return 0;
+	}
+
+	PrinterChange* change = &g_array_index(localChanges, PrinterChange, localChange++);
+	g_strlcpy(printerName, change->printerName, MAX_PRINTER_NAME_SIZE);
+	*added = change->added;
+	return 1;
+}
+
+/*****************************************************************************/
+/* Persistent state */
+/*****************************************************************************/
+
+#define STATE_GROUP_REQUESTED "Requested"
+
+// State file, a GKeyFile with the requested printers. Protected by printers_mutex.
+static GKeyFile* printerState;
+static gchar* printerStateFile;
+
+/* Must be called with printers_mutex held. */
+static void save_printer_state() {
+	GError* err = NULL;
+	gsize length;
+	gchar* data = g_key_file_to_data(printerState, &length, NULL);
+	gchar* dir = g_path_get_dirname(printerStateFile);
+
+	g_mkdir_with_parents(dir, 0700);
+	if (!g_file_set_contents(printerStateFile, data, length, &err)) {
+		g_warning("FMP: could not save printer state: %s", err->message);
+		g_error_free(err);
+	}
+	g_free(dir);
+	g_free(data);
+}
+
+/* Must be called with printers_mutex held. */
+static void save_requested_printers() {
+	guint length;
+	const gchar** names = (const gchar**)g_hash_table_get_keys_as_array(requestedSharedPrinters, &length);
+
+	g_key_file_set_string_list(printerState, STATE_GROUP_REQUESTED, "printers", names, length);
+	g_free(names);
+	save_printer_state();
+}
+
+static void load_printer_state() {
+	GError* err = NULL;
+	gchar** names;
+	int i;
+
+	printerStateFile = g_build_filename(g_get_user_config_dir(), "flexvdi", "printers.ini", NULL);
+	printerState = g_key_file_new();
+	if (!g_key_file_load_from_file(printerState, printerStateFile, G_KEY_FILE_NONE, &err)) {
+		SPICE_DEBUG("FMP: no printer state loaded from %s: %s", printerStateFile, err->message);
+		g_error_free(err);
+		return;
+	}
+
+	names = g_key_file_get_string_list(printerState, STATE_GROUP_REQUESTED, "printers", NULL, NULL);
+	for (i = 0; names && names[i]; i++) {
+		g_hash_table_insert(requestedSharedPrinters, g_strdup(names[i]), NULL);
+	}
+	SPICE_DEBUG("FMP: %d requested printers loaded from %s", i, printerStateFile);
+	g_strfreev(names);
+}
+
 /*****************************************************************************/
 /* Share/unshare printers */
 /*****************************************************************************/
 
+/*
+ * Note down in sharedPrinters that the printer is shared.
+ * Must be called with printers_mutex held.
+ */
+static void addSharedPrinter(const char* printerName) {
+	if (sharedPrinters) {
+		g_hash_table_insert(sharedPrinters, g_strdup(printerName), NULL);
+	}
+}
+
 /*
  * Share the printer and note it down in sharedPrinters.
  */
 static int32_t doSharePrinter(const char* printerName) {
 	int32_t retVal = flexvdi_share_printer(printerName);
 	if (retVal) {
-		char* s = g_malloc(MAX_PRINTER_NAME_SIZE);
-		strncpy(s, printerName, MAX_PRINTER_NAME_SIZE);
-		g_hash_table_insert(sharedPrinters, s, NULL);
+		g_mutex_lock(&printers_mutex);
+		addSharedPrinter(printerName);
+		g_mutex_unlock(&printers_mutex);
 	}
 	return retVal;
 }
 
+typedef struct {
+	char* printerName;
+	guint batch;
+} ShareJob;
+
+/*
+ * GFunc run by the threads of sharePool: shares one printer of a batch,
+ * and notes down the result and how long it took.
+ */
+static void share_printer_job(gpointer data, gpointer user_data) {
+	ShareJob* job = data;
+	gint64 start = g_get_monotonic_time();
+	int32_t retVal = flexvdi_share_printer(job->printerName);
+	guint64 ms = (g_get_monotonic_time() - start) / 1000;
+	int bucket = MIN(g_bit_storage(ms), PRINTER_LATENCY_BUCKETS) - 1;
+	int32_t done, total, failed;
+	SpiceGlibGluePrinterShareCallback cb;
+
+	SPICE_DEBUG("FMP: printer %s shared in %" G_GUINT64_FORMAT " ms with result %d",
+	            job->printerName, ms, retVal);
+
+	g_mutex_lock(&printers_mutex);
+	if (job->batch != batch) {
+		// The agent reconnected meanwhile, this result is outdated
+		g_mutex_unlock(&printers_mutex);
+		goto end;
+	}
+	if (retVal) {
+		addSharedPrinter(job->printerName);
+	} else {
+		batchFailed++;
+	}
+	latencyHistogram[bucket]++;
+	done = ++batchDone;
+	total = batchTotal;
+	failed = batchFailed;
+	cb = shareCallback;
+	g_mutex_unlock(&printers_mutex);
+
+	if (done == total) {
+		SPICE_DEBUG("FMP: %d printers shared, %d failed.", total - failed, failed);
+	}
+	if (cb) {
+		cb(done, total, failed);
+	}
+
+end:
+	g_free(job->printerName);
+	g_free(job);
+}
+
 /* Share a printer. And add it to the list of printers we want to share.
  * If we are connected, share it now; otherwise share when flexVDI Agent connects with us.
  * returns 0 if failed (no agent running, ...)
@@ -125,9 +484,10 @@ int32_t SpiceGlibGlueSharePrinter(const char* printerName) {
 	SPICE_DEBUG("FMP: SpiceGlibGlueSharePrinter %s", printerName);
 
 	// Add printer to requestedSharedPrinters
-	char* s = g_malloc(MAX_PRINTER_NAME_SIZE);
-	strncpy(s, printerName, MAX_PRINTER_NAME_SIZE);
-	g_hash_table_insert(requestedSharedPrinters, s, NULL);
+	g_mutex_lock(&printers_mutex);
+	g_hash_table_insert(requestedSharedPrinters, g_strdup(printerName), NULL);
+	save_requested_printers();
+	g_mutex_unlock(&printers_mutex);
 
 	return doSharePrinter(printerName);
 }
@@ -138,16 +498,52 @@ int32_t SpiceGlibGlueSharePrinter(const char* printerName) {
 int32_t SpiceGlibGlueUnsharePrinter(const char* printerName) {
 	SPICE_DEBUG("FMP: GlibGlueUnsharePrinter %s", printerName);
 
-	g_hash_table_remove(requestedSharedPrinters, printerName);
-
 	// !retVal means there is no connection, so there is no shared printer
 	int32_t retVal= flexvdi_unshare_printer(printerName);
-	if (retVal) {
+	g_mutex_lock(&printers_mutex);
+	g_hash_table_remove(requestedSharedPrinters, printerName);
+	if (retVal && sharedPrinters)
 		g_hash_table_remove(sharedPrinters, printerName);
-	}
+	save_requested_printers();
+	g_mutex_unlock(&printers_mutex);
 	return retVal;
 }
 
+/* Sets the maximum number of share requests in flight when the agent connects. */
+void SpiceGlibGlueSetPrinterShareConcurrency(int32_t maxInFlight) {
+	SPICE_DEBUG("FMP: SpiceGlibGlueSetPrinterShareConcurrency(%d)", maxInFlight);
+	sharingWindow = maxInFlight > 0 ? maxInFlight : DEFAULT_SHARING_WINDOW;
+	if (sharePool) {
+		g_thread_pool_set_max_threads(sharePool, sharingWindow, NULL);
+	}
+}
+
+void SpiceGlibGlueSetPrinterShareCallback(SpiceGlibGluePrinterShareCallback cb) {
+	g_mutex_lock(&printers_mutex);
+	shareCallback = cb;
+	g_mutex_unlock(&printers_mutex);
+}
+
+void SpiceGlibGlueGetPrinterShareProgress(int32_t* done, int32_t* total, int32_t* failed) {
+	g_mutex_lock(&printers_mutex);
+	*done = batchDone;
+	*total = batchTotal;
+	*failed = batchFailed;
+	g_mutex_unlock(&printers_mutex);
+}
+
+int32_t SpiceGlibGlueGetPrinterShareLatencyHistogram(uint32_t* buckets, int32_t numBuckets) {
+	int32_t i;
+
+	numBuckets = MIN(numBuckets, PRINTER_LATENCY_BUCKETS);
+	g_mutex_lock(&printers_mutex);
+	for (i = 0; i < numBuckets; i++) {
+		buckets[i] = latencyHistogram[i];
+	}
+	g_mutex_unlock(&printers_mutex);
+	return numBuckets;
+}
+
 /**
  * Returns >0 if the flexVDI agent is connected
  */
@@ -166,28 +562,46 @@ static void share_all_requested_printers(gpointer data)
 {
 	SPICE_DEBUG("FMP: share_all_requested_printers()");
 
-	// All printers have been disconnected, so we remove all elements from
-	// sharedPrinters hashTable
-	g_hash_table_remove_all(sharedPrinters);
-
 	GHashTableIter iter;
+	char *val;
+	char *key;
+
+	// All printers have been disconnected, so we remove all elements from
+	// sharedPrinters hashTable, and start a new batch
+	g_mutex_lock(&printers_mutex);
 	int size=g_hash_table_size(requestedSharedPrinters);
 	SPICE_DEBUG("FMP: %d printers to be shared.", size);
+	if (sharedPrinters)
+		g_hash_table_remove_all(sharedPrinters);
+	batch++;
+	batchTotal = size;
+	batchDone = batchFailed = 0;
 
-	char *val;
-	char *key;
 	g_hash_table_iter_init (&iter, requestedSharedPrinters);
 	while (g_hash_table_iter_next (&iter, (gpointer) &key, (gpointer) &val)) {
-		doSharePrinter(key);
+		ShareJob* job = g_new(ShareJob, 1);
+		job->printerName = g_strdup(key);
+		job->batch = batch;
+		g_thread_pool_push(sharePool, job, NULL);
 		SPICE_DEBUG("FMP: printer: %s", key);
 	}
+	g_mutex_unlock(&printers_mutex);
 }
 
 /* Creation of structures used by Follow Me Print Glue. */
 void initializeFollowMePrinting() {
 	SPICE_DEBUG("FMP: initializeFollowMePrinting()");
 	requestedSharedPrinters = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	load_printer_state();
+	sharePool = g_thread_pool_new(share_printer_job, NULL, sharingWindow, FALSE, NULL);
 	flexvdi_on_agent_connected(share_all_requested_printers, NULL);
+
+	printerInventory = g_ptr_array_new_with_free_func(g_free);
+	changeLog = g_array_new(FALSE, FALSE, sizeof(PrinterChange));
+	g_array_set_clear_func(changeLog, free_printer_change);
+	// List the printers before the client program asks for them
+	start_inventory_refresh(NULL);
+	refreshSource = g_timeout_add_seconds(PRINTER_REFRESH_INTERVAL, start_inventory_refresh, NULL);
 }
 
 /* Free structures used by Follow Me Print Glue. */
@@ -195,18 +609,53 @@ void disposeFollowMePrinting() {
 	SPICE_DEBUG("FMP: disposeFollowMePrinting()");
 	// Remove callback
 	flexvdi_on_agent_connected(NULL, NULL);
+	// Wait for the shares in flight
+	g_thread_pool_free(sharePool, TRUE, TRUE);
+	sharePool = NULL;
 	g_hash_table_destroy(requestedSharedPrinters);
+	g_key_file_free(printerState);
+	g_free(printerStateFile);
+	g_source_remove(refreshSource);
+	refreshSource = 0;
+
+	// Wait for the refresh in flight, no other one can start now
+	g_mutex_lock(&inventory_mutex);
+	GThread* thread = refreshThread;
+	refreshThread = NULL;
+	g_mutex_unlock(&inventory_mutex);
+	if (thread)
+		g_thread_join(thread);
+	if (localPrinters)
+		g_ptr_array_unref(localPrinters);
+	localPrinters = NULL;
+	if (localChanges)
+		g_array_unref(localChanges);
+	localChanges = NULL;
+	g_ptr_array_unref(printerInventory);
+	printerInventory = NULL;
+	g_array_unref(changeLog);
+	changeLog = NULL;
+	inventoryGeneration = changeLogStart = 0;
+	inventoryListed = refreshing = FALSE;
 }
 
 /* Creation of structures that store the state of printer sharing within a session. */
 void onConnectGuestFollowMePrinting() {
 	SPICE_DEBUG("FMP: onConnectGuestFollowMePrinting()");
-	sharedPrinters = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	g_mutex_lock(&printers_mutex);
+	if (sharedPrinters == NULL)
+		sharedPrinters = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	g_mutex_unlock(&printers_mutex);
 }
 
 /* Free per-connection structures. */
 void onDisconnectGuestFollowMePrinting() {
 	SPICE_DEBUG("FMP: onDisconnectGuestFollowMePrinting()");
-	g_hash_table_destroy(sharedPrinters);
+	g_mutex_lock(&printers_mutex);
+	if (sharedPrinters)
+		g_hash_table_destroy(sharedPrinters);
+	sharedPrinters = NULL;
+	batch++;
+	g_mutex_unlock(&printers_mutex);
 }
 #endif /* PRINTING */
@@ -18,6 +18,30 @@
 #ifndef _GLUE_PRINTING_H
 #define _GLUE_PRINTING_H
 
+#include <stdint.h>
+
+/* Share latencies are counted in buckets of powers of two milliseconds:
+ * bucket 0 counts the shares that took less than 2 ms, and bucket i those
+ * that took from 2^i to 2^(i+1) ms. The last bucket also counts the slower ones. */
+#define PRINTER_LATENCY_BUCKETS 16
+
+/* Called from a worker thread each time a requested printer share completes,
+ * after the flexVDI agent connects. */
+typedef void (*SpiceGlibGluePrinterShareCallback)(int32_t done, int32_t total, int32_t failed);
+
+void SpiceGlibGlueSetPrinterShareConcurrency(int32_t maxInFlight);
+void SpiceGlibGlueSetPrinterShareCallback(SpiceGlibGluePrinterShareCallback cb);
+void SpiceGlibGlueGetPrinterShareProgress(int32_t* done, int32_t* total, int32_t* failed);
+/* Copies up to numBuckets buckets of the share latency histogram.
+ * Returns the number of buckets copied. */
+int32_t SpiceGlibGlueGetPrinterShareLatencyHistogram(uint32_t* buckets, int32_t numBuckets);
+
+/* Inventory of local printers, refreshed in background. */
+uint32_t SpiceGlibGlueGetLocalPrinterGeneration();
+void SpiceGlibGlueRefreshLocalPrinters();
+int64_t SpiceGlibGlueGetLocalPrinterChanges(uint32_t sinceGeneration);
+int32_t SpiceGlibGlueGetNextLocalPrinterChange(char* printerName, int32_t* added);
+
 void initializeFollowMePrinting();
 
 void onConnectGuestFollowMePrinting();
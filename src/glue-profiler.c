@@ -0,0 +1,122 @@
+/**
+ * Copyright (C) 2016 flexVDI (Flexible Software Solutions S.L.)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <spice-client.h>
+
+#include "glue-profiler.h"
+
+static const char *phaseNames[GLUE_PHASE_COUNT] = {
+    "connect", "setup", "main", "primary", "mark", "invalidate", "copy", "lock", "usb"
+};
+
+/* Written in the glib mainloop thread, except for the lock phase. */
+static struct {
+    GMutex mutex;
+    gint64 start;
+    gint64 phases[GLUE_PHASE_COUNT];
+    gint64 channels[GLUE_PROFILER_MAX_CHANNEL_TYPES];
+} profile;
+
+void glue_profiler_start(void)
+{
+    int i;
+
+    g_mutex_lock(&profile.mutex);
+    profile.start = g_get_monotonic_time();
+    for (i = 0; i < GLUE_PHASE_COUNT; i++)
+        profile.phases[i] = -1;
+    for (i = 0; i < GLUE_PROFILER_MAX_CHANNEL_TYPES; i++)
+        profile.channels[i] = -1;
+    profile.phases[GLUE_PHASE_CONNECT] = 0;
+    g_mutex_unlock(&profile.mutex);
+}
+
+static void log_summary(void)
+{
+    GString *line = g_string_new("Startup:");
+    int i;
+
+    for (i = GLUE_PHASE_SESSION_SETUP; i < GLUE_PHASE_COUNT; i++) {
+        if (profile.phases[i] >= 0)
+            g_string_append_printf(line, " %s +%" G_GINT64_FORMAT "ms",
+                                   phaseNames[i], profile.phases[i] / 1000);
+    }
+    for (i = 0; i < GLUE_PROFILER_MAX_CHANNEL_TYPES; i++) {
+        if (profile.channels[i] >= 0)
+            g_string_append_printf(line, " %s-open +%" G_GINT64_FORMAT "ms",
+                                   spice_channel_type_to_string(i), profile.channels[i] / 1000);
+    }
+    g_message("%s", line->str);
+    g_string_free(line, TRUE);
+}
+
+void glue_profiler_mark(int phase)
+{
+    /* Cheap check first, this is called for every frame */
+    if (phase < 0 || phase >= GLUE_PHASE_COUNT || profile.start == 0 ||
+        profile.phases[phase] >= 0)
+        return;
+
+    g_mutex_lock(&profile.mutex);
+    if (profile.phases[phase] < 0) {
+        profile.phases[phase] = g_get_monotonic_time() - profile.start;
+        if (phase == GLUE_PHASE_FIRST_LOCK)
+            log_summary();
+    }
+    g_mutex_unlock(&profile.mutex);
+}
+
+void glue_profiler_channel_opened(int channelType)
+{
+    if (channelType < 0 || channelType >= GLUE_PROFILER_MAX_CHANNEL_TYPES || profile.start == 0)
+        return;
+
+    g_mutex_lock(&profile.mutex);
+    if (profile.channels[channelType] < 0)
+        profile.channels[channelType] = g_get_monotonic_time() - profile.start;
+    g_mutex_unlock(&profile.mutex);
+    if (channelType == SPICE_CHANNEL_MAIN)
+        glue_profiler_mark(GLUE_PHASE_MAIN_OPEN);
+}
+
+int64_t SpiceGlibGlue_GetStartupPhase(int32_t phase)
+{
+    int64_t result;
+
+    if (phase < 0 || phase >= GLUE_PHASE_COUNT || profile.start == 0)
+        return -1;
+    g_mutex_lock(&profile.mutex);
+    result = profile.phases[phase];
+    g_mutex_unlock(&profile.mutex);
+    return result;
+}
+
+int64_t SpiceGlibGlue_GetChannelOpenTime(int32_t channelType)
+{
+    int64_t result;
+
+    if (channelType < 0 || channelType >= GLUE_PROFILER_MAX_CHANNEL_TYPES || profile.start == 0)
+        return -1;
+    g_mutex_lock(&profile.mutex);
+    result = profile.channels[channelType];
+    g_mutex_unlock(&profile.mutex);
+    return result;
+}
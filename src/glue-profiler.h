@@ -0,0 +1,59 @@
+/**
+ * Copyright (C) 2016 flexVDI (Flexible Software Solutions S.L.)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Startup profiling. The first time each phase of a connection happens is
+ * recorded, relative to SpiceGlibGlue_Connect(), with the monotonic clock.
+ * When the client program first locks an updated display buffer, the whole
+ * startup is logged in a single line.
+ */
+
+#ifndef _GLUE_PROFILER_H
+#define _GLUE_PROFILER_H
+
+#include <stdint.h>
+#include <glib.h>
+
+#define GLUE_PHASE_CONNECT          0   /* SpiceGlibGlue_Connect() called */
+#define GLUE_PHASE_SESSION_SETUP    1   /* Session configured */
+#define GLUE_PHASE_MAIN_OPEN        2   /* Main channel opened */
+#define GLUE_PHASE_PRIMARY_CREATE   3   /* Primary surface created */
+#define GLUE_PHASE_FIRST_MARK       4   /* First display mark */
+#define GLUE_PHASE_FIRST_INVALIDATE 5
+#define GLUE_PHASE_FIRST_COPY       6   /* First copy to the display buffer */
+#define GLUE_PHASE_FIRST_LOCK       7   /* First lock of an updated display buffer */
+#define GLUE_PHASE_USB_INIT         8   /* USB subsystem initialized */
+#define GLUE_PHASE_COUNT            9
+
+/* Up to SPICE_CHANNEL_* values */
+#define GLUE_PROFILER_MAX_CHANNEL_TYPES 16
+
+/* Called internally. Starts a new profile. */
+void glue_profiler_start(void);
+/* Called internally. Only the first time of each phase is recorded. */
+void glue_profiler_mark(int phase);
+void glue_profiler_channel_opened(int channelType);
+
+/* Microseconds from SpiceGlibGlue_Connect() to a GLUE_PHASE_*, or -1 if it
+ * has not happened yet. */
+int64_t SpiceGlibGlue_GetStartupPhase(int32_t phase);
+
+/* Microseconds from SpiceGlibGlue_Connect() to the opening of the first
+ * channel of a type (SPICE_CHANNEL_*), or -1. */
+int64_t SpiceGlibGlue_GetChannelOpenTime(int32_t channelType);
+
+#endif /* _GLUE_PROFILER_H */
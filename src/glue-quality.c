@@ -0,0 +1,399 @@
+/**
+ * Copyright (C) 2016 flexVDI (Flexible Software Solutions S.L.)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <spice-client.h>
+#ifndef G_OS_WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+#include "glue-quality.h"
+#include "glue-service.h"
+#include "glue-connection.h"
+#include "glue-spice-widget-priv.h"
+
+#define SAMPLE_MS 2000
+/* Samples with fewer display updates per second are idle, and not measured */
+#define BUSY_FPS 5
+#define SAMPLES_DOWN 3
+#define SAMPLES_UP 5
+/* Clear samples needed to go up again are doubled, up to this, every time the
+ * link gets congested soon after going up */
+#define MAX_SAMPLES_UP 40
+#define RECONGESTION_US (60 * G_USEC_PER_SEC)
+#define DEFAULT_CONGESTED_MS 80
+#define DEFAULT_CLEAR_MS 20
+#define TRAFFIC_SAMPLE_MS 1000
+
+/* Only accessed in the glib mainloop, except the metrics, the thresholds and
+ * the traffic stats */
+static struct {
+    GMutex mutex;
+    guint timer, trafficTimer;
+    gint congestedMs, clearMs;
+    gint frames;                /* Updated with atomic operations */
+    guint64 lastBytes;
+    gint64 lastSample;
+    gdouble avgKbps;
+    gpointer channel;           /* Display channel of the RTT samples, only compared */
+    gdouble avgRttUs, baseRttUs;
+    gint congested, clear;      /* Consecutive busy samples over/under the thresholds */
+    gint samplesUp;
+    gboolean lastChangeUp;
+    gint64 updatedBytes;        /* Since the last reset, with atomic operations */
+    guint64 readBytes;          /* Of the display channel, last sampled */
+    guint64 baseReadBytes;      /* Of the display channel, at the last reset */
+    gint cacheSize, glzWindowSize;  /* Of the session, last sampled */
+    SpiceGlibGlueQualityMetrics metrics;
+} quality = {
+    .congestedMs = DEFAULT_CONGESTED_MS,
+    .clearMs = DEFAULT_CLEAR_MS,
+    .samplesUp = SAMPLES_UP,
+    .metrics.level = GLUE_QUALITY_HIGH,
+};
+
+void glue_quality_frame(int width, int height)
+{
+    if (quality.timer)
+        g_atomic_int_inc(&quality.frames);
+    /* Called for every update, it does not take the mutex */
+    __atomic_fetch_add(&quality.updatedBytes, (gint64)width * height * 4, __ATOMIC_RELAXED);
+}
+
+/* Reads the display traffic counters in the glib mainloop, for
+ * SpiceGlibGlue_GetDisplayTrafficStats() to return them in any thread */
+static void sample_traffic(void)
+{
+    gulong bytes = 0;
+    gint cacheSize = 0, glzWindowSize = 0;
+
+    if (global_display() != NULL) {
+        SpiceDisplayPrivate *d = SPICE_DISPLAY_GET_PRIVATE(global_display());
+        if (d->display != NULL)
+            g_object_get(d->display, "total-read-bytes", &bytes, NULL);
+        g_object_get(d->session, "cache-size", &cacheSize,
+                     "glz-window-size", &glzWindowSize, NULL);
+    }
+
+    g_mutex_lock(&quality.mutex);
+    /* A new connection starts counting again from 0 */
+    if (bytes < quality.baseReadBytes)
+        quality.baseReadBytes = 0;
+    quality.readBytes = bytes;
+    quality.cacheSize = cacheSize;
+    quality.glzWindowSize = glzWindowSize;
+    g_mutex_unlock(&quality.mutex);
+}
+
+/* GSourceFunc */
+static gboolean sample_traffic1(gpointer data)
+{
+    sample_traffic();
+    return TRUE;
+}
+
+static gboolean reset_stats1(gpointer data)
+{
+    sample_traffic();
+    g_mutex_lock(&quality.mutex);
+    __atomic_store_n(&quality.updatedBytes, 0, __ATOMIC_RELAXED);
+    quality.baseReadBytes = quality.readBytes;
+    g_mutex_unlock(&quality.mutex);
+    if (quality.trafficTimer == 0)
+        quality.trafficTimer = g_timeout_add(TRAFFIC_SAMPLE_MS, sample_traffic1, NULL);
+    return FALSE;
+}
+
+void glue_quality_reset_stats(void)
+{
+    g_timeout_add_full(G_PRIORITY_HIGH, 0, reset_stats1, NULL, NULL);
+}
+
+static guint64 session_read_bytes(SpiceSession *session)
+{
+    GList *channels = spice_session_get_channels(session), *it;
+    guint64 total = 0;
+
+    for (it = channels; it != NULL; it = it->next) {
+        gulong bytes = 0;
+        g_object_get(it->data, "total-read-bytes", &bytes, NULL);
+        total += bytes;
+    }
+    g_list_free(channels);
+    return total;
+}
+
+/* The high level restores the compression and video codecs set as connection
+ * options; where they are not set, it asks for the fastest and sharpest ones,
+ * since the server defaults cannot be asked for again. */
+static void apply_level(SpiceDisplayPrivate *d, int level)
+{
+#if SPICE_GTK_CHECK_VERSION(0, 31, 0)
+    static const SpiceImageCompression compression[] = {
+        [GLUE_QUALITY_LOW] = SPICE_IMAGE_COMPRESSION_AUTO_GLZ,
+        [GLUE_QUALITY_MEDIUM] = SPICE_IMAGE_COMPRESSION_AUTO_GLZ,
+    };
+#endif
+#if SPICE_GTK_CHECK_VERSION(0, 34, 0)
+    static const SpiceVideoCodecType codec[] = {
+        [GLUE_QUALITY_LOW] = SPICE_VIDEO_CODEC_TYPE_H264,
+        [GLUE_QUALITY_MEDIUM] = SPICE_VIDEO_CODEC_TYPE_VP8,
+    };
+#endif
+
+    if (d->display == NULL)
+        return;
+    if (level == GLUE_QUALITY_HIGH) {
+        spice_connection_send_display_preferences(SPICE_CHANNEL(d->display),
+                                                  SPICE_IMAGE_COMPRESSION_LZ4,
+                                                  SPICE_VIDEO_CODEC_TYPE_MJPEG);
+        return;
+    }
+#if SPICE_GTK_CHECK_VERSION(0, 31, 0)
+    spice_display_channel_change_preferred_compression(SPICE_DISPLAY_CHANNEL(d->display),
+                                                       compression[level]);
+#endif
+#if SPICE_GTK_CHECK_VERSION(0, 34, 0)
+    spice_display_channel_change_preferred_video_codec_type(SPICE_DISPLAY_CHANNEL(d->display),
+                                                            codec[level]);
+#endif
+}
+
+/* Smoothed round trip time of the TCP connection of a channel, as the kernel
+ * measures it. spice-glib does not expose the latency it measures itself. */
+static gboolean channel_rtt(SpiceChannel *channel, guint *rttUs)
+{
+    GSocket *socket = NULL;
+    gboolean ok = FALSE;
+
+    if (g_object_class_find_property(G_OBJECT_GET_CLASS(channel), "socket") == NULL)
+        return FALSE;
+    g_object_get(channel, "socket", &socket, NULL);
+    if (socket == NULL)
+        return FALSE;
+#if defined(TCP_INFO)
+    {
+        struct tcp_info info;
+        socklen_t len = sizeof(info);
+        if (getsockopt(g_socket_get_fd(socket), IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+            /* The receiver estimate is the one that follows the display data */
+            *rttUs = info.tcpi_rcv_rtt ? info.tcpi_rcv_rtt : info.tcpi_rtt;
+            ok = *rttUs != 0;
+        }
+    }
+#elif defined(TCP_CONNECTION_INFO)
+    {
+        struct tcp_connection_info info;
+        socklen_t len = sizeof(info);
+        if (getsockopt(g_socket_get_fd(socket), IPPROTO_TCP, TCP_CONNECTION_INFO,
+                       &info, &len) == 0) {
+            *rttUs = info.tcpi_srtt * 1000;
+            ok = *rttUs != 0;
+        }
+    }
+#endif
+    g_object_unref(socket);
+    return ok;
+}
+
+static void set_level(SpiceDisplayPrivate *d, int level, const char *reason)
+{
+    gint64 now = g_get_monotonic_time();
+
+    g_message("Quality level %d -> %d: %s (RTT %.0f ms, minimum %.0f ms, %.0f kbps)",
+              quality.metrics.level, level, reason, quality.avgRttUs / 1000,
+              quality.baseRttUs / 1000, quality.avgKbps);
+    if (level < quality.metrics.level && quality.lastChangeUp &&
+        now - quality.metrics.lastChangeUs < RECONGESTION_US) {
+        /* Going up congested the link again, wait longer next time */
+        quality.samplesUp = MIN(quality.samplesUp * 2, MAX_SAMPLES_UP);
+    }
+    quality.lastChangeUp = level > quality.metrics.level;
+    apply_level(d, level);
+    g_mutex_lock(&quality.mutex);
+    quality.metrics.level = level;
+    quality.metrics.levelChanges++;
+    quality.metrics.lastChangeUs = now;
+    g_mutex_unlock(&quality.mutex);
+    quality.congested = quality.clear = 0;
+}
+
+/* Takes an RTT sample of the display channel, and counts the samples in which
+ * the queueing delay, the RTT over its minimum, is over or under the
+ * thresholds. Returns FALSE if there is no RTT measure. */
+static gboolean sample_delay(SpiceDisplayPrivate *d)
+{
+    guint rttUs;
+    gdouble queueUs;
+    gint congestedMs, clearMs;
+
+    if (d->display == NULL || !channel_rtt(SPICE_CHANNEL(d->display), &rttUs))
+        return FALSE;
+    if (quality.channel != d->display) {
+        /* A different connection, with its own minimum */
+        quality.channel = d->display;
+        quality.avgRttUs = quality.baseRttUs = 0;
+        quality.congested = quality.clear = 0;
+    }
+    quality.avgRttUs = quality.avgRttUs == 0 ? rttUs : quality.avgRttUs * 0.7 + rttUs * 0.3;
+    if (quality.baseRttUs == 0 || quality.avgRttUs < quality.baseRttUs)
+        quality.baseRttUs = quality.avgRttUs;
+
+    g_mutex_lock(&quality.mutex);
+    congestedMs = quality.congestedMs;
+    clearMs = quality.clearMs;
+    g_mutex_unlock(&quality.mutex);
+
+    queueUs = quality.avgRttUs - quality.baseRttUs;
+    if (queueUs > congestedMs * 1000) {
+        quality.congested++;
+        quality.clear = 0;
+    } else if (queueUs < clearMs * 1000) {
+        quality.clear++;
+        quality.congested = 0;
+    } else {
+        quality.congested = quality.clear = 0;
+    }
+    return TRUE;
+}
+
+/* GSourceFunc */
+static gboolean sample(gpointer data)
+{
+    SpiceDisplayPrivate *d;
+    gint64 now = g_get_monotonic_time();
+    guint64 bytes;
+    gdouble seconds, kbps, fps;
+
+    if (global_display() == NULL)
+        return TRUE;
+    d = SPICE_DISPLAY_GET_PRIVATE(global_display());
+
+    bytes = session_read_bytes(d->session);
+    seconds = (now - quality.lastSample) / (gdouble)G_USEC_PER_SEC;
+    if (quality.lastSample == 0 || bytes < quality.lastBytes || seconds <= 0) {
+        /* First sample, or a different connection */
+        quality.lastBytes = bytes;
+        quality.lastSample = now;
+        g_atomic_int_set(&quality.frames, 0);
+        return TRUE;
+    }
+    kbps = (bytes - quality.lastBytes) * 8 / 1000.0 / seconds;
+    fps = (gint)g_atomic_int_and((guint *)&quality.frames, 0) / seconds;
+    quality.lastBytes = bytes;
+    quality.lastSample = now;
+
+    /* Throughput only says how much the guest sends, not how much the link
+     * carries. The link is congested when the RTT grows over its minimum,
+     * because the data waits in queues along the path. Only busy samples are
+     * measured, an idle link has no queues. */
+    if (fps >= BUSY_FPS) {
+        quality.avgKbps = quality.avgKbps == 0 ? kbps : quality.avgKbps * 0.7 + kbps * 0.3;
+        if (!sample_delay(d)) {
+            /* Without a measure of congestion, the level stays */
+        } else if (quality.congested >= SAMPLES_DOWN &&
+                   quality.metrics.level > GLUE_QUALITY_LOW) {
+            set_level(d, quality.metrics.level - 1, "congestion");
+        } else if (quality.clear >= quality.samplesUp &&
+                   quality.metrics.level < GLUE_QUALITY_HIGH) {
+            set_level(d, quality.metrics.level + 1, "no congestion");
+        }
+    }
+
+    g_mutex_lock(&quality.mutex);
+    quality.metrics.throughputKbps = quality.avgKbps;
+    quality.metrics.framesPerSecond = fps;
+    quality.metrics.rttMs = quality.avgRttUs / 1000;
+    quality.metrics.queueDelayMs = (quality.avgRttUs - quality.baseRttUs) / 1000;
+    g_mutex_unlock(&quality.mutex);
+    return TRUE;
+}
+
+static gboolean enable1(gpointer data)
+{
+    gboolean enable = GPOINTER_TO_INT(data);
+
+    if (enable && quality.timer == 0) {
+        quality.lastSample = 0;
+        quality.avgKbps = 0;
+        quality.channel = NULL;
+        quality.congested = quality.clear = 0;
+        quality.samplesUp = SAMPLES_UP;
+        quality.lastChangeUp = FALSE;
+        /* The display keeps the connection options, unless a previous run
+         * lowered the level */
+        if (quality.metrics.level != GLUE_QUALITY_HIGH && global_display() != NULL)
+            apply_level(SPICE_DISPLAY_GET_PRIVATE(global_display()), GLUE_QUALITY_HIGH);
+        g_mutex_lock(&quality.mutex);
+        quality.metrics.level = GLUE_QUALITY_HIGH;
+        g_mutex_unlock(&quality.mutex);
+        quality.timer = g_timeout_add(SAMPLE_MS, sample, NULL);
+    } else if (!enable && quality.timer != 0) {
+        g_source_remove(quality.timer);
+        quality.timer = 0;
+    }
+    g_mutex_lock(&quality.mutex);
+    quality.metrics.enabled = enable;
+    g_mutex_unlock(&quality.mutex);
+    return FALSE;
+}
+
+void SpiceGlibGlue_EnableQualityControl(int32_t enable)
+{
+    SPICE_DEBUG("Quality control %s", enable ? "enabled" : "disabled");
+    g_timeout_add_full(G_PRIORITY_HIGH, 0, enable1, GINT_TO_POINTER(enable != 0), NULL);
+}
+
+void SpiceGlibGlue_SetQualityThresholds(int32_t congestedMs, int32_t clearMs)
+{
+    if (clearMs < 0 || congestedMs <= clearMs) {
+        g_warning("Invalid quality thresholds %d, %d", congestedMs, clearMs);
+        return;
+    }
+    g_mutex_lock(&quality.mutex);
+    quality.congestedMs = congestedMs;
+    quality.clearMs = clearMs;
+    g_mutex_unlock(&quality.mutex);
+}
+
+void SpiceGlibGlue_GetQualityMetrics(SpiceGlibGlueQualityMetrics *metrics)
+{
+    g_mutex_lock(&quality.mutex);
+    *metrics = quality.metrics;
+    g_mutex_unlock(&quality.mutex);
+}
+
+void SpiceGlibGlue_GetDisplayTrafficStats(SpiceGlibGlueDisplayTrafficStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    g_mutex_lock(&quality.mutex);
+    stats->imageCacheSize = quality.cacheSize;
+    stats->glzWindowSize = quality.glzWindowSize;
+    stats->receivedBytes = quality.readBytes - quality.baseReadBytes;
+    stats->updatedBytes = __atomic_load_n(&quality.updatedBytes, __ATOMIC_RELAXED);
+    g_mutex_unlock(&quality.mutex);
+    if (stats->updatedBytes > stats->receivedBytes) {
+        stats->bytesAvoided = stats->updatedBytes - stats->receivedBytes;
+        stats->compressionPercent = stats->bytesAvoided * 100 / stats->updatedBytes;
+    }
+}
@@ -0,0 +1,83 @@
+/**
+ * Copyright (C) 2016 flexVDI (Flexible Software Solutions S.L.)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Quality adaptation. While the display is busy, the round trip time of the
+ * display connection tells whether the link is congested: data that waits in
+ * queues along the path adds to the RTT over its minimum. When that queueing
+ * delay stays high, the controller asks the server for stronger image
+ * compression and a more efficient video codec; when it stays low, for faster
+ * and sharper ones, up to those set as connection options. Changes need
+ * several consecutive samples in the same direction, the two thresholds are
+ * apart, and going up again waits longer every time it congested the link,
+ * so that the level does not oscillate.
+ * The RTT is read from the kernel, where it is available (Linux, Android,
+ * macOS and iOS); elsewhere the level stays as it is.
+ */
+
+#ifndef _GLUE_QUALITY_H
+#define _GLUE_QUALITY_H
+
+#include <stdint.h>
+
+#define GLUE_QUALITY_LOW    0
+#define GLUE_QUALITY_MEDIUM 1
+#define GLUE_QUALITY_HIGH   2
+
+typedef struct {
+    int32_t enabled;
+    int32_t level;              /* GLUE_QUALITY_* */
+    int32_t throughputKbps;     /* Average over the busy samples */
+    int32_t framesPerSecond;    /* Display updates, last sample */
+    int32_t rttMs;              /* Average over the busy samples, 0 if unknown */
+    int32_t queueDelayMs;       /* rttMs over its minimum on this connection */
+    int32_t levelChanges;
+    int64_t lastChangeUs;       /* g_get_monotonic_time() of the last change, 0 if none */
+} SpiceGlibGlueQualityMetrics;
+
+typedef struct {
+    int32_t imageCacheSize;     /* Bytes, as configured in the session */
+    int32_t glzWindowSize;
+    int64_t receivedBytes;      /* By the display channel */
+    int64_t updatedBytes;       /* Of 32 bit pixels drawn by those updates */
+    int64_t bytesAvoided;       /* updatedBytes - receivedBytes, if positive */
+    int32_t compressionPercent; /* bytesAvoided over updatedBytes */
+} SpiceGlibGlueDisplayTrafficStats;
+
+/* Called internally for every display update of the active connection. */
+void glue_quality_frame(int width, int height);
+/* Called internally when the active connection changes, in any thread. */
+void glue_quality_reset_stats(void);
+
+/* Starts or stops the controller. It starts at the high level. */
+void SpiceGlibGlue_EnableQualityControl(int32_t enable);
+
+/* Queueing delay, in ms, above which the quality goes down and below which it
+ * goes up. Defaults are 80 and 20. */
+void SpiceGlibGlue_SetQualityThresholds(int32_t congestedMs, int32_t clearMs);
+
+void SpiceGlibGlue_GetQualityMetrics(SpiceGlibGlueQualityMetrics *metrics);
+
+/* Display traffic of the active connection, since it was connected or
+ * activated: the bytes received against the pixels they updated. That is the
+ * overall compression ratio, of the image and video compression and the
+ * caches together; spice-glib does not expose the cache hits, so their share
+ * cannot be told apart. The cache sizes are reported as configured. The
+ * counters are sampled every second in the glib mainloop. */
+void SpiceGlibGlue_GetDisplayTrafficStats(SpiceGlibGlueDisplayTrafficStats *stats);
+
+#endif /* _GLUE_QUALITY_H */
@@ -31,6 +31,8 @@
 
 #include "glue-spice-widget.h"
 #include "glue-connection.h"
+#include "glue-profiler.h"
+#include "glue-quality.h"
 
 #include "glib.h"
 #if defined(PRINTING) || defined(SSO)
@@ -174,6 +176,56 @@ void SpiceGlibGlue_InitializeLogging(int32_t verbosityLevel)
 
 static SpiceConnection *mainconn = NULL;
 
+/* Connections by handle, including mainconn. The table is accessed from the
+ * client program thread and from the glib mainloop, under connectionsMutex;
+ * connections are only removed, and unreferenced, in the mainloop. */
+static GHashTable *connections = NULL;
+static GMutex connectionsMutex;
+static int32_t activeHandle = 0;
+static int32_t nextHandle = 1;
+
+static void insert_connection(int32_t handle, SpiceConnection *conn)
+{
+    g_mutex_lock(&connectionsMutex);
+    if (connections == NULL)
+        connections = g_hash_table_new(g_direct_hash, g_direct_equal);
+    g_hash_table_insert(connections, GINT_TO_POINTER(handle), conn);
+    g_mutex_unlock(&connectionsMutex);
+}
+
+static int32_t add_connection(SpiceConnection *conn)
+{
+    int32_t handle = g_atomic_int_add(&nextHandle, 1);
+    insert_connection(handle, conn);
+    return handle;
+}
+
+static SpiceConnection *lookup_connection(int32_t handle)
+{
+    SpiceConnection *conn = NULL;
+
+    g_mutex_lock(&connectionsMutex);
+    if (connections != NULL)
+        conn = g_hash_table_lookup(connections, GINT_TO_POINTER(handle));
+    g_mutex_unlock(&connectionsMutex);
+    return conn;
+}
+
+/* Only in the mainloop. The connection is unreferenced out of the lock. */
+static void remove_connection(int32_t handle)
+{
+    SpiceConnection *conn = NULL;
+
+    g_mutex_lock(&connectionsMutex);
+    if (connections != NULL) {
+        conn = g_hash_table_lookup(connections, GINT_TO_POINTER(handle));
+        g_hash_table_remove(connections, GINT_TO_POINTER(handle));
+    }
+    g_mutex_unlock(&connectionsMutex);
+    if (conn != NULL)
+        g_object_unref(conn);
+}
+
 SpiceDisplay* global_display() {
     return mainconn != NULL ? spice_connection_get_display(mainconn) : NULL;
 }
@@ -191,8 +243,12 @@ void SpiceGlibGlue_MainLoop(void)
 static gboolean disconnect1()
 {
     SPICE_DEBUG("SpiceGlibGlue_Disconnect\n");
+    if (mainconn == NULL)
+        return FALSE;
     spice_connection_disconnect(mainconn);
-    g_clear_object(&mainconn);
+    mainconn = NULL;
+    remove_connection(activeHandle);
+    activeHandle = 0;
     return FALSE;
 }
 
@@ -213,11 +269,14 @@ int16_t SpiceGlibGlue_Connect(char* host,
 
     SPICE_DEBUG("SpiceClientConnect session_setup");
 
+    glue_profiler_start();
     mainconn = spice_connection_new();
+    activeHandle = add_connection(mainconn);
     spice_connection_setup(mainconn, host,
 			port, tls_port, ws_port,
 			password,
 			ca_file, cert_subj, enable_sound);
+    glue_profiler_mark(GLUE_PHASE_SESSION_SETUP);
 
 #if defined(PRINTING) || defined(SSO)
     flexvdi_port_register_session(mainconn->session);
@@ -228,6 +287,7 @@ int16_t SpiceGlibGlue_Connect(char* host,
 
     SPICE_DEBUG("SpiceClientConnect connection_connect");
 
+    glue_quality_reset_stats();
     spice_connection_connect(mainconn);
 #if defined(USBREDIR)
 	usb_glue_register_session(mainconn->session);
@@ -237,8 +297,43 @@ int16_t SpiceGlibGlue_Connect(char* host,
     return result;
 }
 
+/* Connected means that the main channel is linked, and the display shows the guest. */
 int16_t SpiceGlibGlue_isConnected() {
-    return (mainconn != NULL && spice_connection_get_num_channels(mainconn) > 3);
+    return mainconn != NULL &&
+        spice_connection_get_channel_state(mainconn, SPICE_CHANNEL_MAIN) == GLUE_CHANNEL_READY &&
+        spice_connection_get_channel_state(mainconn, SPICE_CHANNEL_DISPLAY) == GLUE_CHANNEL_READY;
+}
+
+/* Whether input events can be sent, as soon as the inputs channel is linked. */
+int16_t SpiceGlibGlue_isInputReady() {
+    return mainconn != NULL &&
+        spice_connection_get_channel_state(mainconn, SPICE_CHANNEL_INPUTS) == GLUE_CHANNEL_READY;
+}
+
+/**
+ * Returns the state (GLUE_CHANNEL_*) of the first channel of a type
+ * (SPICE_CHANNEL_*) of the active connection.
+ **/
+int32_t SpiceGlibGlue_GetChannelState(int32_t channelType) {
+    return mainconn != NULL ?
+        spice_connection_get_channel_state(mainconn, channelType) : GLUE_CHANNEL_NONE;
+}
+
+static void (*displayUsableCallback)(void) = NULL;
+
+static void onDisplayUsable(SpiceConnection *conn)
+{
+    if (conn == mainconn && displayUsableCallback != NULL)
+        displayUsableCallback();
+}
+
+/**
+ * Sets a function to be called, in the glib mainloop thread, when the
+ * display of the active connection shows its first frame.
+ **/
+void SpiceGlibGlue_SetDisplayUsableCallback(void (*callback)(void)) {
+    displayUsableCallback = callback;
+    spice_connection_set_display_usable_func(onDisplayUsable);
 }
 
 int16_t SpiceGlibGlue_getNumberOfChannels() {
@@ -249,6 +344,126 @@ int16_t SpiceGlibGlue_getNumberOfChannels() {
     }
 }
 
+/*
+ * Connection pool. Other connections are kept open in the background, and
+ * SpiceGlibGlue_Activate() switches the display, inputs and cursor to one of
+ * them without going through the handshakes and the first full frame again.
+ * The display of an inactive connection is not copied to the display buffer.
+ * Pooled connections have no sound, and follow-me printing and SSO stay with
+ * the connection made with SpiceGlibGlue_Connect().
+ */
+typedef struct {
+    gchar *host, *port, *tls_port, *ws_port, *password, *ca_file, *cert_subj;
+    int32_t handle;
+} PoolConnectData;
+
+static gboolean poolConnect1(gpointer data)
+{
+    PoolConnectData *p = data;
+    SpiceConnection *conn = spice_connection_new();
+
+    spice_connection_setup(conn, p->host, p->port, p->tls_port, p->ws_port,
+                           p->password, p->ca_file, p->cert_subj, FALSE);
+    insert_connection(p->handle, conn);
+    spice_connection_connect(conn);
+    SPICE_DEBUG("Pooled connection %d to %s", p->handle, p->host);
+
+    g_free(p->host);
+    g_free(p->port);
+    g_free(p->tls_port);
+    g_free(p->ws_port);
+    g_free(p->password);
+    g_free(p->ca_file);
+    g_free(p->cert_subj);
+    g_free(p);
+    return FALSE;
+}
+
+/**
+ * Opens a connection in the background. Returns its handle, to be
+ * passed to SpiceGlibGlue_Activate().
+ **/
+int32_t SpiceGlibGlue_PoolConnect(char* host,
+                                  char* port, char* tls_port, char* ws_port,
+                                  char* password,
+                                  char* ca_file, char* cert_subj)
+{
+    PoolConnectData *p = g_new0(PoolConnectData, 1);
+
+    p->host = g_strdup(host);
+    p->port = g_strdup(port);
+    p->tls_port = g_strdup(tls_port);
+    p->ws_port = g_strdup(ws_port);
+    p->password = g_strdup(password);
+    p->ca_file = g_strdup(ca_file);
+    p->cert_subj = g_strdup(cert_subj);
+    p->handle = g_atomic_int_add(&nextHandle, 1);
+    g_timeout_add_full(G_PRIORITY_HIGH, 0, poolConnect1, p, NULL);
+    return p->handle;
+}
+
+static gboolean activate1(gpointer data)
+{
+    int32_t handle = GPOINTER_TO_INT(data);
+    SpiceConnection *conn = lookup_connection(handle);
+    SpiceDisplay *previous = global_display();
+
+    if (conn == NULL || conn == mainconn)
+        return FALSE;
+
+    SPICE_DEBUG("Activating connection %d instead of %d", handle, activeHandle);
+    mainconn = conn;
+    activeHandle = handle;
+    if (global_display() != NULL)
+        spice_display_switch(previous, global_display());
+    glue_quality_reset_stats();
+#if defined(USBREDIR)
+    usb_glue_register_session(spice_connection_get_session(conn));
+#endif
+    /* A pooled connection usually showed its first frame long ago */
+    if (spice_connection_get_channel_state(conn, SPICE_CHANNEL_DISPLAY) == GLUE_CHANNEL_READY)
+        onDisplayUsable(conn);
+    return FALSE;
+}
+
+/**
+ * Makes a pooled connection the active one. The previous one stays
+ * connected in the pool. Returns -1 if there is no such connection.
+ **/
+int16_t SpiceGlibGlue_Activate(int32_t handle)
+{
+    if (handle <= 0 || handle >= g_atomic_int_get(&nextHandle))
+        return -1;
+    g_timeout_add_full(G_PRIORITY_HIGH, 0, activate1, GINT_TO_POINTER(handle), NULL);
+    return 0;
+}
+
+/* Handle of the active connection, 0 if there is none. */
+int32_t SpiceGlibGlue_GetActiveConnection(void)
+{
+    return activeHandle;
+}
+
+static gboolean poolDisconnect1(gpointer data)
+{
+    int32_t handle = GPOINTER_TO_INT(data);
+    SpiceConnection *conn = lookup_connection(handle);
+
+    if (conn == NULL)
+        return FALSE;
+    if (conn == mainconn)
+        return disconnect1();
+    spice_connection_disconnect(conn);
+    remove_connection(handle);
+    return FALSE;
+}
+
+/* Closes a pooled connection, or the active one. */
+void SpiceGlibGlue_PoolDisconnect(int32_t handle)
+{
+    g_timeout_add_full(G_PRIORITY_HIGH, 0, poolDisconnect1, GINT_TO_POINTER(handle), NULL);
+}
+
 void SpiceGlibGlueInitializeGlue()
 {
 #ifdef PRINTING
@@ -267,6 +482,39 @@ void SpiceGlibGlueSetDisplayBuffer(uint32_t *display_buffer,
     spice_display_set_display_buffer(display_buffer, width, height);
 }
 
+/**
+ * Like SpiceGlibGlueSetDisplayBuffer(), with the row pitch in bytes, one of the
+ * GLUE_PIXEL_FORMAT_* formats and a GLUE_ORIENTATION_* orientation, so that the
+ * buffer can be uploaded as is. SpiceGlibGlueSetDisplayBuffer() uses RGBA,
+ * bottom-up on Android and iOS, and top-down elsewhere.
+ * Returns 0, or -1 if the format or stride are not valid.
+ **/
+int16_t SpiceGlibGlueSetDisplayBufferEx(void *display_buffer, int32_t width, int32_t height,
+                                        int32_t stride, int32_t format, int32_t orientation)
+{
+    SPICE_DEBUG("SpiceGlibGlueSetDisplayBufferEx");
+    return spice_display_set_display_buffer_ex(display_buffer, width, height,
+                                               stride, format, orientation);
+}
+
+/**
+ * Allocates a display buffer for SpiceGlibGlueSetDisplayBufferEx(), with its
+ * start and its rows aligned to alignment bytes (a power of two, 64 if it is
+ * 0), so that it can be mapped to a texture directly. Returns the buffer, and
+ * its row pitch in stride, or NULL on error. It is released with
+ * SpiceGlibGlueFreeDisplayBuffer(), after setting another buffer.
+ **/
+void *SpiceGlibGlueAllocDisplayBuffer(int32_t width, int32_t height, int32_t format,
+                                      int32_t alignment, int32_t *stride)
+{
+    return spice_display_alloc_display_buffer(width, height, format, alignment, stride);
+}
+
+void SpiceGlibGlueFreeDisplayBuffer(void *buffer)
+{
+    spice_display_free_display_buffer(buffer);
+}
+
 /**
  * Params: width, height
  *  IN:
@@ -298,6 +546,58 @@ void SpiceGlibGlueUnlockDisplayBuffer()
     spice_display_unlock_display_buffer();
 }
 
+/**
+ * Returns the modifier keys (GLUE_KEY_MOD_*) currently pressed in the guest,
+ * or -1 if there is no display.
+ **/
+int32_t SpiceGlibGlueGetKeyModifiers()
+{
+    if (global_display() == NULL)
+        return -1;
+    return spice_display_get_key_modifiers(global_display());
+}
+
+/**
+ * Enables tile hashing: invalidated areas whose pixels did not change are
+ * not copied to the display buffer, nor reported as updated.
+ **/
+void SpiceGlibGlueEnableTileHashing(int32_t enable)
+{
+    spice_display_enable_tile_hashing(enable);
+}
+
+/**
+ * Enables the detection of video streams. Their frames are then read with
+ * SpiceGlibGlueGetStreamFrame(), and their areas are not updated in the
+ * display buffer while they are active and read. A stream that has not been
+ * read for half a second is updated in the display buffer again.
+ **/
+void SpiceGlibGlueEnableStreamDetection(int32_t enable)
+{
+    spice_display_enable_stream_detection(enable);
+}
+
+/**
+ * Fills streams with up to maxStreams active streams.
+ * Returns how many there are.
+ **/
+int32_t SpiceGlibGlueGetStreams(SpiceGlibGlueStreamInfo *streams, int32_t maxStreams)
+{
+    return spice_display_get_streams(streams, maxStreams);
+}
+
+/**
+ * Copies the last frame of a stream to pixels (width * height, top-down, in
+ * the format the display buffer had when the stream was detected, so RGB565
+ * frames take two bytes per pixel), and its position and timestamp to info.
+ * Returns 0, or -1 if the stream ended or pixels is too small.
+ **/
+int32_t SpiceGlibGlueGetStreamFrame(int32_t id, uint32_t *pixels, int32_t maxPixels,
+                                    SpiceGlibGlueStreamInfo *info)
+{
+    return spice_display_get_stream_frame(id, pixels, maxPixels, info);
+}
+
 int16_t SpiceGlibGlueGetCursorPosition(int32_t* x, int32_t* y)
 {
     if (global_display() == NULL) {
@@ -0,0 +1,255 @@
+/**
+ * Copyright (C) 2016 flexVDI (Flexible Software Solutions S.L.)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef SHM_EXPORT
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/memfd.h>
+
+#include "glue-shm-export.h"
+#include "glue-spice-widget.h"
+#include "glue-spice-widget-priv.h"
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
+typedef struct {
+    gint x, y, w, h;
+} DamageRect;
+
+/* Written in the glib mainloop thread, enabled and disabled from any thread */
+static struct {
+    GMutex mutex;
+    int memFd;
+    int eventFd;
+    guint8 *map;
+    gsize mapSize;
+    SpiceGlibGlueShmHeader *header;
+    guint64 frames;
+    guint32 next;
+    gint width, height;
+    /* Area that each slot lacks since it was last written */
+    DamageRect pending[GLUE_SHM_MAX_SLOTS];
+} shm = {
+    .memFd = -1,
+    .eventFd = -1,
+};
+
+static void damage_union(DamageRect *r, gint x, gint y, gint w, gint h)
+{
+    gint x1, y1;
+
+    if (r->w == 0 || r->h == 0) {
+        r->x = x; r->y = y; r->w = w; r->h = h;
+        return;
+    }
+    x1 = MAX(r->x + r->w, x + w);
+    y1 = MAX(r->y + r->h, y + h);
+    r->x = MIN(r->x, x);
+    r->y = MIN(r->y, y);
+    r->w = x1 - r->x;
+    r->h = y1 - r->y;
+}
+
+/* Must be called with shm.mutex held. */
+static void shm_close(void)
+{
+    if (shm.map)
+        munmap(shm.map, shm.mapSize);
+    if (shm.memFd >= 0)
+        close(shm.memFd);
+    if (shm.eventFd >= 0)
+        close(shm.eventFd);
+    shm.map = NULL;
+    shm.header = NULL;
+    shm.memFd = shm.eventFd = -1;
+}
+
+gboolean glue_shm_export_enabled(void)
+{
+    return shm.header != NULL;
+}
+
+int32_t SpiceGlibGlueEnableShmExport(int32_t maxWidth, int32_t maxHeight, int32_t numSlots,
+                                     int32_t *memFd, int32_t *eventFd)
+{
+    gsize headerSize, pixelsOffset, slotSize;
+    guint32 stride;
+    int32_t format;
+
+    SPICE_DEBUG("Shared memory export of %dx%d in %d slots", maxWidth, maxHeight, numSlots);
+    if (maxWidth <= 0 || maxHeight <= 0 || numSlots < 2 || numSlots > GLUE_SHM_MAX_SLOTS)
+        return -1;
+
+    g_mutex_lock(&shm.mutex);
+    shm_close();
+
+    format = glue_display_buffer_format();
+    stride = ALIGN_UP(maxWidth * glue_pixel_format_bpp(format), 4);
+    headerSize = ALIGN_UP(sizeof(SpiceGlibGlueShmHeader), 64);
+    pixelsOffset = ALIGN_UP(sizeof(SpiceGlibGlueShmSlot), 64);
+    slotSize = ALIGN_UP(pixelsOffset + (gsize)stride * maxHeight, 4096);
+    shm.mapSize = headerSize + slotSize * numSlots;
+
+    shm.memFd = syscall(SYS_memfd_create, "spiceglue-display", MFD_CLOEXEC);
+    shm.eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (shm.memFd < 0 || shm.eventFd < 0 || ftruncate(shm.memFd, shm.mapSize) < 0) {
+        g_warning("Could not create the shared memory export: %s", g_strerror(errno));
+        shm_close();
+        g_mutex_unlock(&shm.mutex);
+        return -1;
+    }
+    shm.map = mmap(NULL, shm.mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, shm.memFd, 0);
+    if (shm.map == MAP_FAILED) {
+        g_warning("Could not map the shared memory export: %s", g_strerror(errno));
+        shm.map = NULL;
+        shm_close();
+        g_mutex_unlock(&shm.mutex);
+        return -1;
+    }
+
+    shm.header = (SpiceGlibGlueShmHeader *)shm.map;
+    shm.header->magic = GLUE_SHM_MAGIC;
+    shm.header->version = GLUE_SHM_VERSION;
+    shm.header->numSlots = numSlots;
+    shm.header->maxWidth = maxWidth;
+    shm.header->maxHeight = maxHeight;
+    shm.header->stride = stride;
+    shm.header->headerSize = headerSize;
+    shm.header->slotSize = slotSize;
+    shm.header->pixelsOffset = pixelsOffset;
+    shm.header->format = format;
+    shm.header->readerSlot = GLUE_SHM_NO_SLOT;
+    shm.frames = 0;
+    shm.next = 0;
+    shm.width = shm.height = 0; /* The first frame will be whole */
+
+    *memFd = shm.memFd;
+    *eventFd = shm.eventFd;
+    g_mutex_unlock(&shm.mutex);
+    return 0;
+}
+
+void SpiceGlibGlueDisableShmExport(void)
+{
+    SPICE_DEBUG("Shared memory export disabled");
+    g_mutex_lock(&shm.mutex);
+    shm_close();
+    g_mutex_unlock(&shm.mutex);
+}
+
+/* Must be called with shm.mutex held. Marks the next slot as being written
+ * with sequence, skipping the one held by the reader. Returns NULL if the
+ * reader kept taking the slots. */
+static SpiceGlibGlueShmSlot *claim_slot(SpiceGlibGlueShmHeader *header, guint64 sequence)
+{
+    SpiceGlibGlueShmSlot *slot;
+    guint64 previous;
+    guint32 i;
+
+    for (i = 0; i < header->numSlots; i++) {
+        slot = (SpiceGlibGlueShmSlot *)(shm.map + header->headerSize +
+                                        shm.next * header->slotSize);
+        previous = slot->sequence;
+        /* Stored before readerSlot is loaded, so either the reader sees an odd
+         * sequence, or this sees the slot held */
+        __atomic_store_n(&slot->sequence, sequence, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&header->readerSlot, __ATOMIC_SEQ_CST) != shm.next)
+            return slot;
+        __atomic_store_n(&slot->sequence, previous, __ATOMIC_SEQ_CST);
+        shm.next = (shm.next + 1) % header->numSlots;
+    }
+    return NULL;
+}
+
+void glue_shm_export_frame(const guint32 *src, gint srcStride, gint width, gint height,
+                           gint x, gint y, gint w, gint h)
+{
+    SpiceGlibGlueShmHeader *header;
+    SpiceGlibGlueShmSlot *slot;
+    DamageRect *copy;
+    guint8 *dst;
+    const guint64 one = 1;
+    guint32 i;
+
+    g_mutex_lock(&shm.mutex);
+    header = shm.header;
+    if (header == NULL || width > header->maxWidth || height > header->maxHeight) {
+        g_mutex_unlock(&shm.mutex);
+        return;
+    }
+
+    if (width != shm.width || height != shm.height) {
+        x = y = 0;
+        w = width;
+        h = height;
+        shm.width = width;
+        shm.height = height;
+    }
+    x = CLAMP(x, 0, width);
+    y = CLAMP(y, 0, height);
+    w = MIN(w, width - x);
+    h = MIN(h, height - y);
+    if (w <= 0 || h <= 0) {
+        g_mutex_unlock(&shm.mutex);
+        return;
+    }
+    for (i = 0; i < header->numSlots; i++) {
+        damage_union(&shm.pending[i], x, y, w, h);
+    }
+
+    slot = claim_slot(header, shm.frames * 2 + 1);
+    if (slot == NULL) {
+        /* The damage stays pending for the next frame */
+        g_mutex_unlock(&shm.mutex);
+        return;
+    }
+    copy = &shm.pending[shm.next];
+    shm.frames++;
+
+    dst = (guint8 *)slot + header->pixelsOffset + copy->y * header->stride +
+          copy->x * glue_pixel_format_bpp(header->format);
+    glue_copy_pixels(header->format,
+                     (const guint8 *)src + copy->y * srcStride + copy->x * sizeof(Color32),
+                     srcStride, dst, header->stride, copy->w, copy->h);
+    copy->w = copy->h = 0;
+
+    slot->timestamp = g_get_monotonic_time();
+    slot->width = width;
+    slot->height = height;
+    slot->dirtyX = x;
+    slot->dirtyY = y;
+    slot->dirtyWidth = w;
+    slot->dirtyHeight = h;
+    __atomic_store_n(&slot->sequence, shm.frames * 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->latest, shm.next, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->sequence, shm.frames * 2, __ATOMIC_RELEASE);
+    shm.next = (shm.next + 1) % header->numSlots;
+
+    if (write(shm.eventFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        SPICE_DEBUG("Could not notify the shared memory frame: %s", g_strerror(errno));
+    g_mutex_unlock(&shm.mutex);
+}
+
+#endif
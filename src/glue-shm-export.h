@@ -0,0 +1,95 @@
+/**
+ * Copyright (C) 2016 flexVDI (Flexible Software Solutions S.L.)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Shared memory display export, for renderers running in another process.
+ *
+ * The display is written, converted to the format of the display buffer when
+ * the export was enabled (RGBA if there is none), to a ring of numSlots full
+ * frames in a memfd. Each frame is notified by writing to an eventfd. The
+ * client program passes both descriptors to the other process, which maps the
+ * memfd shared and presents frames without copying them.
+ *
+ * Layout: a SpiceGlibGlueShmHeader at offset 0, and slot i at
+ * headerSize + i * slotSize, beginning with a SpiceGlibGlueShmSlot and with
+ * the pixels at pixelsOffset from it. A slot sequence is odd while the slot
+ * is being written.
+ *
+ * There can be one reader, which holds a slot while it presents it: it stores
+ * the latest slot in readerSlot and then checks that its sequence is even and
+ * not 0, or tries again. The writer does not write the slot in readerSlot, so
+ * its pixels stay as they are until the reader sets readerSlot back to
+ * GLUE_SHM_NO_SLOT. Both use sequentially consistent atomics for readerSlot
+ * and the slot sequence. tests/test-shm-export.c has a reference reader.
+ */
+
+#ifndef _GLUE_SHM_EXPORT_H
+#define _GLUE_SHM_EXPORT_H
+
+#include <stdint.h>
+
+#define GLUE_SHM_MAGIC   0x45535646 /* "FVSE" */
+#define GLUE_SHM_VERSION 3
+#define GLUE_SHM_MAX_SLOTS 8
+#define GLUE_SHM_NO_SLOT 0xFFFFFFFF
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t numSlots;
+    uint32_t maxWidth;
+    uint32_t maxHeight;
+    uint32_t stride;            /* Bytes per row in every slot */
+    uint32_t headerSize;
+    uint32_t slotSize;
+    uint32_t pixelsOffset;
+    uint32_t format;            /* GLUE_PIXEL_FORMAT_* of every slot */
+    volatile uint32_t latest;   /* Slot with the last complete frame */
+    volatile uint64_t sequence; /* Sequence of that frame, 0 if there is none yet */
+    volatile uint32_t readerSlot; /* Slot held by the reader, written by it */
+} SpiceGlibGlueShmHeader;
+
+typedef struct {
+    volatile uint64_t sequence; /* Twice the frame number; odd while being written */
+    int64_t timestamp;          /* g_get_monotonic_time() when it was written */
+    uint32_t width;
+    uint32_t height;
+    /* Area changed since the previous frame */
+    int32_t dirtyX;
+    int32_t dirtyY;
+    int32_t dirtyWidth;
+    int32_t dirtyHeight;
+} SpiceGlibGlueShmSlot;
+
+#ifdef SHM_EXPORT
+#include <glib.h>
+
+/* Called internally when the display changes, in the glib mainloop thread.
+ * src is the whole surface, ARGB, with rows of srcStride bytes. */
+gboolean glue_shm_export_enabled(void);
+void glue_shm_export_frame(const guint32 *src, gint srcStride, gint width, gint height,
+                           gint x, gint y, gint w, gint h);
+
+/* Starts exporting frames up to maxWidth x maxHeight in a ring of numSlots.
+ * Returns 0 and the descriptors, which belong to the glue, or -1 on error.
+ * The first frame is written with the next display update. */
+int32_t SpiceGlibGlueEnableShmExport(int32_t maxWidth, int32_t maxHeight, int32_t numSlots,
+                                     int32_t *memFd, int32_t *eventFd);
+void SpiceGlibGlueDisableShmExport(void);
+#endif
+
+#endif /* _GLUE_SHM_EXPORT_H */
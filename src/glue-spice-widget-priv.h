@@ -100,6 +100,8 @@ struct _SpiceDisplayPrivate {
     const guint16           *keycode_map;
     size_t                  keycode_maplen;
     uint32_t                key_state[512 / 32];
+    uint32_t                key_state_words; /* bit i set if key_state[i] != 0 */
+    uint32_t                key_modifiers; /* GLUE_KEY_MOD_* of the pressed keys */
     int                     key_delayed_scancode;
     guint                   key_delayed_id;
     SpiceGrabSequence       *grabseq; /* the configured key sequence */
@@ -123,6 +125,24 @@ struct _SpiceDisplayPrivate {
     gboolean                updatedDisplayBuffer;
 };
 
+typedef unsigned int Color32;
+
+static inline Color32 ARGBtoABGR(Color32 x)
+{
+    return (( 0xFF000000) ) |
+    ((x & 0x00FF0000) >> 16) |
+    ((x & 0x0000FF00) ) |
+    ((x & 0x000000FF) <<  16 );
+}
+
+/* Converts w x h pixels of the guest ARGB surface to one of the
+ * GLUE_PIXEL_FORMAT_* formats, as in the display buffer. */
+gint glue_pixel_format_bpp(int32_t format);
+void glue_copy_pixels(int32_t format, const guint8 *src, gint srcStride,
+                      guint8 *dst, gint dstStride, gint w, gint h);
+/* Format of the display buffer, GLUE_PIXEL_FORMAT_RGBA if none is set */
+int32_t glue_display_buffer_format(void);
+
 G_END_DECLS
 
 #endif
@@ -41,17 +41,32 @@
 #include "glue-service.h"
 #include "mono-glue-types.h"
 #include "glue-clipboard.h"
+#include "glue-shm-export.h"
+#include "glue-profiler.h"
+#include "glue-quality.h"
+#include "glue-keymaps.h"
 
 
 static struct {
-    uint32_t *buffer;
+    guint8   *buffer;
     int32_t  width;
     int32_t  height;
+    int32_t  stride;        /* In bytes */
+    int32_t  format;        /* GLUE_PIXEL_FORMAT_* */
+    int32_t  orientation;   /* GLUE_ORIENTATION_* */
 } glue_buffer;
 
 /* MUTEX to ensure that glue_buffer is not freed while it's being written */
 GMutex glue_display_lock;
 
+/* Hashes of the display tiles in the last copy, see skip_unchanged_tiles() */
+static struct {
+    gboolean enabled;
+    gboolean reset;     /* The hashes no longer match the display buffer */
+    gint tilesX, tilesY;
+    guint64 *hashes;    /* 0 if unknown */
+} tiles;
+
 
 G_DEFINE_TYPE(SpiceDisplay, spice_display, SPICE_TYPE_CHANNEL);
 
@@ -69,6 +84,7 @@ static guint signals[SPICE_DISPLAY_LAST_SIGNAL];
 static HWND win32_window = NULL;
 #endif
 
+/* Orientation of the buffers set with spice_display_set_display_buffer() */
 #if defined(ANDROID)
 #define INVERSE_BUFFER 1
 #elif __APPLE__
@@ -77,6 +93,11 @@ static HWND win32_window = NULL;
     #define INVERSE_BUFFER 1
     #endif
 #endif
+#if INVERSE_BUFFER
+#define DEFAULT_ORIENTATION GLUE_ORIENTATION_BOTTOM_UP
+#else
+#define DEFAULT_ORIENTATION GLUE_ORIENTATION_TOP_DOWN
+#endif
 
 static void disconnect_main(SpiceDisplay *display);
 static void disconnect_display(SpiceDisplay *display);
@@ -85,6 +106,7 @@ static void channel_new(SpiceSession *s, SpiceChannel *channel, gpointer data);
 static void channel_destroy(SpiceSession *s, SpiceChannel *channel, gpointer data);
 static void sync_keyboard_lock_modifiers(SpiceDisplay *display);
 static void try_mouse_ungrab(SpiceDisplay *display);
+static void reset_streams(void);
 
 
 static int on_gain_focus(SpiceDisplay *display);
@@ -203,6 +225,7 @@ static void spice_display_init(SpiceDisplay *display)
     d->monitor_ready = TRUE;
 
     d->resize_guest_enable=TRUE;
+    d->keycode_map = glue_keymap_get(&d->keycode_maplen);
     on_gain_focus(display);
 
     g_mutex_init(&d->cursor_lock);
@@ -498,30 +521,77 @@ int32_t SpiceGlibRecalcGeometry(int32_t x, int32_t y, int32_t w, int32_t h) {
 
 #define CONVERT_0555_TO_8888(s) (CONVERT_0555_TO_0888(s) | 0xff000000)
 
+#ifdef __GNUC__
+#define lowest_bit(x) __builtin_ctz(x)
+#else
+#define lowest_bit(x) g_bit_nth_lsf(x, -1)
+#endif
+
+/* Scancodes of the modifier keys, extended ones with 0x100 */
+static const struct {
+    guint16 scancode;
+    guint32 modifier;
+} modifier_keys[] = {
+    { 0x02a, GLUE_KEY_MOD_LSHIFT },
+    { 0x036, GLUE_KEY_MOD_RSHIFT },
+    { 0x01d, GLUE_KEY_MOD_LCTRL },
+    { 0x11d, GLUE_KEY_MOD_RCTRL },
+    { 0x038, GLUE_KEY_MOD_LALT },
+    { 0x138, GLUE_KEY_MOD_RALT },
+    { 0x15b, GLUE_KEY_MOD_LMETA },
+    { 0x15c, GLUE_KEY_MOD_RMETA },
+};
+
+static guint32 key_modifier(int scancode)
+{
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS(modifier_keys); i++) {
+        if (modifier_keys[i].scancode == scancode)
+            return modifier_keys[i].modifier;
+    }
+    return 0;
+}
+
+/* Updates the set of pressed keys */
+static void set_key_state(SpiceDisplayPrivate *d, int scancode, gboolean down)
+{
+    uint32_t i = scancode / 32, m = 1u << (scancode % 32);
+
+    if (down) {
+        d->key_state[i] |= m;
+        d->key_state_words |= 1u << i;
+        d->key_modifiers |= key_modifier(scancode);
+    } else {
+        d->key_state[i] &= ~m;
+        if (!d->key_state[i])
+            d->key_state_words &= ~(1u << i);
+        d->key_modifiers &= ~key_modifier(scancode);
+    }
+}
+
 void send_key(SpiceDisplay *display, int scancode, int down)
 {
     SpiceDisplayPrivate *d = SPICE_DISPLAY_GET_PRIVATE(display);
-    uint32_t i, b, m;
+    uint32_t i;
 
     if (!d->inputs)
         return;
 
     i = scancode / 32;
-    b = scancode % 32;
-    m = (1 << b);
     g_return_if_fail(i < SPICE_N_ELEMENTS(d->key_state));
 
     if (down) {
         // send event to guest
         spice_inputs_channel_key_press(d->inputs, scancode);
         // update local "key-is-pressed"  map
-        d->key_state[i] |= m;
+        set_key_state(d, scancode, TRUE);
     } else {
-        if (!(d->key_state[i] & m)) {
+        if (!(d->key_state[i] & (1u << (scancode % 32)))) {
             return;
         }
         spice_inputs_channel_key_release(d->inputs, scancode);
-        d->key_state[i] &= ~m;
+        set_key_state(d, scancode, FALSE);
     }
 }
 
@@ -530,22 +600,40 @@ void send_key(SpiceDisplay *display, int scancode, int down)
  * Send release-key events to the guest for every key that is pressed.
  * This avoids the "stuck key" problem when widget lost focus with a key pressed
  * and did not receive the release event.
- * This generates more key events than needed, but that is not a big deal.
+ * Only the pressed keys are visited, and they are all released in one burst,
+ * modifiers last, so that the guest does not see a modified key without them.
  */
 static void release_keys(SpiceDisplay *display)
 {
     SpiceDisplayPrivate *d = SPICE_DISPLAY_GET_PRIVATE(display);
-    uint32_t i, b;
+    uint32_t words, bits, i, n = 0;
+    guint16 scancodes[G_N_ELEMENTS(modifier_keys)];
+
+    if (!d->inputs || !d->key_state_words)
+        return;
 
     SPICE_DEBUG("%s", __FUNCTION__);
-    for (i = 0; i < SPICE_N_ELEMENTS(d->key_state); i++) {
-        if (!d->key_state[i]) {
-            continue;
-        }
-        for (b = 0; b < 32; b++) {
-            send_key(display, i * 32 + b, FALSE);
+    for (words = d->key_state_words; words; words &= words - 1) {
+        i = lowest_bit(words);
+        for (bits = d->key_state[i]; bits; bits &= bits - 1) {
+            int scancode = i * 32 + lowest_bit(bits);
+            if (key_modifier(scancode))
+                scancodes[n++] = scancode;
+            else
+                spice_inputs_channel_key_release(d->inputs, scancode);
         }
+        d->key_state[i] = 0;
     }
+    for (i = 0; i < n; i++)
+        spice_inputs_channel_key_release(d->inputs, scancodes[i]);
+    d->key_state_words = 0;
+    d->key_modifiers = 0;
+}
+
+/* Snapshot of the modifier keys pressed in the guest, GLUE_KEY_MOD_* */
+int32_t spice_display_get_key_modifiers(SpiceDisplay *display)
+{
+    return SPICE_DISPLAY_GET_PRIVATE(display)->key_modifiers;
 }
 
 /* ---------------------------------------------------------------- */
@@ -927,11 +1015,13 @@ static void primary_create(SpiceChannel *channel,
     SpiceDisplayPrivate *d = SPICE_DISPLAY_GET_PRIVATE(display);
 
     d->format = format;
-    d->stride = stride;
+    d->stride = stride > 0 ? stride : width * sizeof(Color32);
     d->shmid = shmid;
     d->width = width;
     d->height = height;
     d->data_origin = d->data = imgdata;
+    tiles.reset = TRUE;
+    glue_profiler_mark(GLUE_PHASE_PRIMARY_CREATE);
 
     update_monitor_area(display);
 }
@@ -949,16 +1039,165 @@ static void primary_destroy(SpiceChannel *channel, gpointer data)
     d->shmid  = 0;
     d->data   = NULL;
     d->data_origin = NULL;
+    reset_streams();
+}
+
+/*
+ * Tile hashing. Guests often invalidate areas whose pixels did not change.
+ * With tile hashing enabled, the tiles of the invalidated area are hashed and
+ * compared with the hashes of the last copy, and only the tiles that changed
+ * are copied. If none changed, nothing is copied and the display buffer is
+ * not marked as updated.
+ */
+#define TILE_SIZE 64
+#define TILE_HASH_PRIME 0x100000001B3ULL
+
+static inline guint64 rotl64(guint64 x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+/* Four independent lanes, so that the compiler can vectorize the inner loop. */
+static guint64 hash_tile(const Color32 *src, gint stride, gint w, gint h)
+{
+    guint64 lanes[4] = {
+        0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL,
+        0x165667B19E3779F9ULL, 0x27D4EB2F165667C5ULL
+    };
+    gint i, j;
+
+    for (i = 0; i < h; i++, src += stride) {
+        for (j = 0; j + 4 <= w; j += 4) {
+            lanes[0] = (lanes[0] ^ src[j]) * TILE_HASH_PRIME;
+            lanes[1] = (lanes[1] ^ src[j + 1]) * TILE_HASH_PRIME;
+            lanes[2] = (lanes[2] ^ src[j + 2]) * TILE_HASH_PRIME;
+            lanes[3] = (lanes[3] ^ src[j + 3]) * TILE_HASH_PRIME;
+        }
+        for (; j < w; j++) {
+            lanes[j & 3] = (lanes[j & 3] ^ src[j]) * TILE_HASH_PRIME;
+        }
+    }
+    return (lanes[0] ^ rotl64(lanes[1], 16) ^ rotl64(lanes[2], 32) ^ rotl64(lanes[3], 48)) | 1;
+}
+
+/* Must be called with glue_display_lock held. Narrows the invalidated area to
+ * the tiles that changed since the last copy. Returns FALSE if none did. */
+static gboolean skip_unchanged_tiles(SpiceDisplayPrivate *d)
+{
+    gint tilesX = (d->width + TILE_SIZE - 1) / TILE_SIZE;
+    gint tilesY = (d->height + TILE_SIZE - 1) / TILE_SIZE;
+    gint x0 = MAX(d->invalidate_x, 0), y0 = MAX(d->invalidate_y, 0);
+    gint x1 = MIN(d->invalidate_x + d->invalidate_w, d->width);
+    gint y1 = MIN(d->invalidate_y + d->invalidate_h, d->height);
+    gint minX = tilesX, minY = tilesY, maxX = -1, maxY = -1;
+    gint tx, ty;
+
+    if (x0 >= x1 || y0 >= y1)
+        return TRUE;
+
+    if (tiles.reset || tiles.tilesX != tilesX || tiles.tilesY != tilesY) {
+        g_free(tiles.hashes);
+        tiles.hashes = g_new0(guint64, tilesX * tilesY);
+        tiles.tilesX = tilesX;
+        tiles.tilesY = tilesY;
+        tiles.reset = FALSE;
+    }
+
+    for (ty = y0 / TILE_SIZE; ty <= (y1 - 1) / TILE_SIZE; ty++) {
+        for (tx = x0 / TILE_SIZE; tx <= (x1 - 1) / TILE_SIZE; tx++) {
+            const Color32 *src = (const Color32 *)((const guint8 *)d->data +
+                                                   ty * TILE_SIZE * d->stride) + tx * TILE_SIZE;
+            guint64 hash = hash_tile(src, d->stride / sizeof(Color32),
+                                     MIN(TILE_SIZE, d->width - tx * TILE_SIZE),
+                                     MIN(TILE_SIZE, d->height - ty * TILE_SIZE));
+            guint64 *old = &tiles.hashes[ty * tilesX + tx];
+            if (hash != *old) {
+                *old = hash;
+                minX = MIN(minX, tx);
+                maxX = MAX(maxX, tx);
+                minY = MIN(minY, ty);
+                maxY = MAX(maxY, ty);
+            }
+        }
+    }
+
+    if (maxX < 0)
+        return FALSE;
+
+    /* Whole tiles, their hashes cover pixels outside the invalidated area */
+    d->invalidate_x = minX * TILE_SIZE;
+    d->invalidate_y = minY * TILE_SIZE;
+    d->invalidate_w = MIN(d->width, (maxX + 1) * TILE_SIZE) - d->invalidate_x;
+    d->invalidate_h = MIN(d->height, (maxY + 1) * TILE_SIZE) - d->invalidate_y;
+    return TRUE;
+}
+
+void spice_display_enable_tile_hashing(gboolean enable)
+{
+    SPICE_DEBUG("Tile hashing %s", enable ? "enabled" : "disabled");
+    g_mutex_lock(&glue_display_lock);
+    tiles.enabled = enable;
+    tiles.reset = TRUE;
+    g_mutex_unlock(&glue_display_lock);
+}
+
+/*
+ * Copy kernels, one per output format, from the guest ARGB surface. The
+ * orientation is a negative destination stride, so the inner loops have no
+ * branches.
+ */
+#define CONVERT_TO_RGBA(s)   ARGBtoABGR(s)
+#define CONVERT_TO_BGRA(s)   ((s) | 0xFF000000)
+#define CONVERT_TO_XRGB(s)   (s)
+#define CONVERT_TO_RGB565(s) ((guint16)((((s) >> 8) & 0xF800) | (((s) >> 5) & 0x07E0) | \
+                                        (((s) >> 3) & 0x001F)))
+
+typedef void (*CopyKernel)(const guint8 *src, gint srcStride, guint8 *dst, gint dstStride,
+                           gint w, gint h);
+
+#define DEFINE_COPY_KERNEL(name, DstType, CONVERT)                                    \
+static void copy_to_##name(const guint8 *src, gint srcStride,                         \
+                           guint8 *dst, gint dstStride, gint w, gint h)               \
+{                                                                                     \
+    gint i, j;                                                                        \
+    for (i = 0; i < h; i++, src += srcStride, dst += dstStride) {                     \
+        const Color32 *s = (const Color32 *)src;                                      \
+        DstType *t = (DstType *)dst;                                                  \
+        for (j = 0; j < w; j++) {                                                     \
+            t[j] = CONVERT(s[j]);                                                     \
+        }                                                                             \
+    }                                                                                 \
 }
 
-typedef unsigned int Color32;
+DEFINE_COPY_KERNEL(rgba, Color32, CONVERT_TO_RGBA)
+DEFINE_COPY_KERNEL(bgra, Color32, CONVERT_TO_BGRA)
+DEFINE_COPY_KERNEL(xrgb, Color32, CONVERT_TO_XRGB)
+DEFINE_COPY_KERNEL(rgb565, guint16, CONVERT_TO_RGB565)
+
+static const struct {
+    CopyKernel copy;
+    gint bytesPerPixel;
+} copy_kernels[GLUE_PIXEL_FORMAT_COUNT] = {
+    [GLUE_PIXEL_FORMAT_RGBA]   = { copy_to_rgba, 4 },
+    [GLUE_PIXEL_FORMAT_BGRA]   = { copy_to_bgra, 4 },
+    [GLUE_PIXEL_FORMAT_XRGB]   = { copy_to_xrgb, 4 },
+    [GLUE_PIXEL_FORMAT_RGB565] = { copy_to_rgb565, 2 },
+};
+
+gint glue_pixel_format_bpp(int32_t format)
+{
+    return copy_kernels[format].bytesPerPixel;
+}
 
-static inline Color32 ARGBtoABGR(Color32 x)
+void glue_copy_pixels(int32_t format, const guint8 *src, gint srcStride,
+                      guint8 *dst, gint dstStride, gint w, gint h)
 {
-    return (( 0xFF000000) ) |
-    ((x & 0x00FF0000) >> 16) |
-    ((x & 0x0000FF00) ) |
-    ((x & 0x000000FF) <<  16 );
+    copy_kernels[format].copy(src, srcStride, dst, dstStride, w, h);
+}
+
+int32_t glue_display_buffer_format(void)
+{
+    return glue_buffer.format;
 }
 
 gboolean copy_display_to_glue()
@@ -975,6 +1214,19 @@ gboolean copy_display_to_glue()
         return TRUE;
     }
 
+#ifdef SHM_EXPORT
+    if (glue_shm_export_enabled()) {
+        glue_shm_export_frame(d->data, d->stride, d->width, d->height, d->invalidate_x,
+                              d->invalidate_y, d->invalidate_w, d->invalidate_h);
+        if (glue_buffer.buffer == NULL) {
+            /* The display is only exported */
+            d->copy_scheduled = 0;
+            d->invalidated = FALSE;
+            return FALSE;
+        }
+    }
+#endif
+
     g_mutex_lock(&glue_display_lock);
 
     if (glue_buffer.buffer == NULL) {
@@ -990,40 +1242,302 @@ gboolean copy_display_to_glue()
         return TRUE;
     }
 
-    Color32 * src2_data = (Color32 *)d->data;
-    Color32 * dst2_data = (Color32 *)glue_buffer.buffer;
+    if (tiles.enabled && !skip_unchanged_tiles(d)) {
+        /* Nothing changed, do not make the client program upload it again */
+        d->copy_scheduled = 0;
+        d->invalidated = FALSE;
+        g_mutex_unlock(&glue_display_lock);
+        return FALSE;
+    }
+
     int maxI = d->height > (d->invalidate_y + d->invalidate_h)? d->invalidate_h : d->height - d->invalidate_y;
     int maxJ = d->width  > (d->invalidate_x + d->invalidate_w)? d->invalidate_x + d->invalidate_w : d->width;
-    src2_data += d->width * d->invalidate_y;
-#if INVERSE_BUFFER
-    int tmp = (glue_buffer.height - d->invalidate_y - 1) * glue_buffer.width;
-    dst2_data += tmp;
-#else
-    dst2_data += glue_buffer.width * d->invalidate_y;
-#endif
-
-    int i, j;
-    for (i = 0 ; i < maxI; i++) {
-        for (j = d->invalidate_x; j < maxJ; j ++) {
-            dst2_data[j] = ARGBtoABGR(src2_data[j]);
-        }
-#if INVERSE_BUFFER
-        dst2_data -= glue_buffer.width;
-#else
-        dst2_data += glue_buffer.width;
-#endif
-        src2_data += d->width;
+    gint srcStride = d->stride;
+    gint dstStride = glue_buffer.stride;
+    gint bpp = copy_kernels[glue_buffer.format].bytesPerPixel;
+    const guint8 *src = (const guint8 *)d->data + srcStride * d->invalidate_y +
+                        d->invalidate_x * sizeof(Color32);
+    guint8 *dst = glue_buffer.buffer + d->invalidate_x * bpp;
+    if (glue_buffer.orientation == GLUE_ORIENTATION_BOTTOM_UP) {
+        dst += (gsize)(glue_buffer.height - d->invalidate_y - 1) * dstStride;
+        dstStride = -dstStride;
+    } else {
+        dst += (gsize)d->invalidate_y * dstStride;
+    }
+    if (maxI > 0 && maxJ > d->invalidate_x) {
+        copy_kernels[glue_buffer.format].copy(src, srcStride, dst, dstStride,
+                                              maxJ - d->invalidate_x, maxI);
     }
 
     d->copy_scheduled = 0;
     d->invalidated = FALSE;
     d->updatedDisplayBuffer = TRUE;
+    glue_profiler_mark(GLUE_PHASE_FIRST_COPY);
 
 
     g_mutex_unlock(&glue_display_lock);
     return FALSE;
 }
 
+/*
+ * Video streams. The guest video that spice-glib decodes arrives as repeated
+ * invalidations of the same area. With stream detection enabled, an area
+ * invalidated STREAM_MIN_FRAMES times, with less than STREAM_TIMEOUT_MS between
+ * them, becomes a stream: its frames are kept apart, with their timestamp, so
+ * that the client program can present them at their own cadence, and they are
+ * no longer copied to glue_buffer. That lasts while the client program reads
+ * them: if it has not read a frame for STREAM_TIMEOUT_MS, the frames are copied
+ * to glue_buffer too, so that a slow or unaware client program does not see a
+ * frozen area. When the stream stops, its area is copied again.
+ */
+#define GLUE_MAX_STREAMS 4
+#define STREAM_MIN_AREA (128 * 96)
+#define STREAM_MIN_FRAMES 10
+#define STREAM_TIMEOUT_MS 500
+
+typedef struct {
+    gint x, y, w, h;
+    gint hits;
+    gint64 lastHit;
+    gint64 lastRead;    /* Last frame read by the client program, or detection time */
+    int32_t id;         /* 0 while it is only a candidate */
+    uint32_t sequence;
+    int64_t timestamp;
+    int32_t format;     /* Of the display buffer when the stream was detected */
+    guint8 *pixels;     /* Last frame, read by the client program */
+    guint8 *back;       /* Buffer for the next frame, NULL while it is being written */
+} GlueStream;
+
+static GlueStream glue_streams[GLUE_MAX_STREAMS];
+static gboolean stream_detection = FALSE;
+static int32_t next_stream_id = 1;
+static guint stream_timer = 0;
+/* MUTEX to protect the stream frames, read by the client program */
+static GMutex glue_stream_lock;
+
+static void add_damage(SpiceDisplayPrivate *d, gint x, gint y, gint w, gint h);
+
+/* Must be called with glue_stream_lock held. */
+static void stream_remove(GlueStream *stream)
+{
+    g_free(stream->pixels);
+    g_free(stream->back);
+    memset(stream, 0, sizeof(*stream));
+}
+
+/* GSourceFunc, ends the streams that have not been updated for a while, and
+ * copies their area to glue_buffer. */
+static gboolean expire_streams(gpointer data)
+{
+    gint64 now = g_get_monotonic_time();
+    gboolean active = FALSE;
+    int i;
+
+    g_mutex_lock(&glue_stream_lock);
+    for (i = 0; i < GLUE_MAX_STREAMS; i++) {
+        GlueStream *stream = &glue_streams[i];
+        if (stream->hits == 0)
+            continue;
+        if (now - stream->lastHit < STREAM_TIMEOUT_MS * 1000) {
+            active |= stream->id != 0;
+            continue;
+        }
+        if (stream->id != 0 && global_display() != NULL) {
+            SPICE_DEBUG("Stream %d ended", stream->id);
+            add_damage(SPICE_DISPLAY_GET_PRIVATE(global_display()),
+                       stream->x, stream->y, stream->w, stream->h);
+        }
+        stream_remove(stream);
+    }
+    if (!active)
+        stream_timer = 0;
+    g_mutex_unlock(&glue_stream_lock);
+    return active;
+}
+
+/* Copies a frame of the area x, y, w, h to dst, converted to format, without
+ * any lock held. */
+static void stream_copy_frame(SpiceDisplayPrivate *d, int32_t format, guint8 *dst,
+                              gint x, gint y, gint w, gint h)
+{
+    const guint8 *src = (const guint8 *)d->data + d->stride * y + x * sizeof(Color32);
+
+    glue_copy_pixels(format, src, d->stride, dst, w * glue_pixel_format_bpp(format), w, h);
+}
+
+/* Returns TRUE if the area is a stream read by the client program, and then
+ * the frame has been taken and must not be copied to glue_buffer. */
+static gboolean stream_invalidate(SpiceDisplayPrivate *d, gint x, gint y, gint w, gint h)
+{
+    GlueStream *stream = NULL, *oldest = NULL;
+    gint64 now = g_get_monotonic_time();
+    gboolean isStream, isRead;
+    int i;
+
+    if (w * h < STREAM_MIN_AREA || d->data == NULL ||
+        x < 0 || y < 0 || x + w > d->width || y + h > d->height)
+        return FALSE;
+
+    g_mutex_lock(&glue_stream_lock);
+    for (i = 0; i < GLUE_MAX_STREAMS && stream == NULL; i++) {
+        GlueStream *s = &glue_streams[i];
+        if (s->hits && s->x == x && s->y == y && s->w == w && s->h == h)
+            stream = s;
+        else if (oldest == NULL || s->lastHit < oldest->lastHit)
+            oldest = s;
+    }
+
+    if (stream == NULL || now - stream->lastHit >= STREAM_TIMEOUT_MS * 1000) {
+        /* A new candidate; an active stream is not replaced */
+        if (stream == NULL)
+            stream = oldest;
+        if (stream->id != 0) {
+            g_mutex_unlock(&glue_stream_lock);
+            return FALSE;
+        }
+        stream_remove(stream);
+        stream->x = x;
+        stream->y = y;
+        stream->w = w;
+        stream->h = h;
+    }
+    stream->hits++;
+    stream->lastHit = now;
+
+    if (stream->id == 0 && stream->hits >= STREAM_MIN_FRAMES) {
+        stream->id = next_stream_id++;
+        stream->lastRead = now;
+        stream->format = glue_display_buffer_format();
+        stream->pixels = g_malloc0((gsize)w * h * glue_pixel_format_bpp(stream->format));
+        stream->back = g_malloc((gsize)w * h * glue_pixel_format_bpp(stream->format));
+        SPICE_DEBUG("Stream %d detected at %dx%d+%d+%d", stream->id, w, h, x, y);
+        if (stream_timer == 0)
+            stream_timer = g_timeout_add(STREAM_TIMEOUT_MS, expire_streams, NULL);
+    }
+
+    isStream = stream->id != 0;
+    if (isStream && stream->back != NULL) {
+        /* The frame is written to the back buffer without the lock, and only
+         * swapped with the one read by the client program under it */
+        int32_t id = stream->id, format = stream->format;
+        guint8 *back = stream->back;
+        stream->back = NULL;
+        g_mutex_unlock(&glue_stream_lock);
+
+        stream_copy_frame(d, format, back, x, y, w, h);
+
+        g_mutex_lock(&glue_stream_lock);
+        if (stream->id == id && stream->back == NULL) {
+            stream->back = stream->pixels;
+            stream->pixels = back;
+            stream->sequence++;
+            stream->timestamp = now;
+        } else {
+            /* The stream was removed meanwhile */
+            g_free(back);
+        }
+    }
+    isRead = isStream && now - stream->lastRead < STREAM_TIMEOUT_MS * 1000;
+    g_mutex_unlock(&glue_stream_lock);
+    return isRead;
+}
+
+static void reset_streams(void)
+{
+    int i;
+
+    g_mutex_lock(&glue_stream_lock);
+    for (i = 0; i < GLUE_MAX_STREAMS; i++) {
+        stream_remove(&glue_streams[i]);
+    }
+    if (stream_timer) {
+        g_source_remove(stream_timer);
+        stream_timer = 0;
+    }
+    g_mutex_unlock(&glue_stream_lock);
+}
+
+/* Called when the active display changes from previous to display, in the
+ * glib mainloop. Keys pressed in the previous one are released, and the new
+ * one is copied whole. */
+void spice_display_switch(SpiceDisplay *previous, SpiceDisplay *display)
+{
+    SpiceDisplayPrivate *d = SPICE_DISPLAY_GET_PRIVATE(display);
+
+    if (previous != NULL)
+        release_keys(previous);
+
+    g_mutex_lock(&glue_display_lock);
+    tiles.reset = TRUE;
+    g_mutex_unlock(&glue_display_lock);
+    reset_streams();
+
+    if (d->data != NULL) {
+        d->invalidated = FALSE;
+        add_damage(d, 0, 0, d->width, d->height);
+    }
+    d->updatedDisplayBuffer = TRUE;
+}
+
+void spice_display_enable_stream_detection(gboolean enable)
+{
+    SPICE_DEBUG("Stream detection %s", enable ? "enabled" : "disabled");
+    stream_detection = enable;
+    if (!enable)
+        reset_streams();
+}
+
+int32_t spice_display_get_streams(SpiceGlibGlueStreamInfo *streams, int32_t maxStreams)
+{
+    int32_t i, n = 0;
+
+    g_mutex_lock(&glue_stream_lock);
+    for (i = 0; i < GLUE_MAX_STREAMS && n < maxStreams; i++) {
+        GlueStream *stream = &glue_streams[i];
+        if (stream->id == 0)
+            continue;
+        streams[n].id = stream->id;
+        streams[n].x = stream->x;
+        streams[n].y = stream->y;
+        streams[n].width = stream->w;
+        streams[n].height = stream->h;
+        streams[n].sequence = stream->sequence;
+        streams[n].timestamp = stream->timestamp;
+        n++;
+    }
+    g_mutex_unlock(&glue_stream_lock);
+    return n;
+}
+
+int32_t spice_display_get_stream_frame(int32_t id, uint32_t *pixels, int32_t maxPixels,
+                                       SpiceGlibGlueStreamInfo *info)
+{
+    int32_t i, result = -1;
+
+    g_mutex_lock(&glue_stream_lock);
+    for (i = 0; i < GLUE_MAX_STREAMS; i++) {
+        GlueStream *stream = &glue_streams[i];
+        if (stream->id != id || id == 0)
+            continue;
+        if (stream->w * stream->h <= maxPixels) {
+            memcpy(pixels, stream->pixels,
+                   (gsize)stream->w * stream->h * glue_pixel_format_bpp(stream->format));
+            info->id = stream->id;
+            info->x = stream->x;
+            info->y = stream->y;
+            info->width = stream->w;
+            info->height = stream->h;
+            info->sequence = stream->sequence;
+            info->timestamp = stream->timestamp;
+            stream->lastRead = g_get_monotonic_time();
+            result = 0;
+        }
+        break;
+    }
+    g_mutex_unlock(&glue_stream_lock);
+    return result;
+}
+
 /* Called when we receive a new display image.
  * Sets invalidated = TRUE, and updates the values of invalidate_x/y/w/h that
  * store the coordinates of the area to copy_display_to_glue().
@@ -1033,9 +1547,20 @@ gboolean copy_display_to_glue()
 static void invalidate(SpiceChannel *channel,
                        gint x, gint y, gint w, gint h, gpointer data)
 {
-    if (global_display() == NULL) return;
+    /* Displays of pooled, inactive, connections are not copied */
+    if (global_display() == NULL || data != global_display()) return;
     SpiceDisplayPrivate *d = SPICE_DISPLAY_GET_PRIVATE(global_display());
 
+    glue_profiler_mark(GLUE_PHASE_FIRST_INVALIDATE);
+    glue_quality_frame(w, h);
+    if (stream_detection && stream_invalidate(d, x, y, w, h))
+        return;
+
+    add_damage(d, x, y, w, h);
+}
+
+static void add_damage(SpiceDisplayPrivate *d, gint x, gint y, gint w, gint h)
+{
     if (d->invalidated == TRUE) {
         gint invalidate_x0 = d->invalidate_x;
         gint invalidate_y0 = d->invalidate_y;
@@ -1093,6 +1618,8 @@ static void mark(SpiceDisplay *display, gint mark)
 
     SPICE_DEBUG("widget mark: %d, %d:%d %p", mark, d->channel_id, d->monitor_id, display);
     d->mark = mark;
+    if (mark)
+        glue_profiler_mark(GLUE_PHASE_FIRST_MARK);
     update_ready(display);
 }
 
@@ -1617,9 +2144,28 @@ static void sync_keyboard_lock_modifiers(SpiceDisplay *display)
 
 void spice_display_set_display_buffer(uint32_t *display_buffer, int32_t width, int32_t height)
 {
+    spice_display_set_display_buffer_ex(display_buffer, width, height, width * sizeof(uint32_t),
+                                        GLUE_PIXEL_FORMAT_RGBA, DEFAULT_ORIENTATION);
+}
+
+int16_t spice_display_set_display_buffer_ex(void *display_buffer, int32_t width, int32_t height,
+                                            int32_t stride, int32_t format, int32_t orientation)
+{
+    if (format < 0 || format >= GLUE_PIXEL_FORMAT_COUNT ||
+        (display_buffer != NULL && stride < width * copy_kernels[format].bytesPerPixel)) {
+        g_warning("Invalid display buffer format %d or stride %d for width %d",
+                  format, stride, width);
+        return -1;
+    }
+
     glue_buffer.buffer = display_buffer;
     glue_buffer.width = width;
     glue_buffer.height = height;
+    glue_buffer.stride = stride;
+    glue_buffer.format = format;
+    glue_buffer.orientation = orientation == GLUE_ORIENTATION_BOTTOM_UP ?
+        GLUE_ORIENTATION_BOTTOM_UP : GLUE_ORIENTATION_TOP_DOWN;
+    tiles.reset = TRUE;
 
     if (global_display() != NULL) {
         SpiceDisplayPrivate *d = SPICE_DISPLAY_GET_PRIVATE(global_display());
@@ -1628,6 +2174,43 @@ void spice_display_set_display_buffer(uint32_t *display_buffer, int32_t width, i
             d->copy_scheduled = 1;
         }
     }
+    return 0;
+}
+
+#define DEFAULT_BUFFER_ALIGNMENT 64
+
+/* The pointer returned by g_malloc is stored right before the aligned buffer. */
+void *spice_display_alloc_display_buffer(int32_t width, int32_t height, int32_t format,
+                                         int32_t alignment, int32_t *stride)
+{
+    gsize size;
+    guint8 *block, *buffer;
+
+    if (alignment <= 0)
+        alignment = DEFAULT_BUFFER_ALIGNMENT;
+    if ((alignment & (alignment - 1)) != 0 || format < 0 || format >= GLUE_PIXEL_FORMAT_COUNT ||
+        width <= 0 || height <= 0) {
+        g_warning("Invalid display buffer %dx%d, format %d, alignment %d",
+                  width, height, format, alignment);
+        return NULL;
+    }
+
+    *stride = (width * copy_kernels[format].bytesPerPixel + alignment - 1) & ~(alignment - 1);
+    size = (gsize)*stride * height;
+    block = g_try_malloc(size + alignment + sizeof(gpointer));
+    if (block == NULL)
+        return NULL;
+    buffer = (guint8 *)(((guintptr)block + sizeof(gpointer) + alignment - 1) &
+                        ~(guintptr)(alignment - 1));
+    ((gpointer *)buffer)[-1] = block;
+    memset(buffer, 0, size);
+    return buffer;
+}
+
+void spice_display_free_display_buffer(void *buffer)
+{
+    if (buffer != NULL)
+        g_free(((gpointer *)buffer)[-1]);
 }
 
 /**
@@ -1667,6 +2250,7 @@ int16_t spice_display_lock_display_buffer(int32_t *width, int32_t *height)
 
     if (d->updatedDisplayBuffer) {
     	d->updatedDisplayBuffer = FALSE;
+        glue_profiler_mark(GLUE_PHASE_FIRST_LOCK);
     	return 1;
     }
     return 0;
@@ -1707,6 +2291,14 @@ int32_t spice_display_key_event(SpiceDisplay *display, int16_t isDown, int32_t h
         return-1;
 
     scancode = hardware_keycode;
+    if (d->keycode_map != NULL) {
+        if (hardware_keycode < 0 || hardware_keycode >= d->keycode_maplen ||
+            d->keycode_map[hardware_keycode] == 0) {
+            SPICE_DEBUG("Unmapped keycode %d", hardware_keycode);
+            return -1;
+        }
+        scancode = d->keycode_map[hardware_keycode];
+    }
     if (isDown) {
         send_key(display, scancode, 1);
     } else {
@@ -23,6 +23,7 @@
 #include "spice-client.h"
 
 #include <spice-util.h>
+#include "mono-glue-types.h"
 
 
 G_BEGIN_DECLS
@@ -73,11 +74,23 @@ void send_key(SpiceDisplay *display, int scancode, int down);
 gboolean copy_display_to_glue();
 void spice_display_set_display_buffer(uint32_t *display_buffer,
 				   int32_t width, int32_t height);
+int16_t spice_display_set_display_buffer_ex(void *display_buffer, int32_t width, int32_t height,
+                                            int32_t stride, int32_t format, int32_t orientation);
+void *spice_display_alloc_display_buffer(int32_t width, int32_t height, int32_t format,
+                                         int32_t alignment, int32_t *stride);
+void spice_display_free_display_buffer(void *buffer);
 int16_t spice_display_is_display_buffer_updated(SpiceDisplay *display, int32_t width, int32_t height);
 int16_t spice_display_lock_display_buffer(int32_t *width, int32_t *height);
 void spice_display_unlock_display_buffer();
+void spice_display_switch(SpiceDisplay *previous, SpiceDisplay *display);
+void spice_display_enable_tile_hashing(gboolean enable);
+void spice_display_enable_stream_detection(gboolean enable);
+int32_t spice_display_get_streams(SpiceGlibGlueStreamInfo *streams, int32_t maxStreams);
+int32_t spice_display_get_stream_frame(int32_t id, uint32_t *pixels, int32_t maxPixels,
+                                       SpiceGlibGlueStreamInfo *info);
 int16_t spice_display_get_cursor_position(SpiceDisplay *display, int32_t* x, int32_t* y);
 int32_t spice_display_key_event(SpiceDisplay *display, int16_t isDown, int32_t hardware_keycode);
+int32_t spice_display_get_key_modifiers(SpiceDisplay *display);
 
 G_END_DECLS
 
@@ -0,0 +1,179 @@
+/**
+ * Copyright (C) 2016 flexVDI (Flexible Software Solutions S.L.)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "glue-typing-layout.h"
+
+/* Modifiers of a key in a layout table, with its scancode */
+#define SHIFT 0x1000
+#define ALTGR 0x2000
+#define SCANCODE(key) ((key) & 0x1ff)
+#define SCANCODE_SHIFT 0x2a
+#define SCANCODE_ALTGR 0x138
+
+/* A character, typed with one key, or with a dead key and then another one */
+typedef struct {
+    gunichar ch;
+    guint16 keys[2];
+} LayoutKey;
+
+/* Letters and digits are in the same place in all the supported layouts */
+static const guint8 letters[26] = {
+    0x1e, 0x30, 0x2e, 0x20, 0x12, 0x21, 0x22, 0x23, 0x17, 0x24, 0x25, 0x26, 0x32,
+    0x31, 0x18, 0x19, 0x10, 0x13, 0x1f, 0x14, 0x16, 0x2f, 0x11, 0x2d, 0x15, 0x2c,
+};
+
+static const LayoutKey layout_us[] = {
+    { ' ', { 0x39 } }, { '!', { SHIFT | 0x02 } }, { '"', { SHIFT | 0x28 } },
+    { '#', { SHIFT | 0x04 } }, { '$', { SHIFT | 0x05 } }, { '%', { SHIFT | 0x06 } },
+    { '&', { SHIFT | 0x08 } }, { '\'', { 0x28 } }, { '(', { SHIFT | 0x0a } },
+    { ')', { SHIFT | 0x0b } }, { '*', { SHIFT | 0x09 } }, { '+', { SHIFT | 0x0d } },
+    { ',', { 0x33 } }, { '-', { 0x0c } }, { '.', { 0x34 } }, { '/', { 0x35 } },
+    { ':', { SHIFT | 0x27 } }, { ';', { 0x27 } }, { '<', { SHIFT | 0x33 } },
+    { '=', { 0x0d } }, { '>', { SHIFT | 0x34 } }, { '?', { SHIFT | 0x35 } },
+    { '@', { SHIFT | 0x03 } }, { '[', { 0x1a } }, { '\\', { 0x2b } }, { ']', { 0x1b } },
+    { '^', { SHIFT | 0x07 } }, { '_', { SHIFT | 0x0c } }, { '`', { 0x29 } },
+    { '{', { SHIFT | 0x1a } }, { '|', { SHIFT | 0x2b } }, { '}', { SHIFT | 0x1b } },
+    { '~', { SHIFT | 0x29 } },
+    { 0 }
+};
+
+/* Spanish (Spain), where 0x1a and 0x28 are the grave/circumflex and
+ * acute/diaeresis dead keys */
+static const LayoutKey layout_es[] = {
+    { ' ', { 0x39 } }, { '!', { SHIFT | 0x02 } }, { '"', { SHIFT | 0x03 } },
+    { '#', { ALTGR | 0x04 } }, { '$', { SHIFT | 0x05 } }, { '%', { SHIFT | 0x06 } },
+    { '&', { SHIFT | 0x07 } }, { '\'', { 0x0c } }, { '(', { SHIFT | 0x09 } },
+    { ')', { SHIFT | 0x0a } }, { '*', { SHIFT | 0x1b } }, { '+', { 0x1b } },
+    { ',', { 0x33 } }, { '-', { 0x35 } }, { '.', { 0x34 } }, { '/', { SHIFT | 0x08 } },
+    { ':', { SHIFT | 0x34 } }, { ';', { SHIFT | 0x33 } }, { '<', { 0x56 } },
+    { '=', { SHIFT | 0x0b } }, { '>', { SHIFT | 0x56 } }, { '?', { SHIFT | 0x0c } },
+    { '@', { ALTGR | 0x03 } }, { '[', { ALTGR | 0x1a } }, { '\\', { ALTGR | 0x29 } },
+    { ']', { ALTGR | 0x1b } }, { '^', { SHIFT | 0x1a, 0x39 } }, { '_', { SHIFT | 0x35 } },
+    { '`', { 0x1a, 0x39 } }, { '{', { ALTGR | 0x28 } }, { '|', { ALTGR | 0x02 } },
+    { '}', { ALTGR | 0x2b } }, { '~', { ALTGR | 0x05 } },
+    { 0x00a1, { 0x0d } },           /* ¡ */
+    { 0x00bf, { SHIFT | 0x0d } },   /* ¿ */
+    { 0x00ba, { 0x29 } },           /* º */
+    { 0x00aa, { SHIFT | 0x29 } },   /* ª */
+    { 0x00b7, { SHIFT | 0x04 } },   /* · */
+    { 0x00ac, { ALTGR | 0x07 } },   /* ¬ */
+    { 0x20ac, { ALTGR | 0x06 } },   /* € */
+    { 0x00f1, { 0x27 } },           /* ñ */
+    { 0x00d1, { SHIFT | 0x27 } },   /* Ñ */
+    { 0x00e7, { 0x2b } },           /* ç */
+    { 0x00c7, { SHIFT | 0x2b } },   /* Ç */
+    { 0x00b4, { 0x28, 0x39 } },     /* ´ */
+    { 0x00a8, { SHIFT | 0x28, 0x39 } }, /* ¨ */
+    { 0x00e1, { 0x28, 0x1e } }, { 0x00e9, { 0x28, 0x12 } }, { 0x00ed, { 0x28, 0x17 } },
+    { 0x00f3, { 0x28, 0x18 } }, { 0x00fa, { 0x28, 0x16 } },         /* á é í ó ú */
+    { 0x00c1, { 0x28, SHIFT | 0x1e } }, { 0x00c9, { 0x28, SHIFT | 0x12 } },
+    { 0x00cd, { 0x28, SHIFT | 0x17 } }, { 0x00d3, { 0x28, SHIFT | 0x18 } },
+    { 0x00da, { 0x28, SHIFT | 0x16 } },                             /* Á É Í Ó Ú */
+    { 0x00fc, { SHIFT | 0x28, 0x16 } }, { 0x00dc, { SHIFT | 0x28, SHIFT | 0x16 } }, /* ü Ü */
+    { 0x00e0, { 0x1a, 0x1e } }, { 0x00e8, { 0x1a, 0x12 } }, { 0x00ec, { 0x1a, 0x17 } },
+    { 0x00f2, { 0x1a, 0x18 } }, { 0x00f9, { 0x1a, 0x16 } },         /* à è ì ò ù */
+    { 0 }
+};
+
+struct _GlueTypingLayout {
+    const char *name;
+    const LayoutKey *keys;
+};
+
+static const GlueTypingLayout layouts[] = {
+    { "us", layout_us },
+    { "es", layout_es },
+};
+
+static void add_event(GArray *events, guint16 scancode, gboolean down, gboolean last)
+{
+    GlueTypingEvent event = { scancode, down, last };
+    g_array_append_val(events, event);
+}
+
+static void add_key(GArray *events, guint16 key, gboolean last)
+{
+    if (key & SHIFT)
+        add_event(events, SCANCODE_SHIFT, TRUE, FALSE);
+    if (key & ALTGR)
+        add_event(events, SCANCODE_ALTGR, TRUE, FALSE);
+    add_event(events, SCANCODE(key), TRUE, FALSE);
+    add_event(events, SCANCODE(key), FALSE, !(key & (SHIFT | ALTGR)) && last);
+    if (key & ALTGR)
+        add_event(events, SCANCODE_ALTGR, FALSE, !(key & SHIFT) && last);
+    if (key & SHIFT)
+        add_event(events, SCANCODE_SHIFT, FALSE, last);
+}
+
+/* Returns the keys that type ch, in keys[2], or FALSE */
+static gboolean lookup_char(const LayoutKey *layout, gunichar ch, guint16 keys[2])
+{
+    keys[1] = 0;
+    if (ch >= 'a' && ch <= 'z') {
+        keys[0] = letters[ch - 'a'];
+    } else if (ch >= 'A' && ch <= 'Z') {
+        keys[0] = SHIFT | letters[ch - 'A'];
+    } else if (ch >= '1' && ch <= '9') {
+        keys[0] = 0x02 + ch - '1';
+    } else if (ch == '0') {
+        keys[0] = 0x0b;
+    } else if (ch == '\n') {
+        keys[0] = 0x1c;
+    } else if (ch == '\t') {
+        keys[0] = 0x0f;
+    } else {
+        for (; layout->ch != 0; layout++) {
+            if (layout->ch == ch) {
+                keys[0] = layout->keys[0];
+                keys[1] = layout->keys[1];
+                return TRUE;
+            }
+        }
+        return FALSE;
+    }
+    return TRUE;
+}
+
+const GlueTypingLayout *glue_typing_layout_get(const char *name)
+{
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS(layouts); i++) {
+        if (name != NULL && strcmp(name, layouts[i].name) == 0)
+            return &layouts[i];
+    }
+    return NULL;
+}
+
+gboolean glue_typing_layout_add_char(const GlueTypingLayout *layout, gunichar ch,
+                                     GArray *events)
+{
+    guint16 keys[2];
+
+    if (!lookup_char(layout->keys, ch, keys))
+        return FALSE;
+    add_key(events, keys[0], keys[1] == 0);
+    if (keys[1] != 0)
+        add_key(events, keys[1], TRUE);
+    return TRUE;
+}
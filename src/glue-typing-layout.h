@@ -0,0 +1,47 @@
+/**
+ * Copyright (C) 2016 flexVDI (Flexible Software Solutions S.L.)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Keyboard layouts of the guest, for typing text: the scancodes that type each
+ * character, with the shift and AltGr modifiers, or with a dead key first.
+ */
+
+#ifndef _GLUE_TYPING_LAYOUT_H
+#define _GLUE_TYPING_LAYOUT_H
+
+#include <glib.h>
+
+/* A key press or release */
+typedef struct {
+    guint16 scancode;
+    guint8 down;
+    guint8 last;    /* Last event of a character */
+} GlueTypingEvent;
+
+typedef struct _GlueTypingLayout GlueTypingLayout;
+
+/* Layout by name, "us" or "es", or NULL if it does not exist */
+const GlueTypingLayout *glue_typing_layout_get(const char *name);
+
+/* Appends to events, a GArray of GlueTypingEvents, the keystrokes that type
+ * ch. Modifiers are pressed before their key and released after it, shift
+ * last, and the last release of the character is marked. Returns FALSE, and
+ * adds nothing, if the layout cannot type ch. */
+gboolean glue_typing_layout_add_char(const GlueTypingLayout *layout, gunichar ch,
+                                     GArray *events);
+
+#endif /* _GLUE_TYPING_LAYOUT_H */
@@ -0,0 +1,138 @@
+/**
+ * Copyright (C) 2016 flexVDI (Flexible Software Solutions S.L.)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <spice-client.h>
+
+#include "glue-typing.h"
+#include "glue-typing-layout.h"
+#include "glue-service.h"
+#include "glue-spice-widget.h"
+
+#define DEFAULT_DELAY_MS 10
+
+static struct {
+    GMutex mutex;
+    GArray *events;         /* Pending GlueTypingEvents, protected by the mutex */
+    guint next;             /* First pending event */
+    gint delayMs;
+    guint timer;            /* Only accessed in the glib mainloop */
+} typing = {
+    .delayMs = DEFAULT_DELAY_MS,
+};
+
+/* Sends the events of one character, or all of them without delay.
+ * Returns whether there are more. */
+static gboolean send_events(void)
+{
+    SpiceDisplay *display = global_display();
+    GArray *tick = g_array_new(FALSE, FALSE, sizeof(GlueTypingEvent));
+    gboolean more;
+    guint i;
+
+    g_mutex_lock(&typing.mutex);
+    while (typing.next < typing.events->len) {
+        GlueTypingEvent *event = &g_array_index(typing.events, GlueTypingEvent, typing.next++);
+        g_array_append_val(tick, *event);
+        if (event->last && typing.delayMs > 0)
+            break;
+    }
+    more = typing.next < typing.events->len;
+    if (!more) {
+        g_array_set_size(typing.events, 0);
+        typing.next = 0;
+    }
+    g_mutex_unlock(&typing.mutex);
+
+    /* Sent unlocked, so that TypeText and CancelTyping do not wait for them */
+    for (i = 0; display != NULL && i < tick->len; i++) {
+        GlueTypingEvent *event = &g_array_index(tick, GlueTypingEvent, i);
+        send_key(display, event->scancode, event->down);
+    }
+    g_array_free(tick, TRUE);
+    return more;
+}
+
+/* GSourceFunc */
+static gboolean type_tick(gpointer data)
+{
+    if (send_events())
+        return TRUE;
+    typing.timer = 0;
+    return FALSE;
+}
+
+static gboolean start_typing(gpointer data)
+{
+    if (typing.timer == 0 && send_events())
+        typing.timer = g_timeout_add(typing.delayMs, type_tick, NULL);
+    return FALSE;
+}
+
+int32_t SpiceGlibGlue_TypeText(const char *utf8, const char *layout)
+{
+    const GlueTypingLayout *keys = glue_typing_layout_get(layout);
+    const char *p;
+    int32_t skipped = 0;
+
+    if (keys == NULL) {
+        g_warning("Unknown keyboard layout %s", layout ? layout : "(null)");
+        return -1;
+    }
+    if (global_display() == NULL || utf8 == NULL || !g_utf8_validate(utf8, -1, NULL))
+        return -1;
+
+    g_mutex_lock(&typing.mutex);
+    if (typing.events == NULL)
+        typing.events = g_array_new(FALSE, FALSE, sizeof(GlueTypingEvent));
+    for (p = utf8; *p != '\0'; p = g_utf8_next_char(p)) {
+        gunichar ch = g_utf8_get_char(p);
+        if (ch == '\r')
+            continue;
+        if (!glue_typing_layout_add_char(keys, ch, typing.events)) {
+            SPICE_DEBUG("Character U+%04X cannot be typed with layout %s", ch, layout);
+            skipped++;
+        }
+    }
+    g_mutex_unlock(&typing.mutex);
+
+    g_timeout_add_full(G_PRIORITY_HIGH, 0, start_typing, NULL, NULL);
+    return skipped;
+}
+
+void SpiceGlibGlue_SetTypingDelay(int32_t delayMs)
+{
+    if (delayMs < 0) {
+        g_warning("Invalid typing delay %d", delayMs);
+        return;
+    }
+    typing.delayMs = delayMs;
+}
+
+void SpiceGlibGlue_CancelTyping(void)
+{
+    g_mutex_lock(&typing.mutex);
+    /* Characters are sent whole, so no key is left pressed */
+    if (typing.events != NULL) {
+        g_array_set_size(typing.events, 0);
+        typing.next = 0;
+    }
+    g_mutex_unlock(&typing.mutex);
+}
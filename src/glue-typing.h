@@ -0,0 +1,43 @@
+/**
+ * Copyright (C) 2016 flexVDI (Flexible Software Solutions S.L.)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Text typed into the guest as keystrokes. The text is converted to scancodes
+ * with the tables of the keyboard layout configured in the guest, and the
+ * keystrokes are sent from the glib mainloop, one character per tick of a
+ * timer, or all at once without delay.
+ */
+
+#ifndef _GLUE_TYPING_H
+#define _GLUE_TYPING_H
+
+#include <stdint.h>
+
+/* Types utf-8 text in the guest, for a layout ("us" or "es"). It may be
+ * called from any thread, and the text is queued after any previous one.
+ * Returns the number of characters that the layout cannot type, which are
+ * skipped, or -1 if the layout does not exist or there is no display. */
+int32_t SpiceGlibGlue_TypeText(const char *utf8, const char *layout);
+
+/* Delay between two typed characters, in ms (10 by default). With 0, the
+ * whole text is sent in a single batch. */
+void SpiceGlibGlue_SetTypingDelay(int32_t delayMs);
+
+/* Discards the text that has not been typed yet. */
+void SpiceGlibGlue_CancelTyping(void);
+
+#endif /* _GLUE_TYPING_H */
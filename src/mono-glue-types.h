@@ -34,4 +34,36 @@ typedef struct {
     uint32_t *rgba;
 } MonoGlueCursor;
 
+/* Pixel formats of the display buffer. RGBA and BGRA are byte orders in
+ * memory, with alpha set to 0xFF; XRGB is the 32-bit 0xXXRRGGBB word the
+ * guest sends, with the X byte undefined. */
+#define GLUE_PIXEL_FORMAT_RGBA   0
+#define GLUE_PIXEL_FORMAT_BGRA   1
+#define GLUE_PIXEL_FORMAT_XRGB   2
+#define GLUE_PIXEL_FORMAT_RGB565 3  /* 16 bits per pixel, native endianness */
+#define GLUE_PIXEL_FORMAT_COUNT  4
+
+#define GLUE_ORIENTATION_TOP_DOWN  0
+#define GLUE_ORIENTATION_BOTTOM_UP 1
+
+/* Modifier keys pressed, as sent to the guest */
+#define GLUE_KEY_MOD_LSHIFT (1 << 0)
+#define GLUE_KEY_MOD_RSHIFT (1 << 1)
+#define GLUE_KEY_MOD_LCTRL  (1 << 2)
+#define GLUE_KEY_MOD_RCTRL  (1 << 3)
+#define GLUE_KEY_MOD_LALT   (1 << 4)
+#define GLUE_KEY_MOD_RALT   (1 << 5)
+#define GLUE_KEY_MOD_LMETA  (1 << 6)
+#define GLUE_KEY_MOD_RMETA  (1 << 7)
+
+typedef struct {
+    int32_t id;
+    int32_t x;
+    int32_t y;
+    int32_t width;
+    int32_t height;
+    uint32_t sequence;  /* Incremented with each frame */
+    int64_t timestamp;  /* Arrival of the last frame, g_get_monotonic_time() */
+} SpiceGlibGlueStreamInfo;
+
 #endif /* MONO_GLUE_TYPES_H_ */
@@ -0,0 +1,121 @@
+/**
+ * Copyright (C) 2016 flexVDI (Flexible Software Solutions S.L.)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "usb-device-list.h"
+#ifdef USBREDIR
+
+typedef struct
+{
+    UsbDeviceInfo info;
+    guint index;            // Position in UsbDeviceList.entries
+} UsbDeviceEntry;
+
+/*
+ * Removed entries leave a NULL hole in the array, so that removing does not
+ * move the rest of the devices. The holes are squeezed out when they become
+ * the majority, which keeps removals O(1) amortized and the insertion order.
+ */
+struct _UsbDeviceList {
+    GHashTable *byDevice;   // SpiceUsbDevice* -> UsbDeviceEntry*, owns the entries
+    GPtrArray *entries;     // The same UsbDeviceEntry*, in insertion order, or NULL
+    guint numHoles;
+};
+
+UsbDeviceList *usb_device_list_new(void)
+{
+    UsbDeviceList *list = g_new0(UsbDeviceList, 1);
+    list->byDevice = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+    list->entries = g_ptr_array_new();
+    return list;
+}
+
+void usb_device_list_free(UsbDeviceList *list)
+{
+    if (list) {
+        g_ptr_array_free(list->entries, TRUE);
+        g_hash_table_destroy(list->byDevice);
+        g_free(list);
+    }
+}
+
+guint usb_device_list_get_length(UsbDeviceList *list)
+{
+    return list->entries->len - list->numHoles;
+}
+
+UsbDeviceInfo *usb_device_list_lookup(UsbDeviceList *list, SpiceUsbDevice *device)
+{
+    UsbDeviceEntry *entry = g_hash_table_lookup(list->byDevice, device);
+    return entry ? &entry->info : NULL;
+}
+
+UsbDeviceInfo *usb_device_list_add(UsbDeviceList *list, const UsbDeviceInfo *info)
+{
+    UsbDeviceEntry *entry;
+
+    if (g_hash_table_contains(list->byDevice, info->device))
+        return NULL;
+    entry = g_new(UsbDeviceEntry, 1);
+    entry->info = *info;
+    entry->index = list->entries->len;
+    g_ptr_array_add(list->entries, entry);
+    g_hash_table_insert(list->byDevice, info->device, entry);
+    return &entry->info;
+}
+
+static void squeeze(UsbDeviceList *list)
+{
+    guint i, j;
+
+    for (i = j = 0; i < list->entries->len; i++) {
+        UsbDeviceEntry *entry = g_ptr_array_index(list->entries, i);
+        if (entry) {
+            entry->index = j;
+            list->entries->pdata[j++] = entry;
+        }
+    }
+    g_ptr_array_set_size(list->entries, j);
+    list->numHoles = 0;
+}
+
+gboolean usb_device_list_remove(UsbDeviceList *list, SpiceUsbDevice *device)
+{
+    UsbDeviceEntry *entry = g_hash_table_lookup(list->byDevice, device);
+
+    if (!entry)
+        return FALSE;
+    list->entries->pdata[entry->index] = NULL;
+    ++list->numHoles;
+    // Frees entry
+    g_hash_table_remove(list->byDevice, device);
+    if (list->numHoles * 2 > list->entries->len)
+        squeeze(list);
+    return TRUE;
+}
+
+void usb_device_list_foreach(UsbDeviceList *list, GFunc func, gpointer user_data)
+{
+    guint i;
+
+    for (i = 0; i < list->entries->len; i++) {
+        UsbDeviceEntry *entry = g_ptr_array_index(list->entries, i);
+        if (entry)
+            func(&entry->info, user_data);
+    }
+}
+
+#endif
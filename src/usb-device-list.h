@@ -0,0 +1,53 @@
+/**
+ * Copyright (C) 2016 flexVDI (Flexible Software Solutions S.L.)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The USB devices known to a SpiceUsbDeviceWidget, in the order they were
+ * plugged. Lookups, additions and removals are O(1) (amortized), so that a
+ * burst of hot-plug events does not hold the device list lock for long.
+ * Not thread safe, the widget serializes the calls with its own lock.
+ */
+
+#ifdef USBREDIR
+#ifndef _USB_DEVICE_LIST_H
+#define _USB_DEVICE_LIST_H
+
+#include "usb-device-widget.h"
+
+typedef struct _UsbDeviceList UsbDeviceList;
+
+UsbDeviceList *usb_device_list_new(void);
+void usb_device_list_free(UsbDeviceList *list);
+
+/* Number of listed devices */
+guint usb_device_list_get_length(UsbDeviceList *list);
+
+/* The info of device, owned by the list, or NULL if it is not listed */
+UsbDeviceInfo *usb_device_list_lookup(UsbDeviceList *list, SpiceUsbDevice *device);
+
+/* Appends a copy of info. Returns the copy, or NULL if info->device is
+ * already listed. */
+UsbDeviceInfo *usb_device_list_add(UsbDeviceList *list, const UsbDeviceInfo *info);
+
+/* Removes and frees the info of device. Returns FALSE if it was not listed. */
+gboolean usb_device_list_remove(UsbDeviceList *list, SpiceUsbDevice *device);
+
+/* Calls func(info, user_data) for every device, in insertion order */
+void usb_device_list_foreach(UsbDeviceList *list, GFunc func, gpointer user_data);
+
+#endif /* _USB_DEVICE_LIST_H */
+#endif
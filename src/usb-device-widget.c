@@ -23,6 +23,8 @@
 #include <glib/gi18n.h>
 #include "spice-client.h"
 #include "usb-device-widget.h"
+#include "usb-policy.h"
+#include "usb-device-list.h"
 #include <spice-gtk/spice-util-priv.h>
 
 /**
@@ -71,7 +73,7 @@ struct _SpiceUsbDeviceWidgetPrivate {
     SpiceUsbDeviceManager *manager;
 
     /* Data accessed/modified by different threads (spice-glib / gui). */
-    GSList *deviceList; // Contains UsbDeviceInfo*
+    UsbDeviceList *deviceList;
     gchar *err_msg;
 
     gboolean isDeviceListChanged;
@@ -80,6 +82,8 @@ struct _SpiceUsbDeviceWidgetPrivate {
     GMutex deviceList_lock;
     GMutex err_msg_lock;
 
+    /* Auto-redirect policy. Owned by usb-glue, only used from the main loop. */
+    UsbPolicy *policy;
 };
 
 G_DEFINE_TYPE(SpiceUsbDeviceWidget, spice_usb_device_widget, G_TYPE_OBJECT);
@@ -151,6 +155,8 @@ static GObject *spice_usb_device_widget_constructor(
     priv->device_full_format_string =  _("%s %s %s %d-%d"); // For logging
 
 
+    priv->deviceList = usb_device_list_new();
+
     priv->manager = spice_usb_device_manager_get(priv->session, &err);
 
     if (err) {
@@ -170,7 +176,6 @@ static GObject *spice_usb_device_widget_constructor(
     g_signal_connect(priv->manager, "device-error",
                      G_CALLBACK(device_error_cb), self);
 
-    priv->deviceList = NULL;
     priv->isDeviceListChanged = TRUE;
     devices = spice_usb_device_manager_get_devices(priv->manager);
     if (!devices)
@@ -196,8 +201,7 @@ static void spice_usb_device_widget_finalize(GObject *object)
     SpiceUsbDeviceWidgetPrivate *priv = self->priv;
     
     g_mutex_lock(&priv->deviceList_lock);
-    if (priv->deviceList) 
-        g_slist_free(priv->deviceList);
+    usb_device_list_free(priv->deviceList);
     g_mutex_unlock(&priv->deviceList_lock);
     g_mutex_clear(&priv->deviceList_lock);
     
@@ -366,6 +370,11 @@ void spice_usb_device_widget_get_error_msg(SpiceUsbDeviceWidget* self,
  * - there are >0 devices
  * And updates the error message and Device List (disabling devices) accordingly.
  */
+static void update_device_status(gpointer d, gpointer user_data)
+{
+    check_can_redirect((SpiceUsbDeviceWidget *)user_data, (UsbDeviceInfo *)d);
+}
+
 static void spice_usb_device_widget_update_status(gpointer user_data)
 {
 
@@ -373,11 +382,7 @@ static void spice_usb_device_widget_update_status(gpointer user_data)
     SpiceUsbDeviceWidgetPrivate *priv = self->priv;
 
     g_mutex_lock(&priv->deviceList_lock);
-    GSList *iterator = NULL;
-    for (iterator = priv->deviceList; iterator; iterator = iterator->next) {
-        UsbDeviceInfo *d = iterator->data;
-        check_can_redirect(self, d);
-    }
+    usb_device_list_foreach(priv->deviceList, update_device_status, self);
     g_mutex_unlock(&priv->deviceList_lock);
 }
 
@@ -388,17 +393,14 @@ static void flagStatusPerDevice (SpiceUsbDeviceWidget* self,
 
     SpiceUsbDeviceWidgetPrivate *priv = self->priv;
     g_mutex_lock(&priv->deviceList_lock);
-    GSList *iterator = NULL;
-    for (iterator = priv->deviceList; iterator; iterator = iterator->next) {
-        UsbDeviceInfo* info = (UsbDeviceInfo*)iterator->data;
-        if (info->device == device) {
-            if (isShared != AS_IS)
-                info->isShared= isShared;
-            if (isOpPending != AS_IS)
-                info->isOpPending = isOpPending;
-            SPICE_DEBUG("USB: device %s, id %s is set as shared %d", 
-                info->name, info->id, info->isShared);
-        }
+    UsbDeviceInfo* info = usb_device_list_lookup(priv->deviceList, device);
+    if (info) {
+        if (isShared != AS_IS)
+            info->isShared= isShared;
+        if (isOpPending != AS_IS)
+            info->isOpPending = isOpPending;
+        SPICE_DEBUG("USB: device %s, id %s is set as shared %d", 
+            info->name, info->id, info->isShared);
     }
     priv->isDeviceListChanged = TRUE;
     g_mutex_unlock(&priv->deviceList_lock);
@@ -407,6 +409,7 @@ static void flagStatusPerDevice (SpiceUsbDeviceWidget* self,
 typedef struct _ {
     SpiceUsbDevice *device; // The device that was asked to be shared / unshared
     SpiceUsbDeviceWidget *self;
+    gint64 startTime;       // When the share was requested, to log redirection time
 } connect_cb_data;
 
 /* Called when the usb redirection completes */
@@ -427,10 +430,7 @@ static void connect_cb(GObject *gobject, GAsyncResult *res, gpointer user_data)
                                                 priv->device_full_format_string);
 
     if (err) {
-        desc = spice_usb_device_get_description(device,
-                                                priv->device_full_format_string);
         g_prefix_error(&err, "Could not redirect %s: ", desc);
-        g_free(desc);
 
         addErrorMessage(self, err->message);
         //g_signal_emit(self, signals[CONNECT_FAILED], 0, device, err);
@@ -439,8 +439,11 @@ static void connect_cb(GObject *gobject, GAsyncResult *res, gpointer user_data)
         spice_usb_device_widget_update_status(self);
         flagStatusPerDevice(self, device, AS_IS, FALSE);
     } else {
+        SPICE_DEBUG("USB: %s redirected in %.1f ms", desc,
+                    (g_get_monotonic_time() - data->startTime) / 1000.0);
         flagStatusPerDevice(self, device, TRUE, FALSE);
     }   
+    g_free(desc);
     
     priv->isDeviceListChanged = TRUE;
     g_object_unref(data->self);
@@ -457,6 +460,7 @@ void spice_usb_device_widget_share(SpiceUsbDeviceWidget* self,
     connect_cb_data *data = g_new(connect_cb_data, 1);
     data->device = device;
     data->self  = g_object_ref(self);
+    data->startTime = g_get_monotonic_time();
 
     spice_usb_device_manager_connect_device_async(priv->manager,
                                                   device,
@@ -467,17 +471,12 @@ void spice_usb_device_widget_share(SpiceUsbDeviceWidget* self,
     /* Flag the deviceInfo as isOpPending for activity.
      * If we try to disconnect it before it finishes the connection, the program can
      * hang/crash/leave the usb blinking forever... */
-    GSList *iterator;
-    
     g_mutex_lock(&priv->deviceList_lock);
 
-    for (iterator = priv->deviceList; iterator; iterator = iterator->next) {
-        UsbDeviceInfo* info = (UsbDeviceInfo*)iterator->data;
-        SPICE_DEBUG("Pending: Comparing to %s: %s", info->name, info->id);
-        if (info->device == device) {
-            info->isOpPending = TRUE;
-            SPICE_DEBUG("Pending: flagging as pending %s: %s", info->name, info->id);
-        }
+    UsbDeviceInfo* info = usb_device_list_lookup(priv->deviceList, device);
+    if (info) {
+        info->isOpPending = TRUE;
+        SPICE_DEBUG("Pending: flagging as pending %s: %s", info->name, info->id);
     }
     priv->isDeviceListChanged = TRUE;
     g_mutex_unlock(&priv->deviceList_lock);
@@ -510,6 +509,7 @@ void spice_usb_device_widget_unshare(SpiceUsbDeviceWidget* self,
     connect_cb_data *data = g_new(connect_cb_data, 1);
     data->self  = g_object_ref(self);
     data->device  = device;
+    data->startTime = g_get_monotonic_time();
     g_timeout_add_full(G_PRIORITY_HIGH, 0,
                        spice_usb_device_widget_unshare1,
                        data, NULL);
@@ -523,6 +523,23 @@ gboolean spice_usb_device_widget_is_changed(SpiceUsbDeviceWidget* self) {
     return priv->isDeviceListChanged;
 }
 
+static void copy_device(gpointer data, gpointer user_data)
+{
+    UsbDeviceInfo *d = (UsbDeviceInfo *)data;
+    GSList **listCopy = (GSList **)user_data;
+    UsbDeviceInfo *devCopy = g_new (UsbDeviceInfo, 1);
+
+    strncpy(devCopy->name, d->name, MAX_USB_DEVICE_NAME_SIZE);
+    strncpy(devCopy->id, d->id, MAX_USB_DEVICE_ID_SIZE);
+    devCopy->isShared = d->isShared;
+    devCopy->device = d->device;
+    devCopy->isEnabled = d->isEnabled;
+    devCopy->isOpPending = d->isOpPending;
+    SPICE_DEBUG("Returning copy of USB Device; id: %s, *dev %p, shared= %d, enabled: %d, desc: %s", 
+        devCopy->id, devCopy->device, devCopy->isShared, devCopy->isEnabled, devCopy->name);
+    *listCopy = g_slist_prepend(*listCopy, devCopy);
+}
+
 /* Creates a new copy of the list of usb devices, and returns it to the caller
 */
 GSList *spice_usb_device_widget_get_devices(SpiceUsbDeviceWidget* self) {
@@ -532,30 +549,54 @@ GSList *spice_usb_device_widget_get_devices(SpiceUsbDeviceWidget* self) {
     SpiceUsbDeviceWidgetPrivate *priv = self->priv; 
     
     GSList *listCopy = NULL;
-    GSList *iterator = NULL;
     
     g_mutex_lock(&priv->deviceList_lock);
-    for (iterator = priv->deviceList; iterator; iterator = iterator->next) {
-        UsbDeviceInfo *d = iterator->data;
-        UsbDeviceInfo *devCopy = g_new (UsbDeviceInfo, 1);
-        strncpy(devCopy->name, d->name, MAX_USB_DEVICE_NAME_SIZE);
-        strncpy(devCopy->id, d->id, MAX_USB_DEVICE_ID_SIZE);
-        devCopy->isShared = d->isShared;
-        devCopy->device = d->device;
-        devCopy->isEnabled = d->isEnabled;
-        devCopy->isOpPending = d->isOpPending;
-        SPICE_DEBUG("Returning copy of USB Device; id: %s, *dev %p, shared= %d, enabled: %d, desc: %s", 
-            devCopy->id, devCopy->device, devCopy->isShared, devCopy->isEnabled, devCopy->name);
-        listCopy = g_slist_append(listCopy, devCopy);
-    }
-    
+    usb_device_list_foreach(priv->deviceList, copy_device, &listCopy);
     priv->isDeviceListChanged = FALSE;
     g_mutex_unlock(&priv->deviceList_lock);
     
-    return listCopy;
+    // Prepending and reversing keeps the insertion order in O(n)
+    return g_slist_reverse(listCopy);
+}
+
+/* Evaluates the auto-redirect policy for a hot-plugged device.
+ * Returns TRUE if the device must be redirected right away.
+ */
+static gboolean check_auto_redirect(SpiceUsbDeviceWidget *self, UsbDeviceInfo *deviceInfo)
+{
+    SpiceUsbDeviceWidgetPrivate *priv = self->priv;
+    UsbPolicyDevice policyDevice;
+    UsbPolicyDecision decision;
+    gint64 start;
+
+    if (priv->policy == NULL || deviceInfo->isShared)
+        return FALSE;
+
+    start = g_get_monotonic_time();
+    if (!usb_policy_device_from_spice(deviceInfo->device, &policyDevice)) {
+        SPICE_DEBUG("USB: auto-redirect: cannot read descriptors of %s", deviceInfo->name);
+        return FALSE;
+    }
+    decision = usb_policy_evaluate(priv->policy, &policyDevice);
+
+    SPICE_DEBUG("USB: auto-redirect: %s (%04x:%04x class %02x) %s, evaluated in %" G_GINT64_FORMAT " us",
+                deviceInfo->name, policyDevice.vendor, policyDevice.product,
+                policyDevice.deviceClass,
+                decision == USB_POLICY_ALLOW ? "allowed" :
+                decision == USB_POLICY_DENY ? "denied" : "not matched",
+                g_get_monotonic_time() - start);
+
+    return decision == USB_POLICY_ALLOW;
+}
+
+void spice_usb_device_widget_set_auto_redirect_policy(SpiceUsbDeviceWidget* self,
+        UsbPolicy *policy) {
+
+    self->priv->policy = policy;
 }
 
 /* Called when a new usb is connected, and initially for all the devices connected
+ * (with manager == NULL in that case).
  */
 static void device_added_cb(SpiceUsbDeviceManager *manager,
     SpiceUsbDevice *device, gpointer user_data)
@@ -595,9 +636,22 @@ static void device_added_cb(SpiceUsbDeviceManager *manager,
     SPICE_DEBUG("New USB Device; id: %s, *dev %p, shared= %d, enabled: %d, desc: %s", 
         deviceInfo->id, device, deviceInfo->isShared, deviceInfo->isEnabled, deviceInfo->name);
     g_mutex_lock(&priv->deviceList_lock);
-    priv->deviceList = g_slist_append(priv->deviceList, deviceInfo);
+    if (!usb_device_list_add(priv->deviceList, deviceInfo)) {
+        SPICE_DEBUG("USB: device %p already listed, ignoring", device);
+        g_mutex_unlock(&priv->deviceList_lock);
+        g_free(deviceInfo);
+        return;
+    }
     priv->isDeviceListChanged = TRUE;
     g_mutex_unlock(&priv->deviceList_lock);
+
+    /* Only hot-plugged devices are redirected automatically. Devices present at
+     * startup are left for the user, as the usbredir channels may not be up yet.
+     * deviceInfo is our own copy, the listed one may be gone by now. */
+    if (manager != NULL && check_auto_redirect(self, deviceInfo)) {
+        spice_usb_device_widget_share(self, device);
+    }
+    g_free(deviceInfo);
 }
 
 
@@ -609,18 +663,14 @@ static void device_added_cb(SpiceUsbDeviceManager *manager,
     g_debug(" %s:%d:%s()", __FILE__, __LINE__, __func__);
     SpiceUsbDeviceWidget *self = SPICE_USB_DEVICE_WIDGET(user_data);
     SpiceUsbDeviceWidgetPrivate *priv = self->priv;
-    GSList *iterator;
     
     g_mutex_lock(&priv->deviceList_lock);
 
-    for (iterator = priv->deviceList; iterator; iterator = iterator->next) {
-        UsbDeviceInfo* info = (UsbDeviceInfo*)iterator->data;
-        SPICE_DEBUG("REMOVE: Comparing to %s: %s", info->name, info->id);
-        if (info->device == device) {
-            priv->deviceList = g_slist_remove(priv->deviceList, info);
-            SPICE_DEBUG("REMOVE: gonna free %s: %s", info->name, info->id);
-            g_free(info);
-        }
+    UsbDeviceInfo* info = usb_device_list_lookup(priv->deviceList, device);
+    if (info) {
+        SPICE_DEBUG("REMOVE: gonna free %s: %s", info->name, info->id);
+        // Frees info, in O(1)
+        usb_device_list_remove(priv->deviceList, device);
     }
     priv->isDeviceListChanged = TRUE;
     g_mutex_unlock(&priv->deviceList_lock);
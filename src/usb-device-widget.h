@@ -22,6 +22,7 @@
 #define __SPICE_USB_DEVICE_WIDGET_H__
 
 #include "spice-client.h"
+#include "usb-policy.h"
 
 G_BEGIN_DECLS
 
@@ -121,6 +122,13 @@ void spice_usb_device_widget_get_error_msg(SpiceUsbDeviceWidget* self,
  */
 gboolean spice_usb_device_widget_is_msg_changed(SpiceUsbDeviceWidget* self);
 
+/* Sets the policy used to redirect hot-plugged devices automatically.
+ * NULL disables auto-redirection. The policy is not owned by the widget.
+ * Must be called from the main loop.
+ */
+void spice_usb_device_widget_set_auto_redirect_policy(SpiceUsbDeviceWidget* self,
+        UsbPolicy *policy);
+
 G_END_DECLS
 
 #endif /* __SPICE_USB_DEVICE_WIDGET_H__ */
@@ -22,6 +22,8 @@
 #include "glib.h"
 #include "usb-glue.h"
 #include "usb-device-widget.h"
+#include "usb-policy.h"
+#include "glue-profiler.h"
 #ifdef USBREDIR
 
 #ifdef G_OS_WIN32
@@ -35,6 +37,9 @@ HWND hwnd = NULL;
 
 SpiceUsbDeviceWidget *usbWidget = NULL;
 
+/* Compiled auto-redirect rules. Only accessed from the glib mainloop thread. */
+static UsbPolicy *autoRedirectPolicy = NULL;
+
 /* Temporary storage for the list of UsbDeviceInfo
  * Safe to be called by client program thread 
  * - usbDevices: full list
@@ -129,18 +134,167 @@ void SpiceGlibGlue_FinalizeWindowsEvents() {
 
 #endif
 
+/*
+ * Creating the widget enumerates every local USB device, synchronously. So, it
+ * is not done when connecting, but when a USB function is first called, or
+ * when the mainloop is idle after the first display mark, whatever comes first.
+ */
+static SpiceSession *usbSession = NULL;
+static GMutex usbInitMutex;
+static GCond usbInitCond;
+static gboolean usbInitPending = FALSE;
+/* Also protected by usbInitMutex, as they are read from other threads */
+static gint64 connectTime, initStart = -1, initEnd = -1;
+/* How long a thread waits for the mainloop to create the widget */
+#define USB_INIT_TIMEOUT_MS 10000
+
+/* GSourceFunc, always runs in the mainloop */
+static gboolean initUsbWidget(gpointer data)
+{
+    gint64 start, end;
+
+    if (usbWidget == NULL && usbSession != NULL) {
+        start = g_get_monotonic_time();
+        usbWidget = g_object_new(SPICE_TYPE_USB_DEVICE_WIDGET,
+                "session", usbSession,
+                NULL);
+        spice_usb_device_widget_set_auto_redirect_policy(usbWidget, autoRedirectPolicy);
+        end = g_get_monotonic_time();
+        glue_profiler_mark(GLUE_PHASE_USB_INIT);
+        g_mutex_lock(&usbInitMutex);
+        initStart = start;
+        initEnd = end;
+        SPICE_DEBUG("USB: initialized in %" G_GINT64_FORMAT " us, %" G_GINT64_FORMAT
+                    " us after connecting", end - start, start - connectTime);
+        g_mutex_unlock(&usbInitMutex);
+    }
+
+    g_mutex_lock(&usbInitMutex);
+    usbInitPending = FALSE;
+    g_cond_broadcast(&usbInitCond);
+    g_mutex_unlock(&usbInitMutex);
+    return FALSE;
+}
+
+/* Initializes the widget if it was not yet, waiting for the mainloop if
+ * called from another thread. Returns whether there is a widget; FALSE too if
+ * the mainloop did not create it in USB_INIT_TIMEOUT_MS, and then it is
+ * created when the mainloop runs. */
+static gboolean ensureUsbWidget(void)
+{
+    gint64 endTime;
+
+    if (usbWidget != NULL)
+        return TRUE;
+
+    if (g_main_context_is_owner(g_main_context_default())) {
+        initUsbWidget(NULL);
+    } else {
+        endTime = g_get_monotonic_time() + USB_INIT_TIMEOUT_MS * G_TIME_SPAN_MILLISECOND;
+        g_mutex_lock(&usbInitMutex);
+        if (!usbInitPending) {
+            usbInitPending = TRUE;
+            g_timeout_add_full(G_PRIORITY_HIGH, 0, initUsbWidget, NULL, NULL);
+        }
+        while (usbInitPending) {
+            if (!g_cond_wait_until(&usbInitCond, &usbInitMutex, endTime)) {
+                g_warning("USB: the mainloop did not initialize USB in %d ms",
+                          USB_INIT_TIMEOUT_MS);
+                break;
+            }
+        }
+        g_mutex_unlock(&usbInitMutex);
+    }
+    return usbWidget != NULL;
+}
+
+static void usbDisplayMark(SpiceChannel *channel, gint mark, gpointer data)
+{
+    if (mark == 0)
+        return;
+    g_signal_handlers_disconnect_by_func(channel, usbDisplayMark, NULL);
+    if (usbWidget == NULL)
+        g_idle_add(initUsbWidget, NULL);
+}
+
+static void usbChannelNew(SpiceSession *session, SpiceChannel *channel, gpointer data)
+{
+    if (SPICE_IS_DISPLAY_CHANNEL(channel))
+        g_signal_connect(channel, "display-mark", G_CALLBACK(usbDisplayMark), NULL);
+}
+
 void usb_glue_register_session(SpiceSession* session) {
 
-    usbWidget = g_object_new(SPICE_TYPE_USB_DEVICE_WIDGET,
-            "session", session, 
-            NULL);
+    if (usbSession != NULL) {
+        g_signal_handlers_disconnect_by_func(usbSession, usbChannelNew, NULL);
+        g_object_remove_weak_pointer(G_OBJECT(usbSession), (gpointer *)&usbSession);
+    }
+    usbSession = session;
+    g_object_add_weak_pointer(G_OBJECT(usbSession), (gpointer *)&usbSession);
+    if (usbWidget != NULL) {
+        /* The devices of the list point into the old widget */
+        g_slist_free_full(devices, g_free);
+        devices = device = NULL;
+        g_clear_object(&usbWidget);
+    }
+    g_mutex_lock(&usbInitMutex);
+    connectTime = g_get_monotonic_time();
+    initStart = initEnd = -1;
+    g_mutex_unlock(&usbInitMutex);
+    g_signal_connect(session, "channel-new", G_CALLBACK(usbChannelNew), NULL);
+}
+
+void SpiceGlibGlue_GetUsbInitTimes(int64_t *delayUs, int64_t *durationUs) {
+    g_mutex_lock(&usbInitMutex);
+    *delayUs = initStart >= 0 ? initStart - connectTime : -1;
+    *durationUs = initEnd >= 0 ? initEnd - initStart : -1;
+    g_mutex_unlock(&usbInitMutex);
+}
+
+/* Private function. Called from mainloop */
+static gboolean setUsbAutoRedirectPolicy1(gpointer data)
+{
+    UsbPolicy *policy = data;
+
+    if (usbWidget)
+        spice_usb_device_widget_set_auto_redirect_policy(usbWidget, policy);
+    usb_policy_free(autoRedirectPolicy);
+    autoRedirectPolicy = policy;
+    return FALSE;
+}
+
+int32_t SpiceGlibGlue_SetUsbAutoRedirectRules(const char* rules) {
+
+    GError *err = NULL;
+    UsbPolicy *policy = NULL;
+    gint64 start = g_get_monotonic_time();
+
+    if (rules != NULL && *rules != '\0') {
+        policy = usb_policy_new(rules, &err);
+        if (err) {
+            g_warning("USB: %s", err->message);
+            g_clear_error(&err);
+            return -1;
+        }
+        SPICE_DEBUG("USB: compiled %u auto-redirect rules in %" G_GINT64_FORMAT " us",
+                    usb_policy_get_num_rules(policy), g_get_monotonic_time() - start);
+    } else {
+        SPICE_DEBUG("USB: auto-redirect disabled");
+    }
+
+    g_timeout_add_full(G_PRIORITY_HIGH, 0,
+                       setUsbAutoRedirectPolicy1,
+                       policy, NULL);
+    return 0;
 }
 
 void SpiceGlibGlue_GetUsbDeviceList() {
 
     g_debug(" %s:%d:%s()", __FILE__, __LINE__, __func__);
-    if (!usbWidget) {
-        g_error("Requested Usb device list  before initialization");
+    if (!ensureUsbWidget()) {
+        g_warning("USB: requested the device list before initialization");
+        devices = device = NULL;
+        return;
     }
 
     devices = spice_usb_device_widget_get_devices(usbWidget);
@@ -178,8 +332,8 @@ SpiceUsbDevice* SpiceGlibGlue_GetNextUsbDevice(char* devName, char* devId,
 }
 
 int32_t SpiceGlibGlue_isUsbDeviceListChanged() {
-    if (!usbWidget) {
-        g_error("Requested isUsbDeviceListChanged before initialization");
+    if (!ensureUsbWidget()) {
+        return 0;
     }
     return spice_usb_device_widget_is_changed(usbWidget);
 }
@@ -188,8 +342,9 @@ void SpiceGlibGlue_ShareUsbDevice(SpiceUsbDevice* d) {
 
     g_debug(" %s:%d:%s()", __FILE__, __LINE__, __func__);
 
-    if (!usbWidget) {
-        g_error("Requested UsbWidget before initialization");
+    if (!ensureUsbWidget()) {
+        g_warning("USB: requested to share a device before initialization");
+        return;
     }
     
     spice_usb_device_widget_share(usbWidget, d);
@@ -199,8 +354,9 @@ void SpiceGlibGlue_UnshareUsbDevice(SpiceUsbDevice* d) {
 
     g_debug(" %s:%d:%s()", __FILE__, __LINE__, __func__);
 
-    if (!usbWidget) {
-        g_error("Requested UsbWidget before initialization");
+    if (!ensureUsbWidget()) {
+        g_warning("USB: requested to unshare a device before initialization");
+        return;
     }
     
     spice_usb_device_widget_unshare(usbWidget, d);
@@ -208,12 +364,16 @@ void SpiceGlibGlue_UnshareUsbDevice(SpiceUsbDevice* d) {
 
 void SpiceGlibGlue_GetUsbErrMsg(char* errMsg) {
 
+    if (!ensureUsbWidget()) {
+        errMsg[0] = '\0';
+        return;
+    }
     spice_usb_device_widget_get_error_msg(usbWidget, errMsg);
 }
 
 int32_t SpiceGlibGlue_isUsbErrMsgChanged() {
-    if (!usbWidget) {
-        g_error("Requested isUsbErrMsgChanged before initialization");
+    if (!ensureUsbWidget()) {
+        return 0;
     }
     return spice_usb_device_widget_is_msg_changed(usbWidget);
 }
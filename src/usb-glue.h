@@ -25,10 +25,17 @@
 
 #include "glue-spice-widget.h"
 
-/* Called internally by spiceglue during initialization.
+/* Called internally by spiceglue during initialization. The USB subsystem
+ * is started later, on the first call to a USB function or after the first
+ * display mark.
  */
 void usb_glue_register_session(SpiceSession* session);
 
+/* Time from connecting to the start of the USB initialization, and its
+ * duration, in microseconds, or -1 if it has not happened yet.
+ */
+void SpiceGlibGlue_GetUsbInitTimes(int64_t *delayUs, int64_t *durationUs);
+
 /* Create an internal list of  connected usbDevices to be retrieved by one by 
  * one by SpiceGlibGlueGetNextUsbDevice()
  */
@@ -55,6 +62,15 @@ int32_t SpiceGlibGlue_isUsbDeviceListChanged();
 void SpiceGlibGlue_ShareUsbDevice(SpiceUsbDevice* d);
 void SpiceGlibGlue_UnshareUsbDevice(SpiceUsbDevice* d);
 
+/*
+ * Sets the rules to redirect hot-plugged devices automatically, in usbredir
+ * filter syntax: "class,vendor,product,version,allow|..." with -1 as wildcard.
+ * e.g. "0x0b,-1,-1,-1,1|-1,0x1050,0x0407,-1,1" redirects smartcards and one
+ * specific token. NULL or "" disables auto-redirection.
+ * Returns 0 on success, -1 if the rules cannot be parsed (previous rules are kept).
+ */
+int32_t SpiceGlibGlue_SetUsbAutoRedirectRules(const char* rules);
+
 
 /* 
  * Returns true if the usb message has changed since the last time 
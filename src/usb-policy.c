@@ -0,0 +1,260 @@
+/**
+ * Copyright (C) 2016 flexVDI (Flexible Software Solutions S.L.)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "usb-policy.h"
+#ifdef USBREDIR
+#include <libusb.h>
+
+typedef struct
+{
+    int deviceClass;
+    int vendor;
+    int product;
+    int version;
+    gboolean allow;
+} UsbPolicyRule;
+
+/*
+ * Rules are kept in their original order, and also indexed in buckets by their
+ * most selective field, so that evaluating a device only looks at the rules
+ * that can possibly match it:
+ * - byVidPid: rules with both vendor and product set.
+ * - byVid: rules with vendor set and product as wildcard.
+ * - byClass: rules with class set and vendor as wildcard.
+ * - wildcard: the rest.
+ * Each bucket holds rule indexes in ascending order, so the first match in a
+ * bucket is the best candidate of that bucket.
+ */
+struct _UsbPolicy {
+    GArray *rules;
+    GHashTable *byVidPid;
+    GHashTable *byVid;
+    GHashTable *byClass;
+    GArray *wildcard;
+};
+
+#define VID_PID_KEY(vid, pid) GUINT_TO_POINTER(((guint)(vid) << 16) | (guint)(pid))
+
+static gboolean parse_field(const gchar *str, int min, int max, int *value)
+{
+    gchar *end;
+    gint64 v;
+
+    str = g_strstrip((gchar *)str);
+    if (*str == '\0')
+        return FALSE;
+    v = g_ascii_strtoll(str, &end, 0);
+    if (*end != '\0' || (v != -1 && (v < min || v > max)))
+        return FALSE;
+    *value = v;
+    return TRUE;
+}
+
+static void add_to_bucket(GHashTable *table, gpointer key, guint index)
+{
+    GArray *bucket = g_hash_table_lookup(table, key);
+    if (bucket == NULL) {
+        bucket = g_array_new(FALSE, FALSE, sizeof(guint));
+        g_hash_table_insert(table, key, bucket);
+    }
+    g_array_append_val(bucket, index);
+}
+
+static void index_rule(UsbPolicy *policy, const UsbPolicyRule *rule, guint index)
+{
+    if (rule->vendor != -1 && rule->product != -1)
+        add_to_bucket(policy->byVidPid, VID_PID_KEY(rule->vendor, rule->product), index);
+    else if (rule->vendor != -1)
+        add_to_bucket(policy->byVid, GUINT_TO_POINTER(rule->vendor), index);
+    else if (rule->deviceClass != -1)
+        add_to_bucket(policy->byClass, GUINT_TO_POINTER(rule->deviceClass), index);
+    else
+        g_array_append_val(policy->wildcard, index);
+}
+
+UsbPolicy *usb_policy_new(const gchar *rules, GError **err)
+{
+    UsbPolicy *policy = g_new0(UsbPolicy, 1);
+    gchar **ruleStrs;
+    int i;
+
+    policy->rules = g_array_new(FALSE, FALSE, sizeof(UsbPolicyRule));
+    policy->byVidPid = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                             NULL, (GDestroyNotify)g_array_unref);
+    policy->byVid = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                          NULL, (GDestroyNotify)g_array_unref);
+    policy->byClass = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                            NULL, (GDestroyNotify)g_array_unref);
+    policy->wildcard = g_array_new(FALSE, FALSE, sizeof(guint));
+
+    ruleStrs = g_strsplit(rules ? rules : "", "|", -1);
+    for (i = 0; ruleStrs[i] != NULL; i++) {
+        UsbPolicyRule rule;
+        int allow;
+        gchar **fields;
+
+        if (*g_strstrip(ruleStrs[i]) == '\0')
+            continue;
+
+        fields = g_strsplit(ruleStrs[i], ",", -1);
+        if (g_strv_length(fields) != 5 ||
+            !parse_field(fields[0], 0, 0xff, &rule.deviceClass) ||
+            !parse_field(fields[1], 0, 0xffff, &rule.vendor) ||
+            !parse_field(fields[2], 0, 0xffff, &rule.product) ||
+            !parse_field(fields[3], 0, 0xffff, &rule.version) ||
+            !parse_field(fields[4], 0, 1, &allow) || allow == -1) {
+            g_set_error(err, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                        "Invalid USB filter rule \"%s\"", ruleStrs[i]);
+            g_strfreev(fields);
+            g_strfreev(ruleStrs);
+            usb_policy_free(policy);
+            return NULL;
+        }
+        g_strfreev(fields);
+
+        rule.allow = allow;
+        g_array_append_val(policy->rules, rule);
+        index_rule(policy, &rule, policy->rules->len - 1);
+    }
+    g_strfreev(ruleStrs);
+
+    return policy;
+}
+
+void usb_policy_free(UsbPolicy *policy)
+{
+    if (policy == NULL)
+        return;
+    g_array_unref(policy->rules);
+    g_hash_table_destroy(policy->byVidPid);
+    g_hash_table_destroy(policy->byVid);
+    g_hash_table_destroy(policy->byClass);
+    g_array_unref(policy->wildcard);
+    g_free(policy);
+}
+
+guint usb_policy_get_num_rules(UsbPolicy *policy)
+{
+    return policy->rules->len;
+}
+
+gboolean usb_policy_device_from_spice(SpiceUsbDevice *device, UsbPolicyDevice *info)
+{
+    libusb_device *ldev = (libusb_device *)spice_usb_device_get_libusb_device(device);
+    struct libusb_device_descriptor desc;
+    struct libusb_config_descriptor *config;
+    int i;
+
+    if (ldev == NULL || libusb_get_device_descriptor(ldev, &desc) != 0)
+        return FALSE;
+
+    info->deviceClass = desc.bDeviceClass;
+    info->vendor = desc.idVendor;
+    info->product = desc.idProduct;
+    info->version = desc.bcdDevice;
+    info->numInterfaces = 0;
+
+    if (libusb_get_active_config_descriptor(ldev, &config) == 0) {
+        for (i = 0; i < config->bNumInterfaces &&
+                    info->numInterfaces < USB_POLICY_MAX_INTERFACES; i++) {
+            if (config->interface[i].num_altsetting > 0)
+                info->interfaceClass[info->numInterfaces++] =
+                    config->interface[i].altsetting[0].bInterfaceClass;
+        }
+        libusb_free_config_descriptor(config);
+    }
+
+    return TRUE;
+}
+
+/* A class rule matches either the device class or any of its interfaces,
+ * so that composite devices (e.g. a keyboard with a smartcard reader) match. */
+static gboolean device_has_class(const UsbPolicyDevice *info, int deviceClass)
+{
+    int i;
+
+    if (info->deviceClass == deviceClass)
+        return TRUE;
+    for (i = 0; i < info->numInterfaces; i++) {
+        if (info->interfaceClass[i] == deviceClass)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static gboolean rule_matches(const UsbPolicyRule *rule, const UsbPolicyDevice *info)
+{
+    if (rule->vendor != -1 && rule->vendor != info->vendor)
+        return FALSE;
+    if (rule->product != -1 && rule->product != info->product)
+        return FALSE;
+    if (rule->version != -1 && rule->version != info->version)
+        return FALSE;
+    if (rule->deviceClass != -1 && !device_has_class(info, rule->deviceClass))
+        return FALSE;
+    return TRUE;
+}
+
+/* Updates *best with the first rule in bucket that matches info, if it precedes it. */
+static void match_bucket(UsbPolicy *policy, GArray *bucket,
+                         const UsbPolicyDevice *info, guint *best)
+{
+    guint i;
+
+    if (bucket == NULL)
+        return;
+    for (i = 0; i < bucket->len; i++) {
+        guint index = g_array_index(bucket, guint, i);
+        if (index >= *best)
+            return;
+        if (rule_matches(&g_array_index(policy->rules, UsbPolicyRule, index), info)) {
+            *best = index;
+            return;
+        }
+    }
+}
+
+UsbPolicyDecision usb_policy_evaluate(UsbPolicy *policy, const UsbPolicyDevice *info)
+{
+    guint best = G_MAXUINT;
+    int i;
+
+    match_bucket(policy, g_hash_table_lookup(policy->byVidPid,
+                                             VID_PID_KEY(info->vendor, info->product)),
+                 info, &best);
+    match_bucket(policy, g_hash_table_lookup(policy->byVid, GUINT_TO_POINTER(info->vendor)),
+                 info, &best);
+    match_bucket(policy, g_hash_table_lookup(policy->byClass,
+                                             GUINT_TO_POINTER(info->deviceClass)),
+                 info, &best);
+    for (i = 0; i < info->numInterfaces; i++) {
+        if (info->interfaceClass[i] != info->deviceClass)
+            match_bucket(policy, g_hash_table_lookup(policy->byClass,
+                                                     GUINT_TO_POINTER(info->interfaceClass[i])),
+                         info, &best);
+    }
+    match_bucket(policy, policy->wildcard, info, &best);
+
+    if (best == G_MAXUINT)
+        return USB_POLICY_NO_MATCH;
+    return g_array_index(policy->rules, UsbPolicyRule, best).allow ?
+        USB_POLICY_ALLOW : USB_POLICY_DENY;
+}
+
+#endif
@@ -0,0 +1,69 @@
+/**
+ * Copyright (C) 2016 flexVDI (Flexible Software Solutions S.L.)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * USB auto-redirect policy.
+ *
+ * Rules use the usbredir filter syntax:
+ *   class,vendor,product,version,allow|class,vendor,product,version,allow|...
+ * Every field is a number (decimal or 0x-prefixed hex) or -1 as a wildcard.
+ * allow is 1 to redirect the device automatically, 0 to leave it alone.
+ * As in usbredir, the first rule that matches a device decides.
+ */
+
+#ifdef USBREDIR
+#ifndef _USB_POLICY_H
+#define _USB_POLICY_H
+
+#include <glib.h>
+#include "spice-client.h"
+
+#define USB_POLICY_MAX_INTERFACES 32
+
+typedef struct _UsbPolicy UsbPolicy;
+
+/* The fields of a device that rules are matched against. */
+typedef struct
+{
+    int deviceClass;
+    int vendor;
+    int product;
+    int version;
+    int numInterfaces;
+    guint8 interfaceClass[USB_POLICY_MAX_INTERFACES];
+} UsbPolicyDevice;
+
+typedef enum {
+    USB_POLICY_NO_MATCH = 0,
+    USB_POLICY_ALLOW,
+    USB_POLICY_DENY,
+} UsbPolicyDecision;
+
+/* Compiles a rule string. Returns NULL and sets err if it is malformed. */
+UsbPolicy *usb_policy_new(const gchar *rules, GError **err);
+void usb_policy_free(UsbPolicy *policy);
+
+/* Number of rules in the policy */
+guint usb_policy_get_num_rules(UsbPolicy *policy);
+
+/* Fills info from the libusb descriptors of device. Returns FALSE on error. */
+gboolean usb_policy_device_from_spice(SpiceUsbDevice *device, UsbPolicyDevice *info);
+
+UsbPolicyDecision usb_policy_evaluate(UsbPolicy *policy, const UsbPolicyDevice *info);
+
+#endif /* _USB_POLICY_H */
+#endif
@@ -0,0 +1,190 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/**
+ * Copyright (C) 2016 flexVDI (Flexible Software Solutions S.L.)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Playback jitter buffer: silence while buffering, underrun and overrun
+ * accounting, and the adaptive target latency.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <glib.h>
+
+#include "glue-audio.h"
+
+#define FREQUENCY 48000
+#define CHANNELS 2
+#define FRAMES(ms) (FREQUENCY * (ms) / 1000)
+
+/* Writes ms of audio with every sample set to value */
+static void write_ms(gint ms, gint16 value)
+{
+    gint16 *pcm = g_new(gint16, FRAMES(ms) * CHANNELS);
+    gint i;
+
+    for (i = 0; i < FRAMES(ms) * CHANNELS; i++)
+        pcm[i] = value;
+    glue_audio_playback_write((const guint8 *)pcm, FRAMES(ms) * CHANNELS * sizeof(gint16));
+    g_free(pcm);
+}
+
+/* Reads ms of audio, and checks that the first dataMs have every sample set
+ * to value and the rest is silence */
+static void read_ms(gint ms, gint dataMs, gint16 value, gint64 now)
+{
+    gint16 *pcm = g_new(gint16, FRAMES(ms) * CHANNELS);
+    gint i;
+
+    g_assert_cmpint(glue_audio_playback_read(pcm, FRAMES(ms), now), ==, FRAMES(ms));
+    for (i = 0; i < FRAMES(ms) * CHANNELS; i++)
+        g_assert_cmpint(pcm[i], ==, i < FRAMES(dataMs) * CHANNELS ? value : 0);
+    g_free(pcm);
+}
+
+static SpiceGlibGlueAudioStats get_stats(void)
+{
+    SpiceGlibGlueAudioStats stats;
+    SpiceGlibGlue_GetAudioStats(&stats);
+    return stats;
+}
+
+static void start(gint targetMs, gint maxLatencyMs, gboolean adaptive)
+{
+    SpiceGlibGlue_SetAudioLatency(targetMs, maxLatencyMs, adaptive);
+    glue_audio_playback_start(CHANNELS, FREQUENCY);
+}
+
+static void test_silence(void)
+{
+    gint16 pcm[4] = { 1, 1, 1, 1 };
+    gint64 now = g_get_monotonic_time();
+
+    /* Nothing is played before the start */
+    g_assert_cmpint(glue_audio_playback_read(pcm, 2, now), ==, 0);
+
+    start(60, 400, TRUE);
+    write_ms(30, 1000);
+    read_ms(10, 0, 0, now);
+    g_assert_cmpint(get_stats().bufferedMs, ==, 30);
+    write_ms(40, 1000);
+    read_ms(10, 10, 1000, now);
+    g_assert_cmpint(get_stats().bufferedMs, ==, 60);
+    glue_audio_playback_stop();
+    g_assert_cmpint(glue_audio_playback_read(pcm, 2, now), ==, 0);
+}
+
+static void test_underrun(void)
+{
+    gint64 now = g_get_monotonic_time();
+    gint underruns;
+
+    start(60, 100, TRUE);
+    underruns = get_stats().underruns;
+    write_ms(60, 7);
+    read_ms(10, 10, 7, now);
+    /* 50 ms left, the rest is silence */
+    read_ms(60, 50, 7, now);
+    g_assert_cmpint(get_stats().underruns, ==, underruns + 1);
+    g_assert_cmpint(get_stats().targetMs, ==, 80);
+
+    /* Buffering again, up to the new target */
+    write_ms(70, 7);
+    read_ms(10, 0, 0, now);
+    write_ms(10, 7);
+    read_ms(10, 10, 7, now);
+    read_ms(100, 70, 7, now);
+    g_assert_cmpint(get_stats().targetMs, ==, 100);
+
+    /* Not above the maximum */
+    write_ms(100, 7);
+    read_ms(200, 100, 7, now);
+    g_assert_cmpint(get_stats().underruns, ==, underruns + 3);
+    g_assert_cmpint(get_stats().targetMs, ==, 100);
+    glue_audio_playback_stop();
+
+    /* Without adaptation, the target stays */
+    start(60, 400, FALSE);
+    write_ms(60, 7);
+    read_ms(70, 60, 7, now);
+    g_assert_cmpint(get_stats().underruns, ==, underruns + 4);
+    g_assert_cmpint(get_stats().targetMs, ==, 60);
+    glue_audio_playback_stop();
+}
+
+static void test_decay(void)
+{
+    gint64 now;
+
+    start(60, 400, TRUE);
+    now = g_get_monotonic_time();
+    write_ms(60, 3);
+    read_ms(70, 60, 3, now);
+    g_assert_cmpint(get_stats().targetMs, ==, 80);
+
+    write_ms(80, 3);
+    read_ms(10, 10, 3, now + G_USEC_PER_SEC);
+    g_assert_cmpint(get_stats().targetMs, ==, 80);
+    /* Half a step down after 10 s without underruns */
+    read_ms(10, 10, 3, now + 11 * G_USEC_PER_SEC);
+    g_assert_cmpint(get_stats().targetMs, ==, 70);
+    read_ms(10, 10, 3, now + 12 * G_USEC_PER_SEC);
+    g_assert_cmpint(get_stats().targetMs, ==, 70);
+    read_ms(10, 10, 3, now + 22 * G_USEC_PER_SEC);
+    g_assert_cmpint(get_stats().targetMs, ==, 60);
+    /* But never below the configured target */
+    read_ms(10, 10, 3, now + 40 * G_USEC_PER_SEC);
+    g_assert_cmpint(get_stats().targetMs, ==, 60);
+    glue_audio_playback_stop();
+}
+
+static void test_overrun(void)
+{
+    gint64 now = g_get_monotonic_time();
+    gint overruns;
+
+    start(60, 400, TRUE);
+    overruns = get_stats().overruns;
+    write_ms(60, 5);
+    read_ms(10, 10, 5, now);
+    /* Over twice the target, back to the target */
+    write_ms(80, 5);
+    g_assert_cmpint(get_stats().overruns, ==, overruns + 1);
+    g_assert_cmpint(get_stats().bufferedMs, ==, 60);
+    glue_audio_playback_stop();
+
+    /* More than the ring holds keeps the newest audio */
+    start(60, 400, TRUE);
+    write_ms(1000, 1);
+    write_ms(2500, 2);
+    g_assert_cmpint(get_stats().overruns, ==, overruns + 2);
+    g_assert_cmpint(get_stats().bufferedMs, ==, 2000);
+    read_ms(10, 10, 2, now);
+    glue_audio_playback_stop();
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/audio/silence", test_silence);
+    g_test_add_func("/audio/underrun", test_underrun);
+    g_test_add_func("/audio/decay", test_decay);
+    g_test_add_func("/audio/overrun", test_overrun);
+    return g_test_run();
+}
@@ -0,0 +1,80 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/**
+ * Copyright (C) 2016 flexVDI (Flexible Software Solutions S.L.)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Split of the cache memory budget between the image cache and the GLZ window.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <glib.h>
+
+#include "glue-connection.h"
+
+#define MiB (1 << 20)
+
+static void check_split(gint budgetMiB, gint cacheSize, gint glzWindowSize,
+                        gint expectedCache, gint expectedGlz)
+{
+    spice_connection_split_cache_budget(budgetMiB, &cacheSize, &glzWindowSize);
+    g_assert_cmpint(cacheSize, ==, expectedCache);
+    g_assert_cmpint(glzWindowSize, ==, expectedGlz);
+}
+
+static void test_no_budget(void)
+{
+    check_split(0, -1, -1, -1, -1);
+    check_split(0, 8 * MiB, -1, 8 * MiB, -1);
+}
+
+static void test_split(void)
+{
+    /* A quarter for the GLZ window, the rest for the image cache */
+    check_split(64, -1, -1, 48 * MiB, 16 * MiB);
+    check_split(16, -1, -1, 12 * MiB, 4 * MiB);
+}
+
+static void test_limits(void)
+{
+    /* The GLZ window stays between 1 and 32 MiB */
+    check_split(2, -1, -1, 1 * MiB, 1 * MiB);
+    check_split(1024, -1, -1, 992 * MiB, 32 * MiB);
+    /* The image cache gets at least 1 MiB, even over the budget */
+    check_split(1, -1, -1, 1 * MiB, 1 * MiB);
+}
+
+static void test_explicit_sizes(void)
+{
+    /* Sizes set as options are kept, the other one takes the rest */
+    check_split(64, -1, 4 * MiB, 60 * MiB, 4 * MiB);
+    check_split(64, 10 * MiB, -1, 10 * MiB, 16 * MiB);
+    check_split(64, 10 * MiB, 4 * MiB, 10 * MiB, 4 * MiB);
+    check_split(4, -1, 8 * MiB, 1 * MiB, 8 * MiB);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/cache-budget/no-budget", test_no_budget);
+    g_test_add_func("/cache-budget/split", test_split);
+    g_test_add_func("/cache-budget/limits", test_limits);
+    g_test_add_func("/cache-budget/explicit-sizes", test_explicit_sizes);
+    return g_test_run();
+}
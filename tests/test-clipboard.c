@@ -0,0 +1,244 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/**
+ * Copyright (C) 2016 flexVDI (Flexible Software Solutions S.L.)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Conversions of the clipboard core, with the memory backend. The data is
+ * written in chunks of every size, so that CRLF pairs and BMP headers are
+ * split across chunk boundaries.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <glib.h>
+
+#include "glue-clipboard-core.h"
+
+/* Converts data written in chunks of chunkSize bytes */
+static guchar *convert_in_chunks(const char *data, gsize size, ClipboardEolConversion eol,
+                                 gsize chunkSize, gsize *outSize)
+{
+    ClipboardStream stream;
+    gsize offset;
+
+    clipboard_stream_init(&stream, eol, size);
+    for (offset = 0; offset < size; offset += chunkSize)
+        g_assert_true(clipboard_stream_write(&stream, (const guchar *)data + offset,
+                                             MIN(chunkSize, size - offset)));
+    return clipboard_stream_finish(&stream, outSize);
+}
+
+static void check_eol(const char *input, ClipboardEolConversion eol, const char *expected)
+{
+    gsize inputSize = strlen(input), chunkSize, outSize;
+
+    for (chunkSize = 1; chunkSize <= inputSize; chunkSize++) {
+        guchar *output = convert_in_chunks(input, inputSize, eol, chunkSize, &outSize);
+        g_assert_nonnull(output);
+        g_assert_cmpmem(output, outSize, expected, strlen(expected));
+        g_assert_cmpint(output[outSize], ==, '\0');
+        g_free(output);
+    }
+}
+
+static void test_eol_to_unix(void)
+{
+    check_eol("a\r\nb\rc\r\n\r\n", CLIPBOARD_EOL_TO_UNIX, "a\nb\rc\n\n");
+    check_eol("\r\r\n\r", CLIPBOARD_EOL_TO_UNIX, "\r\n\r");
+    check_eol("no line breaks", CLIPBOARD_EOL_TO_UNIX, "no line breaks");
+}
+
+static void test_eol_to_dos(void)
+{
+    check_eol("a\nb\r\nc\n", CLIPBOARD_EOL_TO_DOS, "a\r\nb\r\nc\r\n");
+    check_eol("\n\r\n\r\r\n", CLIPBOARD_EOL_TO_DOS, "\r\n\r\n\r\r\n");
+    check_eol("no line breaks", CLIPBOARD_EOL_TO_DOS, "no line breaks");
+}
+
+static void test_eol_chunk_boundary(void)
+{
+    gsize size = CLIPBOARD_CHUNK_SIZE + 16, outSize;
+    guchar *input = g_malloc(size), *output;
+
+    /* A CRLF split between the first and second chunks of clipboard_convert */
+    memset(input, 'x', size);
+    input[CLIPBOARD_CHUNK_SIZE - 1] = '\r';
+    input[CLIPBOARD_CHUNK_SIZE] = '\n';
+    output = clipboard_convert(input, size, CLIPBOARD_EOL_TO_UNIX, &outSize);
+    g_assert_cmpuint(outSize, ==, size - 1);
+    g_assert_cmpint(output[CLIPBOARD_CHUNK_SIZE - 1], ==, '\n');
+    g_assert_cmpint(output[CLIPBOARD_CHUNK_SIZE], ==, 'x');
+    g_free(output);
+
+    output = clipboard_convert(input, size, CLIPBOARD_EOL_TO_DOS, &outSize);
+    g_assert_cmpmem(output, outSize, input, size);
+    g_free(output);
+    g_free(input);
+}
+
+static void test_max_size(void)
+{
+    gsize outSize;
+
+    SpiceGlibGlue_SetClipboardMaxSize(4);
+    g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "CB: discarded clipboard*");
+    g_assert_null(clipboard_convert((const guchar *)"12345", 5, CLIPBOARD_EOL_KEEP, &outSize));
+    g_assert_cmpuint(outSize, ==, 0);
+    g_test_assert_expected_messages();
+    SpiceGlibGlue_SetClipboardMaxSize(-1);
+}
+
+static guint32 read_le32(const guchar *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((guint32)p[3] << 24);
+}
+
+/* A DIB with a BITMAPINFOHEADER, followed by the masks and color table
+ * (tables bytes) and the pixels */
+static guchar *make_dib(guint16 bitCount, guint32 compression, gsize tables,
+                        gsize pixels, gsize *size)
+{
+    guchar *dib;
+    gsize i;
+
+    *size = 40 + tables + pixels;
+    dib = g_malloc0(*size);
+    dib[0] = 40;
+    dib[14] = bitCount;
+    dib[16] = compression;
+    for (i = 40; i < *size; i++)
+        dib[i] = i * 7;
+    return dib;
+}
+
+/* Converts a DIB to BMP and back, and checks where the pixels start */
+static void check_bmp(const guchar *dib, gsize size, guint32 pixelOffset)
+{
+    gsize bmpSize, dibSize;
+    guchar *bmp = clipboard_dib_to_bmp(dib, size, &bmpSize), *back;
+
+    g_assert_nonnull(bmp);
+    g_assert_cmpuint(bmpSize, ==, size + CLIPBOARD_BMP_FILE_HEADER_SIZE);
+    g_assert_cmpint(bmp[0], ==, 'B');
+    g_assert_cmpint(bmp[1], ==, 'M');
+    g_assert_cmpuint(read_le32(bmp + 2), ==, bmpSize);
+    g_assert_cmpuint(read_le32(bmp + 10), ==, pixelOffset);
+
+    back = clipboard_bmp_to_dib(bmp, bmpSize, &dibSize);
+    g_assert_cmpmem(back, dibSize, dib, size);
+    g_free(back);
+    g_free(bmp);
+}
+
+static void test_bmp(void)
+{
+    gsize size;
+    guchar *dib;
+
+    /* 24 bpp, no color table, bigger than a chunk */
+    dib = make_dib(24, 0, 0, CLIPBOARD_CHUNK_SIZE * 2 + 3, &size);
+    check_bmp(dib, size, 14 + 40);
+    g_free(dib);
+
+    /* 8 bpp, with a full color table */
+    dib = make_dib(8, 0, 256 * 4, 64, &size);
+    check_bmp(dib, size, 14 + 40 + 256 * 4);
+    g_free(dib);
+
+    /* 32 bpp BI_BITFIELDS, with three masks */
+    dib = make_dib(32, 3, 12, 64, &size);
+    check_bmp(dib, size, 14 + 40 + 12);
+    g_free(dib);
+
+    /* 32 bpp BI_ALPHABITFIELDS, with four masks */
+    dib = make_dib(32, 6, 16, 64, &size);
+    check_bmp(dib, size, 14 + 40 + 16);
+    g_free(dib);
+
+    /* 4 bpp, with more colors than pixel values: the table is 16 colors */
+    dib = make_dib(4, 0, 16 * 4, 64, &size);
+    dib[32] = 0;
+    dib[33] = 1;
+    check_bmp(dib, size, 14 + 40 + 16 * 4);
+    g_free(dib);
+
+    /* 1 bpp BITMAPCOREHEADER, with two 3-byte colors */
+    dib = make_dib(0, 0, 0, 2 * 3 + 8, &size);
+    dib[0] = 12;
+    dib[10] = 1;
+    check_bmp(dib, size, 14 + 12 + 2 * 3);
+    g_free(dib);
+}
+
+/* Builds a DIB like make_dib, with another header size and number of colors,
+ * and checks that it is rejected */
+static void check_invalid_dib(guint32 infoSize, guint16 bitCount, guint32 compression,
+                              guint32 colors, gsize tables, gsize pixels)
+{
+    gsize size, bmpSize;
+    guchar *dib = make_dib(bitCount, compression, tables, pixels, &size);
+
+    dib[0] = infoSize;
+    dib[32] = colors;
+    dib[33] = colors >> 8;
+    dib[34] = colors >> 16;
+    dib[35] = colors >> 24;
+    g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "CB: invalid DIB image*");
+    g_assert_null(clipboard_dib_to_bmp(dib, size, &bmpSize));
+    g_test_assert_expected_messages();
+    g_free(dib);
+}
+
+static void test_invalid_images(void)
+{
+    gsize size;
+    static const guchar notBmp[20] = { 'X', 'Y' };
+    static const guchar shortDib[8] = { 40 };
+
+    g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "CB: invalid BMP image*");
+    g_assert_null(clipboard_bmp_to_dib(notBmp, sizeof(notBmp), &size));
+    g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "CB: invalid DIB image*");
+    g_assert_null(clipboard_dib_to_bmp(shortDib, sizeof(shortDib), &size));
+    g_test_assert_expected_messages();
+
+    /* Not a known header size */
+    check_invalid_dib(41, 24, 0, 0, 0, 64);
+    check_invalid_dib(64, 24, 0, 0, 0, 64);
+    /* 8 bpp, without room for the color table */
+    check_invalid_dib(40, 8, 0, 0, 0, 255 * 4);
+    /* BI_BITFIELDS, without room for the masks */
+    check_invalid_dib(40, 32, 3, 0, 0, 8);
+    /* 24 bpp with an optional color table that would overflow 32 bits */
+    check_invalid_dib(40, 24, 0, 0xffffffff, 0, 64);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/clipboard/eol-to-unix", test_eol_to_unix);
+    g_test_add_func("/clipboard/eol-to-dos", test_eol_to_dos);
+    g_test_add_func("/clipboard/eol-chunk-boundary", test_eol_chunk_boundary);
+    g_test_add_func("/clipboard/max-size", test_max_size);
+    g_test_add_func("/clipboard/bmp", test_bmp);
+    g_test_add_func("/clipboard/invalid-images", test_invalid_images);
+
+    return g_test_run();
+}
@@ -0,0 +1,106 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/**
+ * Copyright (C) 2016 flexVDI (Flexible Software Solutions S.L.)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Keymap tables. Two host keys must not send the same scancode, or the guest
+ * could not tell them apart, and a release would release both.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <glib.h>
+
+#include "glue-keymaps.h"
+
+/* USB HID has two usages for the same key, \ on US keyboards and # on ISO ones */
+static gboolean known_duplicate(int32_t keymap, size_t keycode)
+{
+    return keymap == GLUE_KEYMAP_USB_HID && (keycode == 0x31 || keycode == 0x32);
+}
+
+static void test_injective(void)
+{
+    int32_t keymap;
+
+    for (keymap = GLUE_KEYMAP_SCANCODE + 1; keymap < GLUE_KEYMAP_COUNT; keymap++) {
+        /* Keycode that sends every scancode, plus one */
+        size_t seen[0x200], len, i;
+        const uint16_t *table;
+        int mapped = 0;
+
+        g_assert_cmpint(SpiceGlibGlueSetKeymap(keymap), ==, 0);
+        table = glue_keymap_get(&len);
+        g_assert_nonnull(table);
+        memset(seen, 0, sizeof(seen));
+        for (i = 0; i < len; i++) {
+            if (table[i] == 0)
+                continue;
+            g_assert_cmpuint(table[i], <, G_N_ELEMENTS(seen));
+            g_assert_cmpuint(table[i] & 0xff, !=, 0);
+            if (seen[table[i]] != 0 && !known_duplicate(keymap, i)) {
+                g_test_message("Keymap %d: keycodes %" G_GSIZE_FORMAT " and %" G_GSIZE_FORMAT
+                               " send 0x%x", keymap, seen[table[i]] - 1, i, table[i]);
+                g_test_fail();
+            }
+            seen[table[i]] = i + 1;
+            mapped++;
+        }
+        /* At least the letters, digits and modifiers */
+        g_assert_cmpint(mapped, >=, 60);
+    }
+}
+
+static void test_xorg_evdev(void)
+{
+    const uint16_t *evdev, *xorg;
+    size_t evdevLen, xorgLen, i;
+
+    SpiceGlibGlueSetKeymap(GLUE_KEYMAP_EVDEV);
+    evdev = glue_keymap_get(&evdevLen);
+    SpiceGlibGlueSetKeymap(GLUE_KEYMAP_XORG_EVDEV);
+    xorg = glue_keymap_get(&xorgLen);
+    g_assert_cmpuint(xorgLen, ==, evdevLen + 8);
+    for (i = 0; i < 8; i++)
+        g_assert_cmpuint(xorg[i], ==, 0);
+    for (i = 0; i < evdevLen; i++)
+        g_assert_cmpuint(xorg[i + 8], ==, evdev[i]);
+}
+
+static void test_select(void)
+{
+    size_t len;
+
+    g_test_expect_message("SpiceGlue", G_LOG_LEVEL_WARNING, "Unknown keymap*");
+    g_assert_cmpint(SpiceGlibGlueSetKeymap(GLUE_KEYMAP_COUNT), ==, -1);
+    g_test_assert_expected_messages();
+    g_assert_cmpint(SpiceGlibGlueSetKeymap(GLUE_KEYMAP_SCANCODE), ==, 0);
+    g_assert_null(glue_keymap_get(&len));
+    g_assert_cmpuint(len, ==, 0);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/keymaps/injective", test_injective);
+    g_test_add_func("/keymaps/xorg-evdev", test_xorg_evdev);
+    g_test_add_func("/keymaps/select", test_select);
+    return g_test_run();
+}
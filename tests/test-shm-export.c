@@ -0,0 +1,266 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/**
+ * Copyright (C) 2016 flexVDI (Flexible Software Solutions S.L.)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Shared memory display export, read by a reference reader. This is how a
+ * renderer in another process is expected to use the memfd and the eventfd:
+ * it waits for a notification, holds the latest slot while it presents it,
+ * and releases it afterwards.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <glib.h>
+
+#include "glue-shm-export.h"
+#include "mono-glue-types.h"
+
+#define WIDTH 64
+#define HEIGHT 32
+#define SLOTS 3
+
+typedef struct {
+    int eventFd;
+    guint8 *map;
+    gsize mapSize;
+    SpiceGlibGlueShmHeader *header;
+} ShmReader;
+
+static SpiceGlibGlueShmSlot *reader_slot(ShmReader *reader, guint32 index)
+{
+    return (SpiceGlibGlueShmSlot *)(reader->map + reader->header->headerSize +
+                                    index * reader->header->slotSize);
+}
+
+static const guint32 *reader_pixels(ShmReader *reader, SpiceGlibGlueShmSlot *slot)
+{
+    return (const guint32 *)((const guint8 *)slot + reader->header->pixelsOffset);
+}
+
+/* Maps the export as another process would, from the descriptors only. */
+static void reader_open(ShmReader *reader, int memFd, int eventFd)
+{
+    SpiceGlibGlueShmHeader *header;
+
+    header = mmap(NULL, sizeof(*header), PROT_READ, MAP_SHARED, memFd, 0);
+    g_assert_true(header != MAP_FAILED);
+    g_assert_cmpuint(header->magic, ==, GLUE_SHM_MAGIC);
+    g_assert_cmpuint(header->version, ==, GLUE_SHM_VERSION);
+    reader->mapSize = header->headerSize + (gsize)header->slotSize * header->numSlots;
+    munmap(header, sizeof(*header));
+
+    /* Read-write, readerSlot is written by the reader */
+    reader->map = mmap(NULL, reader->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, memFd, 0);
+    g_assert_true(reader->map != MAP_FAILED);
+    reader->header = (SpiceGlibGlueShmHeader *)reader->map;
+    reader->eventFd = eventFd;
+}
+
+static void reader_close(ShmReader *reader)
+{
+    munmap(reader->map, reader->mapSize);
+}
+
+/* Returns how many frames were notified, waiting up to timeout ms. */
+static guint64 reader_wait(ShmReader *reader, int timeout)
+{
+    struct pollfd pfd = { .fd = reader->eventFd, .events = POLLIN };
+    guint64 frames = 0;
+
+    if (poll(&pfd, 1, timeout) == 1 && read(reader->eventFd, &frames, sizeof(frames)) < 0)
+        frames = 0;
+    return frames;
+}
+
+/* Holds the latest complete frame, or returns NULL if there is none yet. Its
+ * pixels are not written until reader_release(). */
+static SpiceGlibGlueShmSlot *reader_acquire(ShmReader *reader, guint32 *index)
+{
+    SpiceGlibGlueShmHeader *header = reader->header;
+    SpiceGlibGlueShmSlot *slot;
+    guint64 sequence;
+
+    if (__atomic_load_n(&header->sequence, __ATOMIC_ACQUIRE) == 0)
+        return NULL;
+    for (;;) {
+        *index = __atomic_load_n(&header->latest, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&header->readerSlot, *index, __ATOMIC_SEQ_CST);
+        slot = reader_slot(reader, *index);
+        sequence = __atomic_load_n(&slot->sequence, __ATOMIC_SEQ_CST);
+        if (sequence != 0 && sequence % 2 == 0)
+            return slot;
+        /* It is being written; it will be the latest one when it is complete */
+    }
+}
+
+static void reader_release(ShmReader *reader)
+{
+    __atomic_store_n(&reader->header->readerSlot, GLUE_SHM_NO_SLOT, __ATOMIC_SEQ_CST);
+}
+
+/* The guest surface, ARGB */
+static guint32 surface[WIDTH * HEIGHT];
+
+static guint32 to_rgba(guint32 argb)
+{
+    return 0xFF000000 | ((argb & 0x00FF0000) >> 16) | (argb & 0x0000FF00) |
+           ((argb & 0x000000FF) << 16);
+}
+
+static void paint(gint x, gint y, gint w, gint h, guint32 color)
+{
+    gint i, j;
+
+    for (i = y; i < y + h; i++)
+        for (j = x; j < x + w; j++)
+            surface[i * WIDTH + j] = color + i * WIDTH + j;
+    glue_shm_export_frame(surface, WIDTH * sizeof(guint32), WIDTH, HEIGHT, x, y, w, h);
+}
+
+static void check_frame(ShmReader *reader, SpiceGlibGlueShmSlot *slot)
+{
+    const guint32 *pixels = reader_pixels(reader, slot);
+    gint i, j;
+
+    g_assert_cmpuint(slot->width, ==, WIDTH);
+    g_assert_cmpuint(slot->height, ==, HEIGHT);
+    for (i = 0; i < HEIGHT; i++) {
+        for (j = 0; j < WIDTH; j++)
+            g_assert_cmpuint(pixels[i * reader->header->stride / 4 + j], ==,
+                             to_rgba(surface[i * WIDTH + j]));
+    }
+}
+
+static void open_export(ShmReader *reader)
+{
+    int32_t memFd, eventFd;
+
+    memset(surface, 0, sizeof(surface));
+    g_assert_cmpint(SpiceGlibGlueEnableShmExport(WIDTH, HEIGHT, SLOTS, &memFd, &eventFd), ==, 0);
+    reader_open(reader, memFd, eventFd);
+}
+
+static void close_export(ShmReader *reader)
+{
+    reader_close(reader);
+    SpiceGlibGlueDisableShmExport();
+}
+
+static void test_layout(void)
+{
+    ShmReader reader;
+    guint32 index;
+
+    open_export(&reader);
+    g_assert_cmpuint(reader.header->numSlots, ==, SLOTS);
+    g_assert_cmpuint(reader.header->format, ==, GLUE_PIXEL_FORMAT_RGBA);
+    g_assert_cmpuint(reader.header->stride, >=, WIDTH * 4);
+    g_assert_cmpuint(reader.header->pixelsOffset, >=, sizeof(SpiceGlibGlueShmSlot));
+    g_assert_cmpuint(reader.header->readerSlot, ==, GLUE_SHM_NO_SLOT);
+    g_assert_null(reader_acquire(&reader, &index));
+    g_assert_cmpuint(reader_wait(&reader, 0), ==, 0);
+    close_export(&reader);
+}
+
+static void test_frames(void)
+{
+    ShmReader reader;
+    SpiceGlibGlueShmSlot *slot;
+    guint32 index;
+
+    open_export(&reader);
+    /* The first frame is whole, whatever the damage */
+    paint(8, 8, 4, 4, 0xFF102030);
+    g_assert_cmpuint(reader_wait(&reader, 1000), ==, 1);
+    slot = reader_acquire(&reader, &index);
+    g_assert_nonnull(slot);
+    g_assert_cmpint(slot->dirtyWidth, ==, WIDTH);
+    g_assert_cmpint(slot->dirtyHeight, ==, HEIGHT);
+    check_frame(&reader, slot);
+    reader_release(&reader);
+
+    /* Slots that missed some damage get it with the next frame written to them */
+    paint(0, 0, 10, 10, 0xFF405060);
+    paint(WIDTH - 10, HEIGHT - 10, 10, 10, 0xFF708090);
+    paint(20, 5, 30, 3, 0xFFA0B0C0);
+    paint(1, HEIGHT - 1, WIDTH - 2, 1, 0xFFD0E0F0);
+    g_assert_cmpuint(reader_wait(&reader, 1000), ==, 4);
+    slot = reader_acquire(&reader, &index);
+    g_assert_nonnull(slot);
+    g_assert_cmpint(slot->dirtyX, ==, 1);
+    g_assert_cmpint(slot->dirtyY, ==, HEIGHT - 1);
+    g_assert_cmpuint(slot->sequence, ==, reader.header->sequence);
+    check_frame(&reader, slot);
+    reader_release(&reader);
+    close_export(&reader);
+}
+
+static void test_reader_hold(void)
+{
+    ShmReader reader;
+    SpiceGlibGlueShmSlot *slot;
+    guint32 index, *held;
+    guint64 sequence;
+    gsize size;
+    int i;
+
+    open_export(&reader);
+    paint(0, 0, WIDTH, HEIGHT, 0xFF000000);
+    slot = reader_acquire(&reader, &index);
+    g_assert_nonnull(slot);
+    sequence = slot->sequence;
+    size = (gsize)reader.header->stride * HEIGHT;
+    held = g_malloc(size);
+    memcpy(held, reader_pixels(&reader, slot), size);
+
+    /* The held slot is skipped, however many frames are written */
+    for (i = 0; i < SLOTS * 3; i++) {
+        paint(i, i, 16, 16, 0xFF000000 + (i << 16));
+        g_assert_cmpuint(reader.header->latest, !=, index);
+        g_assert_cmpuint(slot->sequence, ==, sequence);
+        g_assert_cmpmem(reader_pixels(&reader, slot), size, held, size);
+    }
+    g_assert_cmpuint(reader.header->sequence, ==, sequence + SLOTS * 3 * 2);
+    reader_release(&reader);
+
+    /* And written again once released, with all the damage it missed */
+    for (i = 0; i < SLOTS; i++)
+        paint(40, 20, 8, 8, 0xFF00FF00 + i);
+    g_assert_cmpuint(slot->sequence, >, sequence);
+    slot = reader_acquire(&reader, &index);
+    check_frame(&reader, slot);
+    reader_release(&reader);
+    reader_wait(&reader, 0);
+    g_free(held);
+    close_export(&reader);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/shm-export/layout", test_layout);
+    g_test_add_func("/shm-export/frames", test_frames);
+    g_test_add_func("/shm-export/reader-hold", test_reader_hold);
+    return g_test_run();
+}
@@ -0,0 +1,121 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/**
+ * Copyright (C) 2016 flexVDI (Flexible Software Solutions S.L.)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Keystrokes that type text in the guest layouts: modifiers around their key,
+ * and the dead keys of the Spanish layout.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <glib.h>
+
+#include "glue-typing-layout.h"
+
+#define SHIFT 0x2a
+#define ALTGR 0x138
+#define DOWN(scancode) { scancode, TRUE, FALSE }
+#define UP(scancode) { scancode, FALSE, FALSE }
+#define LAST(scancode) { scancode, FALSE, TRUE }
+
+static void check_char(const char *layout, gunichar ch,
+                       const GlueTypingEvent *expected, guint len)
+{
+    GArray *events = g_array_new(FALSE, FALSE, sizeof(GlueTypingEvent));
+    guint i;
+
+    g_assert_true(glue_typing_layout_add_char(glue_typing_layout_get(layout), ch, events));
+    g_assert_cmpuint(events->len, ==, len);
+    for (i = 0; i < len; i++) {
+        GlueTypingEvent *event = &g_array_index(events, GlueTypingEvent, i);
+        g_assert_cmphex(event->scancode, ==, expected[i].scancode);
+        g_assert_cmpint(event->down, ==, expected[i].down);
+        g_assert_cmpint(event->last, ==, expected[i].last);
+    }
+    g_array_free(events, TRUE);
+}
+
+#define CHECK_CHAR(layout, ch, ...) do { \
+    const GlueTypingEvent expected[] = { __VA_ARGS__ }; \
+    check_char(layout, ch, expected, G_N_ELEMENTS(expected)); \
+} while (0)
+
+static void test_layouts(void)
+{
+    g_assert_nonnull(glue_typing_layout_get("us"));
+    g_assert_nonnull(glue_typing_layout_get("es"));
+    g_assert_null(glue_typing_layout_get("fr"));
+    g_assert_null(glue_typing_layout_get(NULL));
+}
+
+static void test_plain_keys(void)
+{
+    CHECK_CHAR("us", 'a', DOWN(0x1e), LAST(0x1e));
+    CHECK_CHAR("es", '0', DOWN(0x0b), LAST(0x0b));
+    CHECK_CHAR("es", 0x00f1, DOWN(0x27), LAST(0x27));     /* ñ */
+}
+
+static void test_modifiers(void)
+{
+    /* Modifiers are pressed first and released last */
+    CHECK_CHAR("us", 'A', DOWN(SHIFT), DOWN(0x1e), UP(0x1e), LAST(SHIFT));
+    CHECK_CHAR("us", '@', DOWN(SHIFT), DOWN(0x03), UP(0x03), LAST(SHIFT));
+    CHECK_CHAR("es", '@', DOWN(ALTGR), DOWN(0x03), UP(0x03), LAST(ALTGR));
+    CHECK_CHAR("es", 0x20ac, DOWN(ALTGR), DOWN(0x06), UP(0x06), LAST(ALTGR)); /* € */
+}
+
+static void test_dead_keys(void)
+{
+    /* The dead key is released before the next key, and is not the last event */
+    CHECK_CHAR("es", 0x00e1, DOWN(0x28), UP(0x28), DOWN(0x1e), LAST(0x1e));  /* á */
+    CHECK_CHAR("es", 0x00f9, DOWN(0x1a), UP(0x1a), DOWN(0x16), LAST(0x16));  /* ù */
+    CHECK_CHAR("es", 0x00c9, DOWN(0x28), UP(0x28),                           /* É */
+               DOWN(SHIFT), DOWN(0x12), UP(0x12), LAST(SHIFT));
+    CHECK_CHAR("es", 0x00fc, DOWN(SHIFT), DOWN(0x28), UP(0x28), UP(SHIFT),   /* ü */
+               DOWN(0x16), LAST(0x16));
+    CHECK_CHAR("es", 0x00dc, DOWN(SHIFT), DOWN(0x28), UP(0x28), UP(SHIFT),   /* Ü */
+               DOWN(SHIFT), DOWN(0x16), UP(0x16), LAST(SHIFT));
+    /* Spacing accents are the dead key and a space */
+    CHECK_CHAR("es", '^', DOWN(SHIFT), DOWN(0x1a), UP(0x1a), UP(SHIFT),
+               DOWN(0x39), LAST(0x39));
+    CHECK_CHAR("es", 0x00b4, DOWN(0x28), UP(0x28), DOWN(0x39), LAST(0x39)); /* ´ */
+}
+
+static void test_missing_chars(void)
+{
+    GArray *events = g_array_new(FALSE, FALSE, sizeof(GlueTypingEvent));
+
+    g_assert_false(glue_typing_layout_add_char(glue_typing_layout_get("us"), 0x00f1, events));
+    g_assert_false(glue_typing_layout_add_char(glue_typing_layout_get("es"), 0x00e2, events));
+    g_assert_false(glue_typing_layout_add_char(glue_typing_layout_get("es"), 0x4e2d, events));
+    g_assert_cmpuint(events->len, ==, 0);
+    g_array_free(events, TRUE);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/typing/layouts", test_layouts);
+    g_test_add_func("/typing/plain-keys", test_plain_keys);
+    g_test_add_func("/typing/modifiers", test_modifiers);
+    g_test_add_func("/typing/dead-keys", test_dead_keys);
+    g_test_add_func("/typing/missing-chars", test_missing_chars);
+    return g_test_run();
+}
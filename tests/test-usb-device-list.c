@@ -0,0 +1,156 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/**
+ * Copyright (C) 2016 flexVDI (Flexible Software Solutions S.L.)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The USB device list under a burst of plug and unplug events: it must keep
+ * the insertion order and find every listed device, however many holes the
+ * removals leave behind.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <glib.h>
+
+#include "usb-device-list.h"
+
+#define NUM_DEVICES 512
+#define NUM_EVENTS 200000
+
+/* The devices are only used as keys, they are never dereferenced */
+#define FAKE_DEVICE(n) ((SpiceUsbDevice *)GUINT_TO_POINTER((n) + 1))
+
+static UsbDeviceInfo make_info(guint n)
+{
+    UsbDeviceInfo info;
+
+    memset(&info, 0, sizeof(info));
+    info.device = FAKE_DEVICE(n);
+    g_snprintf(info.id, sizeof(info.id), "%u", n);
+    return info;
+}
+
+typedef struct {
+    GPtrArray *expected;
+    guint i;
+} OrderCheck;
+
+static void check_next(gpointer data, gpointer user_data)
+{
+    UsbDeviceInfo *info = (UsbDeviceInfo *)data;
+    OrderCheck *check = (OrderCheck *)user_data;
+
+    g_assert_cmpuint(check->i, <, check->expected->len);
+    g_assert_true(info->device == g_ptr_array_index(check->expected, check->i));
+    check->i++;
+}
+
+static void check_order(UsbDeviceList *list, GPtrArray *expected)
+{
+    OrderCheck check = { expected, 0 };
+
+    g_assert_cmpuint(usb_device_list_get_length(list), ==, expected->len);
+    usb_device_list_foreach(list, check_next, &check);
+    g_assert_cmpuint(check.i, ==, expected->len);
+}
+
+static void test_basic(void)
+{
+    UsbDeviceList *list = usb_device_list_new();
+    UsbDeviceInfo info = make_info(0);
+    UsbDeviceInfo *listed;
+    GPtrArray *expected = g_ptr_array_new();
+    guint i;
+
+    listed = usb_device_list_add(list, &info);
+    g_assert_nonnull(listed);
+    g_assert_true(listed != &info);
+    g_assert_cmpstr(listed->id, ==, "0");
+    g_assert_true(usb_device_list_lookup(list, FAKE_DEVICE(0)) == listed);
+    g_assert_null(usb_device_list_add(list, &info));
+    g_assert_cmpuint(usb_device_list_get_length(list), ==, 1);
+
+    g_assert_true(usb_device_list_remove(list, FAKE_DEVICE(0)));
+    g_assert_false(usb_device_list_remove(list, FAKE_DEVICE(0)));
+    g_assert_null(usb_device_list_lookup(list, FAKE_DEVICE(0)));
+    check_order(list, expected);
+
+    /* Removing from the middle keeps the order of the rest */
+    for (i = 0; i < 5; i++) {
+        info = make_info(i);
+        usb_device_list_add(list, &info);
+    }
+    usb_device_list_remove(list, FAKE_DEVICE(1));
+    usb_device_list_remove(list, FAKE_DEVICE(3));
+    info = make_info(1);
+    usb_device_list_add(list, &info);
+    g_ptr_array_add(expected, FAKE_DEVICE(0));
+    g_ptr_array_add(expected, FAKE_DEVICE(2));
+    g_ptr_array_add(expected, FAKE_DEVICE(4));
+    g_ptr_array_add(expected, FAKE_DEVICE(1));
+    check_order(list, expected);
+
+    g_ptr_array_free(expected, TRUE);
+    usb_device_list_free(list);
+}
+
+static void test_stress(void)
+{
+    UsbDeviceList *list = usb_device_list_new();
+    GPtrArray *expected = g_ptr_array_new();
+    GRand *rand = g_rand_new_with_seed(0x5b1ce);
+    guint event;
+
+    for (event = 0; event < NUM_EVENTS; event++) {
+        guint n = g_rand_int_range(rand, 0, NUM_DEVICES);
+        gboolean listed = g_ptr_array_remove(expected, FAKE_DEVICE(n));
+
+        if (listed) {
+            g_assert_true(usb_device_list_remove(list, FAKE_DEVICE(n)));
+        } else {
+            UsbDeviceInfo info = make_info(n);
+            g_assert_nonnull(usb_device_list_add(list, &info));
+            g_ptr_array_add(expected, FAKE_DEVICE(n));
+        }
+        g_assert_true((usb_device_list_lookup(list, FAKE_DEVICE(n)) != NULL) == !listed);
+        if (event % 1000 == 0)
+            check_order(list, expected);
+    }
+    check_order(list, expected);
+
+    /* Unplug everything */
+    while (expected->len > 0) {
+        g_assert_true(usb_device_list_remove(list, g_ptr_array_index(expected, 0)));
+        g_ptr_array_remove_index(expected, 0);
+    }
+    check_order(list, expected);
+
+    g_rand_free(rand);
+    g_ptr_array_free(expected, TRUE);
+    usb_device_list_free(list);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/usb-device-list/basic", test_basic);
+    g_test_add_func("/usb-device-list/stress", test_stress);
+    return g_test_run();
+}
@@ -0,0 +1,186 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/**
+ * Copyright (C) 2016 flexVDI (Flexible Software Solutions S.L.)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * USB auto-redirect rules: parsing, and the first rule that matches a device
+ * deciding, whatever bucket it is indexed in.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <glib.h>
+
+#include "usb-policy.h"
+
+static UsbPolicyDevice device(int deviceClass, int vendor, int product, int version)
+{
+    UsbPolicyDevice info;
+
+    memset(&info, 0, sizeof(info));
+    info.deviceClass = deviceClass;
+    info.vendor = vendor;
+    info.product = product;
+    info.version = version;
+    return info;
+}
+
+static UsbPolicy *compile(const char *rules, guint numRules)
+{
+    GError *err = NULL;
+    UsbPolicy *policy = usb_policy_new(rules, &err);
+
+    g_assert_null(err);
+    g_assert_nonnull(policy);
+    g_assert_cmpuint(usb_policy_get_num_rules(policy), ==, numRules);
+    return policy;
+}
+
+static void test_empty(void)
+{
+    UsbPolicyDevice info = device(0, 0x1234, 0x5678, 0x100);
+    UsbPolicy *policy = compile("", 0);
+
+    g_assert_cmpint(usb_policy_evaluate(policy, &info), ==, USB_POLICY_NO_MATCH);
+    usb_policy_free(policy);
+    policy = compile(" | |", 0);
+    g_assert_cmpint(usb_policy_evaluate(policy, &info), ==, USB_POLICY_NO_MATCH);
+    usb_policy_free(policy);
+}
+
+static void test_wildcard(void)
+{
+    UsbPolicyDevice info = device(0, 0x1234, 0x5678, 0x100);
+    UsbPolicy *policy = compile(" -1, -1 ,-1,-1, 1 |", 1);
+
+    g_assert_cmpint(usb_policy_evaluate(policy, &info), ==, USB_POLICY_ALLOW);
+    usb_policy_free(policy);
+    policy = compile("-1,-1,-1,-1,0|-1,0x1234,0x5678,-1,1", 2);
+    g_assert_cmpint(usb_policy_evaluate(policy, &info), ==, USB_POLICY_DENY);
+    usb_policy_free(policy);
+}
+
+static void test_class(void)
+{
+    UsbPolicyDevice hid = device(0x03, 0x1234, 0x0001, 0x100);
+    UsbPolicyDevice storage = device(0x00, 0x1234, 0x0002, 0x100);
+    UsbPolicyDevice composite = device(0x00, 0x4321, 0x0003, 0x100);
+    UsbPolicy *policy = compile("3,-1,-1,-1,0|-1,-1,-1,-1,1", 2);
+
+    storage.numInterfaces = 1;
+    storage.interfaceClass[0] = 0x08;
+    /* A keyboard with a smartcard reader, matched by its second interface */
+    composite.numInterfaces = 2;
+    composite.interfaceClass[0] = 0x0b;
+    composite.interfaceClass[1] = 0x03;
+
+    g_assert_cmpint(usb_policy_evaluate(policy, &hid), ==, USB_POLICY_DENY);
+    g_assert_cmpint(usb_policy_evaluate(policy, &storage), ==, USB_POLICY_ALLOW);
+    g_assert_cmpint(usb_policy_evaluate(policy, &composite), ==, USB_POLICY_DENY);
+    usb_policy_free(policy);
+
+    policy = compile("0x08,-1,-1,-1,1", 1);
+    g_assert_cmpint(usb_policy_evaluate(policy, &storage), ==, USB_POLICY_ALLOW);
+    g_assert_cmpint(usb_policy_evaluate(policy, &hid), ==, USB_POLICY_NO_MATCH);
+    usb_policy_free(policy);
+}
+
+static void test_vendor(void)
+{
+    UsbPolicyDevice ours = device(0, 0x1234, 0x0001, 0x100);
+    UsbPolicyDevice theirs = device(0, 0x4321, 0x0001, 0x100);
+    UsbPolicy *policy = compile("-1,0x1234,-1,-1,1|-1,-1,-1,-1,0", 2);
+
+    g_assert_cmpint(usb_policy_evaluate(policy, &ours), ==, USB_POLICY_ALLOW);
+    g_assert_cmpint(usb_policy_evaluate(policy, &theirs), ==, USB_POLICY_DENY);
+    usb_policy_free(policy);
+}
+
+static void test_precedence(void)
+{
+    UsbPolicyDevice exact = device(0x08, 0x1234, 0x5678, 0x100);
+    UsbPolicyDevice other = device(0x00, 0x1234, 0x0001, 0x100);
+    UsbPolicy *policy;
+
+    /* The VID:PID rule first */
+    policy = compile("-1,0x1234,0x5678,-1,0|-1,0x1234,-1,-1,1", 2);
+    g_assert_cmpint(usb_policy_evaluate(policy, &exact), ==, USB_POLICY_DENY);
+    g_assert_cmpint(usb_policy_evaluate(policy, &other), ==, USB_POLICY_ALLOW);
+    usb_policy_free(policy);
+
+    /* A vendor rule before it decides, even if the VID:PID one is more specific */
+    policy = compile("-1,0x1234,-1,-1,1|-1,0x1234,0x5678,-1,0", 2);
+    g_assert_cmpint(usb_policy_evaluate(policy, &exact), ==, USB_POLICY_ALLOW);
+    usb_policy_free(policy);
+
+    /* So does a class rule, and a wildcard one */
+    policy = compile("8,-1,-1,-1,0|-1,0x1234,0x5678,-1,1", 2);
+    g_assert_cmpint(usb_policy_evaluate(policy, &exact), ==, USB_POLICY_DENY);
+    g_assert_cmpint(usb_policy_evaluate(policy, &other), ==, USB_POLICY_NO_MATCH);
+    usb_policy_free(policy);
+    policy = compile("-1,-1,-1,-1,1|-1,0x1234,0x5678,-1,0", 2);
+    g_assert_cmpint(usb_policy_evaluate(policy, &exact), ==, USB_POLICY_ALLOW);
+    usb_policy_free(policy);
+
+    /* The version narrows a VID:PID rule */
+    policy = compile("-1,0x1234,0x5678,0x0200,1|-1,0x1234,0x5678,-1,0", 2);
+    g_assert_cmpint(usb_policy_evaluate(policy, &exact), ==, USB_POLICY_DENY);
+    exact.version = 0x200;
+    g_assert_cmpint(usb_policy_evaluate(policy, &exact), ==, USB_POLICY_ALLOW);
+    usb_policy_free(policy);
+}
+
+static void test_malformed(void)
+{
+    static const char *rules[] = {
+        "-1,-1,-1,1",                       /* Four fields */
+        "-1,-1,-1,-1,1,1",                  /* Six fields */
+        "x,-1,-1,-1,1",
+        "0x100,-1,-1,-1,1",                 /* Class out of range */
+        "-1,0x10000,-1,-1,1",               /* Vendor out of range */
+        "-1,-1,-2,-1,1",
+        "-1,-1,-1,-1,2",
+        "-1,-1,-1,-1,-1",                   /* allow cannot be a wildcard */
+        "-1,-1,-1,-1,",
+        "-1,-1,-1,-1,1|3,-1,-1,-1",         /* The second one */
+        "1 2,-1,-1,-1,1",
+    };
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS(rules); i++) {
+        GError *err = NULL;
+        g_assert_null(usb_policy_new(rules[i], &err));
+        g_assert_nonnull(err);
+        g_assert_true(err->domain == G_IO_ERROR && err->code == G_IO_ERROR_INVALID_ARGUMENT);
+        g_clear_error(&err);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/usb-policy/empty", test_empty);
+    g_test_add_func("/usb-policy/wildcard", test_wildcard);
+    g_test_add_func("/usb-policy/class", test_class);
+    g_test_add_func("/usb-policy/vendor", test_vendor);
+    g_test_add_func("/usb-policy/precedence", test_precedence);
+    g_test_add_func("/usb-policy/malformed", test_malformed);
+    return g_test_run();
+}